@@ -0,0 +1,524 @@
+#include "../hashtable.h"
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* =============================================================================
+ * Benchmark of insertion, lookup, erasure, mixed workloads, iteration and
+ * resizing for several key types, key distributions and table sizes.
+ *
+ * USAGE
+ * ./bench [ARG...]
+ * format=csv|json  Output format, csv by default.
+ * min=N            Smallest table size, 1000 by default.
+ * max=N            Largest table size, 1000000 by default. Sizes grow by a
+ *                  factor of 8 from min, so min=1000 max=1000000000 goes from
+ *                  L1-resident tables up to tables of tens of gigabytes.
+ * ops=N            Operations per lookup and mixed case, 1000000 by default.
+ * key=NAME         Only run key type u32, u64, str (pointers to 21 character
+ *                  strings) or key64 (64 byte structs). Repeatable.
+ * dist=NAME        Only run distribution sequential, random or zipfian.
+ *                  Repeatable.
+ * swiss, robin_hood, incremental, soa
+ *                  Create the tables with the corresponding flags.
+ *
+ * Latency percentiles are taken over batches of BENCH_BATCH operations, since
+ * timing every operation on its own would mostly measure the clock. The
+ * find_batch case looks up the keys of find_hit BENCH_FIND_BATCH at a time
+ * and is timed per call.
+ * ===========================================================================*/
+
+#define BENCH_BATCH         32
+#define BENCH_FIND_BATCH    256
+#define BENCH_ZIPF_THETA    0.99
+#define BENCH_WRITE_BIT     ((uint64_t)1 << 63)
+
+enum bench_dist {
+    BENCH_SEQUENTIAL,
+    BENCH_RANDOM,
+    BENCH_ZIPFIAN,
+    BENCH_NUM_DISTS
+};
+
+static const char *bench_dist_names[] = {"sequential", "random", "zipfian"};
+
+struct bench_options {
+    struct hashtable_config config;
+    int                     json;
+    size_t                  min_size;
+    size_t                  max_size;
+    size_t                  num_ops;
+    unsigned                keys;   /* Bit mask of key types to run */
+    unsigned                dists;  /* Bit mask of distributions to run */
+};
+
+struct bench_stats {
+    double  *batch_ns;  /* Nanoseconds per operation of each batch */
+    size_t  num_batches;
+    size_t  max_batches;
+    size_t  num_ops;
+    double  total_ns;
+};
+
+typedef struct {
+    uint64_t w[8];
+} key64_t;
+
+static int      bench_num_results;
+static uint64_t bench_sink;
+
+static uint64_t bench_now(void)
+{
+    struct timespec timespec;
+    clock_gettime(CLOCK_MONOTONIC, &timespec);
+    return (uint64_t)timespec.tv_sec * 1000000000ULL +
+        (uint64_t)timespec.tv_nsec;
+}
+
+static uint64_t bench_splitmix(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Bijective mixers, so distinct ids always give distinct random keys */
+static uint32_t bench_fmix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint64_t bench_fmix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Zipfian ranks as generated by YCSB (Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases"). Rank 0 is the most popular. */
+struct bench_zipf {
+    uint64_t    n;
+    double      alpha, zetan, eta, half_pow_theta;
+};
+
+static void bench_zipf_init(struct bench_zipf *zipf, uint64_t n)
+{
+    double zetan = 0;
+    for (uint64_t i = 1; i <= n; ++i)
+        zetan += 1.0 / pow((double)i, BENCH_ZIPF_THETA);
+    double zeta2 = 1.0 + pow(0.5, BENCH_ZIPF_THETA);
+    zipf->n                 = n;
+    zipf->zetan             = zetan;
+    zipf->alpha             = 1.0 / (1.0 - BENCH_ZIPF_THETA);
+    zipf->half_pow_theta    = pow(0.5, BENCH_ZIPF_THETA);
+    zipf->eta               = (1.0 - pow(2.0 / (double)n,
+        1.0 - BENCH_ZIPF_THETA)) / (1.0 - zeta2 / zetan);
+}
+
+static uint64_t bench_zipf_next(const struct bench_zipf *zipf, uint64_t *rng)
+{
+    double u    = (double)(bench_splitmix(rng) >> 11) / (double)(1ULL << 53);
+    double uz   = u * zipf->zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + zipf->half_pow_theta)
+        return 1;
+    uint64_t rank = (uint64_t)((double)zipf->n *
+        pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+/* Indices of the keys to look up, in access order. Mixed workloads mark one
+ * in ten operations as a write with BENCH_WRITE_BIT. */
+static void bench_make_accesses(uint64_t *accesses, size_t num_ops, size_t n,
+    enum bench_dist dist, const struct bench_zipf *zipf, int mixed)
+{
+    uint64_t rng = 42;
+    for (size_t i = 0; i < num_ops; ++i) {
+        uint64_t index;
+        switch (dist) {
+        case BENCH_SEQUENTIAL:  index = i % n; break;
+        case BENCH_RANDOM:      index = bench_splitmix(&rng) % n; break;
+        default:                index = bench_zipf_next(zipf, &rng); break;
+        }
+        if (mixed && bench_splitmix(&rng) % 10 == 0)
+            index |= BENCH_WRITE_BIT;
+        accesses[i] = index;
+    }
+}
+
+static void bench_stats_reset(struct bench_stats *stats)
+{
+    stats->num_batches  = 0;
+    stats->num_ops      = 0;
+    stats->total_ns     = 0;
+}
+
+static void bench_record(struct bench_stats *stats, uint64_t ns,
+    size_t num_ops)
+{
+    if (stats->num_batches < stats->max_batches)
+        stats->batch_ns[stats->num_batches++] = (double)ns / (double)num_ops;
+    stats->num_ops  += num_ops;
+    stats->total_ns += (double)ns;
+}
+
+static int bench_compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile(const struct bench_stats *stats, double p)
+{
+    size_t i = (size_t)(p * (double)(stats->num_batches - 1) + 0.5);
+    return stats->batch_ns[i];
+}
+
+static void bench_print_header(const struct bench_options *options)
+{
+    if (options->json)
+        printf("[\n");
+    else
+        printf("key,dist,flags,size,case,ops,ns_per_op,p50_ns,p90_ns,p99_ns,"
+            "max_ns,buckets,table_bytes\n");
+}
+
+static void bench_print_footer(const struct bench_options *options)
+{
+    if (options->json)
+        printf("\n]\n");
+}
+
+static void bench_print(const struct bench_options *options,
+    const char *key_name, enum bench_dist dist, size_t size,
+    const char *case_name, struct bench_stats *stats, size_t num_buckets,
+    size_t table_bytes)
+{
+    if (!stats->num_batches)
+        return;
+    qsort(stats->batch_ns, stats->num_batches, sizeof(double),
+        bench_compare_doubles);
+    double ns_per_op    = stats->total_ns / (double)stats->num_ops;
+    double p50          = bench_percentile(stats, 0.50);
+    double p90          = bench_percentile(stats, 0.90);
+    double p99          = bench_percentile(stats, 0.99);
+    double max          = stats->batch_ns[stats->num_batches - 1];
+    if (options->json)
+        printf("%s  {\"key\": \"%s\", \"dist\": \"%s\", \"flags\": %u, "
+            "\"size\": %zu, \"case\": \"%s\", \"ops\": %zu, "
+            "\"ns_per_op\": %.2f, \"p50_ns\": %.2f, \"p90_ns\": %.2f, "
+            "\"p99_ns\": %.2f, \"max_ns\": %.2f, \"buckets\": %zu, "
+            "\"table_bytes\": %zu}", bench_num_results ? ",\n" : "",
+            key_name, bench_dist_names[dist], options->config.flags, size,
+            case_name, stats->num_ops, ns_per_op, p50, p90, p99, max,
+            num_buckets, table_bytes);
+    else
+        printf("%s,%s,%u,%zu,%s,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%zu,%zu\n",
+            key_name, bench_dist_names[dist], options->config.flags, size,
+            case_name, stats->num_ops, ns_per_op, p50, p90, p99, max,
+            num_buckets, table_bytes);
+    bench_num_results++;
+    fflush(stdout);
+}
+
+/* Time body for each index in [0, num), BENCH_BATCH iterations at a time */
+#define BENCH_TIMED(stats, num, index, body) \
+    for (size_t batch__ = 0; batch__ < (num); batch__ += BENCH_BATCH) { \
+        size_t end__ = batch__ + BENCH_BATCH < (num) ? \
+            batch__ + BENCH_BATCH : (num); \
+        uint64_t start__ = bench_now(); \
+        for (size_t index = batch__; index < end__; ++index) { \
+            body \
+        } \
+        bench_record((stats), bench_now() - start__, end__ - batch__); \
+    }
+
+/* Key types. make_key() writes the key with the given id, using storage for
+ * any data the key points to. */
+static void make_u32(uint32_t *key, uint64_t id, enum bench_dist dist,
+    char *storage)
+{
+    (void)storage;
+    *key = dist == BENCH_SEQUENTIAL ? (uint32_t)id : bench_fmix32((uint32_t)id);
+}
+
+static void make_u64(uint64_t *key, uint64_t id, enum bench_dist dist,
+    char *storage)
+{
+    (void)storage;
+    *key = dist == BENCH_SEQUENTIAL ? id : bench_fmix64(id);
+}
+
+static void make_str(const char **key, uint64_t id, enum bench_dist dist,
+    char *storage)
+{
+    snprintf(storage, 24, "user:%016llx", (unsigned long long)
+        (dist == BENCH_SEQUENTIAL ? id : bench_fmix64(id)));
+    *key = storage;
+}
+
+static void make_key64(key64_t *key, uint64_t id, enum bench_dist dist,
+    char *storage)
+{
+    (void)storage;
+    key->w[0] = dist == BENCH_SEQUENTIAL ? id : bench_fmix64(id);
+    for (int i = 1; i < 8; ++i)
+        key->w[i] = key->w[i - 1] * 0x9E3779B97F4A7C15ULL + (uint64_t)i;
+}
+
+static size_t str_hash(const void *key, size_t size)
+    {(void)size; return hashtable_str_hash(*(const char**)key);}
+
+static int str_compare(const void *a, const void *b, size_t size)
+    {(void)size; return strcmp(*(const char**)a, *(const char**)b);}
+
+/* Define a table type and the benchmark function bench_NAME() running every
+ * case for one size and distribution. */
+#define BENCH_DEFINE(name, key_type, compute_hash, compare_keys, \
+    storage_size, max_keys) \
+    \
+    hashtable_define_ext(name##_table, key_type, uint64_t, compute_hash, \
+        compare_keys, hashtable_copy_key, 0); \
+    \
+    static void bench_##name(const struct bench_options *options, size_t n, \
+        enum bench_dist dist, const uint64_t *find_accesses, \
+        const uint64_t *mixed_accesses, struct bench_stats *stats) \
+    { \
+        if ((uint64_t)2 * n > (uint64_t)(max_keys)) \
+            return; \
+        /* Keys [0, n) are inserted, keys [n, 2n) are looked up as misses */ \
+        key_type    *keys       = malloc(2 * n * sizeof(key_type)); \
+        char        *storage    = malloc(2 * n * (storage_size) + 1); \
+        assert(keys && storage); \
+        for (size_t i = 0; i < 2 * n; ++i) \
+            make_##name(&keys[i], i, dist, storage + i * (storage_size)); \
+        struct name##_table table; \
+        if (name##_table_init_ext(&table, 8, &options->config)) { \
+            fprintf(stderr, "Failed to create table\n"); \
+            exit(1); \
+        } \
+        size_t  num_ops     = options->num_ops; \
+        size_t  table_bytes; \
+        \
+        bench_stats_reset(stats); \
+        BENCH_TIMED(stats, n, i, \
+            name##_table_einsert(&table, keys[i], i);) \
+        table_bytes = hashtable_num_buckets(table) * \
+            (sizeof(table._buckets[0]) + \
+            ((options->config.flags & HASHTABLE_SWISS) ? 1 : 0)); \
+        bench_print(options, #name, dist, n, "insert", stats, \
+            hashtable_num_buckets(table), table_bytes); \
+        \
+        bench_stats_reset(stats); \
+        BENCH_TIMED(stats, num_ops, i, \
+            bench_sink += *name##_table_find(&table, keys[find_accesses[i]]);) \
+        bench_print(options, #name, dist, n, "find_hit", stats, \
+            hashtable_num_buckets(table), table_bytes); \
+        \
+        /* The same lookups through find_batch(), BENCH_FIND_BATCH at a time */ \
+        bench_stats_reset(stats); \
+        { \
+            key_type *batch_keys = malloc(num_ops * sizeof(key_type)); \
+            uint64_t *batch_values[BENCH_FIND_BATCH]; \
+            assert(batch_keys); \
+            for (size_t i = 0; i < num_ops; ++i) \
+                batch_keys[i] = keys[find_accesses[i]]; \
+            for (size_t i = 0; i < num_ops; i += BENCH_FIND_BATCH) { \
+                size_t num = num_ops - i < BENCH_FIND_BATCH ? \
+                    num_ops - i : BENCH_FIND_BATCH; \
+                uint64_t start = bench_now(); \
+                bench_sink += name##_table_find_batch(&table, batch_keys + i, \
+                    num, batch_values); \
+                bench_record(stats, bench_now() - start, num); \
+            } \
+            free(batch_keys); \
+        } \
+        bench_print(options, #name, dist, n, "find_batch", stats, \
+            hashtable_num_buckets(table), table_bytes); \
+        \
+        bench_stats_reset(stats); \
+        BENCH_TIMED(stats, num_ops, i, \
+            bench_sink += name##_table_find(&table, \
+                keys[n + find_accesses[i]]) != 0;) \
+        bench_print(options, #name, dist, n, "find_miss", stats, \
+            hashtable_num_buckets(table), table_bytes); \
+        \
+        /* Nine in ten operations find a key, the rest erase a key and \
+         * insert it back */ \
+        bench_stats_reset(stats); \
+        BENCH_TIMED(stats, num_ops, i, \
+            uint64_t access = mixed_accesses[i]; \
+            key_type *key   = &keys[access & ~BENCH_WRITE_BIT]; \
+            if (access & BENCH_WRITE_BIT) { \
+                name##_table_erase(&table, *key); \
+                name##_table_einsert(&table, *key, access); \
+            } else \
+                bench_sink += *name##_table_find(&table, *key);) \
+        bench_print(options, #name, dist, n, "mixed", stats, \
+            hashtable_num_buckets(table), table_bytes); \
+        \
+        bench_stats_reset(stats); \
+        { \
+            key_type    key; \
+            uint64_t    value; \
+            uint64_t    start = bench_now(); \
+            hashtable_for_each_pair(table, key, value) \
+                bench_sink += value; \
+            bench_record(stats, bench_now() - start, n); \
+            (void)key; \
+        } \
+        bench_print(options, #name, dist, n, "iterate", stats, \
+            hashtable_num_buckets(table), table_bytes); \
+        \
+        /* Rebuilding at twice the size, per entry moved */ \
+        bench_stats_reset(stats); \
+        { \
+            uint64_t start = bench_now(); \
+            if (name##_table_rehash(&table, 2 * hashtable_num_buckets(table))) { \
+                fprintf(stderr, "Failed to rehash table\n"); \
+                exit(1); \
+            } \
+            bench_record(stats, bench_now() - start, n); \
+        } \
+        bench_print(options, #name, dist, n, "resize", stats, \
+            hashtable_num_buckets(table), table_bytes); \
+        \
+        bench_stats_reset(stats); \
+        BENCH_TIMED(stats, n, i, \
+            name##_table_erase(&table, keys[i]);) \
+        assert(hashtable_num_values(table) == 0); \
+        bench_print(options, #name, dist, n, "erase", stats, \
+            hashtable_num_buckets(table), table_bytes); \
+        \
+        name##_table_destroy(&table); \
+        free(storage); \
+        free(keys); \
+    }
+
+BENCH_DEFINE(u32, uint32_t, hashtable_hash, hashtable_compare_keys, 0,
+    (uint64_t)UINT32_MAX + 1)
+BENCH_DEFINE(u64, uint64_t, hashtable_hash, hashtable_compare_keys, 0,
+    UINT64_MAX)
+BENCH_DEFINE(str, const char *, str_hash, str_compare, 24, UINT64_MAX)
+BENCH_DEFINE(key64, key64_t, hashtable_hash, hashtable_compare_keys, 0,
+    UINT64_MAX)
+
+static const char *bench_key_names[] = {"u32", "u64", "str", "key64"};
+
+static void (*bench_functions[])(const struct bench_options *, size_t,
+    enum bench_dist, const uint64_t *, const uint64_t *,
+    struct bench_stats *) = {bench_u32, bench_u64, bench_str, bench_key64};
+
+static int bench_parse_name(const char *name, const char **names,
+    unsigned num_names, unsigned *ret_mask)
+{
+    for (unsigned i = 0; i < num_names; ++i) {
+        if (!strcmp(name, names[i])) {
+            *ret_mask |= 1u << i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_options options = {
+        .min_size   = 1000,
+        .max_size   = 1000000,
+        .num_ops    = 1000000};
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        int err = 0;
+        if (!strcmp(arg, "swiss"))
+            options.config.flags |= HASHTABLE_SWISS;
+        else if (!strcmp(arg, "robin_hood"))
+            options.config.flags |= HASHTABLE_ROBIN_HOOD;
+        else if (!strcmp(arg, "incremental"))
+            options.config.flags |= HASHTABLE_INCREMENTAL;
+        else if (!strcmp(arg, "soa"))
+            options.config.flags |= HASHTABLE_SOA;
+        else if (!strcmp(arg, "format=json"))
+            options.json = 1;
+        else if (!strcmp(arg, "format=csv"))
+            options.json = 0;
+        else if (!strncmp(arg, "min=", 4))
+            options.min_size = strtoull(arg + 4, 0, 10);
+        else if (!strncmp(arg, "max=", 4))
+            options.max_size = strtoull(arg + 4, 0, 10);
+        else if (!strncmp(arg, "ops=", 4))
+            options.num_ops = strtoull(arg + 4, 0, 10);
+        else if (!strncmp(arg, "key=", 4))
+            err = bench_parse_name(arg + 4, bench_key_names, 4, &options.keys);
+        else if (!strncmp(arg, "dist=", 5))
+            err = bench_parse_name(arg + 5, bench_dist_names, BENCH_NUM_DISTS,
+                &options.dists);
+        else
+            err = 1;
+        if (err) {
+            fprintf(stderr, "Unknown argument: %s\n", arg);
+            return 1;
+        }
+    }
+    if (!options.keys)
+        options.keys = 0xF;
+    if (!options.dists)
+        options.dists = (1u << BENCH_NUM_DISTS) - 1;
+    if (!options.min_size || !options.num_ops ||
+        options.max_size < options.min_size) {
+        fprintf(stderr, "Invalid sizes\n");
+        return 1;
+    }
+    size_t              max_ops         = options.num_ops > options.max_size ?
+        options.num_ops : options.max_size;
+    struct bench_stats  stats           = {0};
+    uint64_t            *find_accesses  = malloc(options.num_ops *
+        sizeof(uint64_t));
+    uint64_t            *mixed_accesses = malloc(options.num_ops *
+        sizeof(uint64_t));
+    stats.max_batches   = max_ops / BENCH_BATCH + 1;
+    stats.batch_ns      = malloc(stats.max_batches * sizeof(double));
+    assert(find_accesses && mixed_accesses && stats.batch_ns);
+    bench_print_header(&options);
+    for (size_t n = options.min_size; n <= options.max_size; n *= 8) {
+        for (int dist = 0; dist < BENCH_NUM_DISTS; ++dist) {
+            if (!(options.dists & (1u << dist)))
+                continue;
+            struct bench_zipf zipf;
+            if (dist == BENCH_ZIPFIAN)
+                bench_zipf_init(&zipf, n);
+            bench_make_accesses(find_accesses, options.num_ops, n, dist, &zipf,
+                0);
+            bench_make_accesses(mixed_accesses, options.num_ops, n, dist,
+                &zipf, 1);
+            for (int key = 0; key < 4; ++key) {
+                if (options.keys & (1u << key))
+                    bench_functions[key](&options, n, dist, find_accesses,
+                        mixed_accesses, &stats);
+            }
+        }
+        if (n > SIZE_MAX / 8)
+            break;
+    }
+    bench_print_footer(&options);
+    fprintf(stderr, "Checksum: %llu\n", (unsigned long long)bench_sink);
+    free(stats.batch_ns);
+    free(mixed_accesses);
+    free(find_accesses);
+    return 0;
+}
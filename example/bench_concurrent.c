@@ -0,0 +1,201 @@
+#define HASHTABLE_CONCURRENT
+#include "../hashtable.h"
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* =============================================================================
+ * Multithreaded scaling benchmark of hashtable_define_concurrent() and
+ * hashtable_define_read_mostly() tables. Every thread runs the same mix of
+ * lookups (90% by default), insertions and erasures of random keys, half of
+ * which are present. The table with a single shard behaves like a table behind
+ * one global mutex and serves as the baseline.
+ *
+ * USAGE
+ * ./bench_concurrent [ARG...]
+ * threads=N    Largest thread count, the number of online CPUs by default.
+ *              Thread counts double from 1 up to N.
+ * size=N       Number of keys the table is filled with, 1000000 by default.
+ * ops=N        Operations per thread, 2000000 by default.
+ * reads=N      Percentage of lookups, 90 by default. The other operations are
+ *              split evenly between insertions and erasures.
+ * format=csv|json
+ *              Output format, csv by default.
+ * ===========================================================================*/
+
+#define BENCH_SHARDS 64
+
+hashtable_define_concurrent(global_table, uint64_t, uint64_t, 1);
+hashtable_define_concurrent(sharded_table, uint64_t, uint64_t, BENCH_SHARDS);
+hashtable_define_read_mostly(read_mostly_table, uint64_t, uint64_t);
+
+struct bench_thread {
+    pthread_t   thread;
+    void        *table;
+    uint64_t    seed;
+    size_t      num_ops;
+    size_t      size;
+    unsigned    read_pct;
+    size_t      num_found;
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec timespec;
+    clock_gettime(CLOCK_MONOTONIC, &timespec);
+    return (uint64_t)timespec.tv_sec * 1000000000ULL +
+        (uint64_t)timespec.tv_nsec;
+}
+
+static uint64_t bench_splitmix(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Define the thread function and the run function of one table type */
+#define BENCH_DEFINE_RUN(name) \
+    static void *bench_thread_##name(void *arg) \
+    { \
+        struct bench_thread *thread = arg; \
+        struct name *table          = thread->table; \
+        uint64_t    rng             = thread->seed; \
+        size_t      num_found       = 0; \
+        for (size_t i = 0; i < thread->num_ops; ++i) { \
+            uint64_t r      = bench_splitmix(&rng); \
+            uint64_t key    = (r >> 8) % (2 * thread->size); \
+            unsigned op     = (unsigned)(r & 0xFF) % 100; \
+            if (op < thread->read_pct) \
+                num_found += name##_find(table, key, 0); \
+            else if (op % 2) \
+                name##_insert(table, key, key); \
+            else \
+                name##_erase(table, key); \
+        } \
+        thread->num_found = num_found; \
+        return 0; \
+    } \
+    \
+    static double bench_run_##name(struct bench_thread *threads, \
+        size_t num_threads, size_t size, size_t num_ops, unsigned read_pct) \
+    { \
+        struct name *table = malloc(sizeof(struct name)); \
+        assert(table); \
+        name##_einit(table, 2 * size); \
+        for (uint64_t key = 0; key < 2 * size; key += 2) \
+            name##_einsert(table, key, key); \
+        uint64_t start = bench_now(); \
+        for (size_t i = 0; i < num_threads; ++i) { \
+            threads[i].table    = table; \
+            threads[i].seed     = i + 1; \
+            threads[i].num_ops  = num_ops; \
+            threads[i].size     = size; \
+            threads[i].read_pct = read_pct; \
+            if (pthread_create(&threads[i].thread, 0, bench_thread_##name, \
+                &threads[i])) { \
+                fprintf(stderr, "Failed to create thread\n"); \
+                exit(1); \
+            } \
+        } \
+        for (size_t i = 0; i < num_threads; ++i) \
+            pthread_join(threads[i].thread, 0); \
+        double seconds = (double)(bench_now() - start) / 1e9; \
+        size_t num_values = name##_num_values(table); \
+        assert(num_values > size / 2 && num_values < 2 * size); \
+        name##_destroy(table); \
+        free(table); \
+        return seconds; \
+    }
+
+BENCH_DEFINE_RUN(global_table)
+BENCH_DEFINE_RUN(sharded_table)
+BENCH_DEFINE_RUN(read_mostly_table)
+
+int main(int argc, char **argv)
+{
+    long    num_cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t  max_threads = num_cpus > 0 ? (size_t)num_cpus : 1;
+    size_t  size        = 1000000;
+    size_t  num_ops     = 2000000;
+    unsigned read_pct   = 90;
+    int     json        = 0;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (!strncmp(arg, "threads=", 8))
+            max_threads = strtoull(arg + 8, 0, 10);
+        else if (!strncmp(arg, "size=", 5))
+            size = strtoull(arg + 5, 0, 10);
+        else if (!strncmp(arg, "ops=", 4))
+            num_ops = strtoull(arg + 4, 0, 10);
+        else if (!strncmp(arg, "reads=", 6))
+            read_pct = (unsigned)strtoul(arg + 6, 0, 10);
+        else if (!strcmp(arg, "format=json"))
+            json = 1;
+        else if (!strcmp(arg, "format=csv"))
+            json = 0;
+        else {
+            fprintf(stderr, "Unknown argument: %s\n", arg);
+            return 1;
+        }
+    }
+    if (!max_threads || !size || !num_ops || read_pct > 100) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    struct bench_thread *threads = calloc(max_threads, sizeof(*threads));
+    assert(threads);
+    const char *names[]     = {"global_mutex", "sharded", "read_mostly"};
+    unsigned    shards[]    = {1, BENCH_SHARDS, 1};
+    double      base_mops[3] = {0, 0, 0};
+    int num_results = 0;
+    if (json)
+        printf("[\n");
+    else
+        printf("table,shards,threads,ops,seconds,mops_per_sec,speedup\n");
+    for (size_t num_threads = 1;; num_threads *= 2) {
+        if (num_threads > max_threads)
+            num_threads = max_threads;
+        for (int variant = 0; variant < 3; ++variant) {
+            double seconds;
+            if (variant == 0)
+                seconds = bench_run_global_table(threads, num_threads, size,
+                    num_ops, read_pct);
+            else if (variant == 1)
+                seconds = bench_run_sharded_table(threads, num_threads, size,
+                    num_ops, read_pct);
+            else
+                seconds = bench_run_read_mostly_table(threads, num_threads,
+                    size, num_ops, read_pct);
+            size_t total_ops    = num_threads * num_ops;
+            double mops         = (double)total_ops / seconds / 1e6;
+            if (num_threads == 1)
+                base_mops[variant] = mops;
+            if (json)
+                printf("%s  {\"table\": \"%s\", \"shards\": %u, "
+                    "\"threads\": %zu, \"ops\": %zu, \"seconds\": %.4f, "
+                    "\"mops_per_sec\": %.3f, \"speedup\": %.2f}",
+                    num_results ? ",\n" : "", names[variant], shards[variant],
+                    num_threads, total_ops, seconds, mops,
+                    mops / base_mops[variant]);
+            else
+                printf("%s,%u,%zu,%zu,%.4f,%.3f,%.2f\n", names[variant],
+                    shards[variant], num_threads, total_ops, seconds, mops,
+                    mops / base_mops[variant]);
+            num_results++;
+            fflush(stdout);
+        }
+        if (num_threads == max_threads)
+            break;
+    }
+    if (json)
+        printf("\n]\n");
+    free(threads);
+    return 0;
+}
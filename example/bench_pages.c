@@ -0,0 +1,157 @@
+#include "../hashtable.h"
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* =============================================================================
+ * Benchmark of random lookups in a large table whose bucket array is allocated
+ * by calloc() or by hashtable_page_allocator() with several page options.
+ * Besides the time per lookup, the data TLB misses per lookup are counted
+ * through perf_event_open(), if the kernel allows it (see
+ * /proc/sys/kernel/perf_event_paranoid). Otherwise they are reported as -1.
+ * HASHTABLE_PAGES_HUGETLB falls back to transparent huge pages unless huge
+ * pages have been reserved, for example by
+ * echo 2048 > /proc/sys/vm/nr_hugepages
+ *
+ * USAGE
+ * ./bench_pages [ARG...]
+ * size=N           Number of keys the table is filled with, 16000000 by
+ *                  default, which takes about 512 MB of buckets.
+ * ops=N            Number of random lookups, 10000000 by default.
+ * format=csv|json  Output format, csv by default.
+ * ===========================================================================*/
+
+#define BENCH_NUM_VARIANTS 5
+
+hashtable_define(bench_table, uint64_t, uint64_t);
+
+static uint64_t bench_now(void)
+{
+    struct timespec timespec;
+    clock_gettime(CLOCK_MONOTONIC, &timespec);
+    return (uint64_t)timespec.tv_sec * 1000000000ULL +
+        (uint64_t)timespec.tv_nsec;
+}
+
+static uint64_t bench_splitmix(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Open a counter of data TLB read misses of this thread, or return -1 */
+static int bench_open_dtlb_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t  size    = 16000000;
+    size_t  num_ops = 10000000;
+    int     json    = 0;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (!strncmp(arg, "size=", 5))
+            size = strtoull(arg + 5, 0, 10);
+        else if (!strncmp(arg, "ops=", 4))
+            num_ops = strtoull(arg + 4, 0, 10);
+        else if (!strcmp(arg, "format=json"))
+            json = 1;
+        else if (!strcmp(arg, "format=csv"))
+            json = 0;
+        else {
+            fprintf(stderr, "Unknown argument: %s\n", arg);
+            return 1;
+        }
+    }
+    if (!size || !num_ops) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    const char *names[BENCH_NUM_VARIANTS] = {"calloc", "pages", "huge",
+        "hugetlb", "huge_interleave"};
+    struct hashtable_pages pages[BENCH_NUM_VARIANTS] = {
+        {0, 0},
+        {0, 0},
+        {HASHTABLE_PAGES_HUGE, 0},
+        {HASHTABLE_PAGES_HUGETLB, 0},
+        {HASHTABLE_PAGES_HUGE | HASHTABLE_PAGES_INTERLEAVE, 0}};
+    int counter = bench_open_dtlb_counter();
+    if (json)
+        printf("[\n");
+    else
+        printf("pages,size,ops,ns_per_op,dtlb_misses_per_op\n");
+    for (int variant = 0; variant < BENCH_NUM_VARIANTS; ++variant) {
+        struct hashtable_allocator  allocator   =
+            hashtable_page_allocator(&pages[variant]);
+        struct hashtable_config     config      = {0};
+        if (variant)
+            config.allocator = &allocator;
+        struct bench_table table;
+        if (bench_table_init_ext(&table, 0, &config) ||
+            bench_table_reserve(&table, size)) {
+            fprintf(stderr, "Failed to create table\n");
+            return 1;
+        }
+        for (uint64_t key = 0; key < size; ++key)
+            bench_table_einsert(&table, key, key);
+        uint64_t    rng         = 1;
+        uint64_t    sum         = 0;
+        long long   num_misses  = -1;
+        if (counter >= 0) {
+            ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        uint64_t start = bench_now();
+        for (size_t i = 0; i < num_ops; ++i) {
+            uint64_t *value = bench_table_find(&table,
+                bench_splitmix(&rng) % size);
+            sum += *value;
+        }
+        double ns = (double)(bench_now() - start) / (double)num_ops;
+        if (counter >= 0) {
+            ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counter, &num_misses, sizeof(num_misses)) !=
+                sizeof(num_misses))
+                num_misses = -1;
+        }
+        double misses = num_misses < 0 ? -1.0 :
+            (double)num_misses / (double)num_ops;
+        if (json)
+            printf("%s  {\"pages\": \"%s\", \"size\": %zu, \"ops\": %zu, "
+                "\"ns_per_op\": %.2f, \"dtlb_misses_per_op\": %.3f}",
+                variant ? ",\n" : "", names[variant], size, num_ops, ns,
+                misses);
+        else
+            printf("%s,%zu,%zu,%.2f,%.3f\n", names[variant], size, num_ops,
+                ns, misses);
+        fflush(stdout);
+        assert(sum);
+        bench_table_destroy(&table);
+    }
+    if (json)
+        printf("\n]\n");
+    if (counter >= 0)
+        close(counter);
+    return 0;
+}
@@ -0,0 +1,199 @@
+#define HASHTABLE_CONCURRENT
+#include "../hashtable.h"
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* =============================================================================
+ * Multithreaded scaling benchmark of operations over a whole table, split
+ * into ranges of bucket positions by hashtable_parallel_for():
+ * - scan:  Sums the values, through hashtable_for_each_range().
+ * - free:  Frees a heap-allocated key of every pair, followed by
+ *          hashtable_clear().
+ * - grow:  Inserts every key into an empty table whose config has
+ *          hashtable_parallel_for() as parallel_for, so that each growth
+ *          rebuilds the table on the given number of threads.
+ * - build: Builds an empty table of the same config from arrays of keys and
+ *          values through TABLE_build().
+ *
+ * USAGE
+ * ./bench_parallel [ARG...]
+ * threads=N        Largest thread count, the number of online CPUs by default.
+ *                  Thread counts double from 1 up to N.
+ * size=N           Number of keys the table is filled with, 8000000 by
+ *                  default.
+ * format=csv|json  Output format, csv by default.
+ * ===========================================================================*/
+
+hashtable_define(scan_table, uint64_t, uint64_t);
+hashtable_define(free_table, char *, uint64_t);
+
+struct bench_scan {
+    struct scan_table   *table;
+    uint64_t            sums[HASHTABLE_MAX_THREADS];
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec timespec;
+    clock_gettime(CLOCK_MONOTONIC, &timespec);
+    return (uint64_t)timespec.tv_sec * 1000000000ULL +
+        (uint64_t)timespec.tv_nsec;
+}
+
+static void bench_scan_range(void *ctx, size_t begin, size_t end,
+    unsigned thread)
+{
+    struct bench_scan   *scan   = ctx;
+    uint64_t            sum     = 0;
+    const uint64_t      *key;
+    uint64_t            *value;
+    hashtable_for_each_range(*scan->table, begin, end, key, value)
+        sum += *value;
+    (void)key;
+    scan->sums[thread] = sum;
+}
+
+static void bench_free_range(void *ctx, size_t begin, size_t end,
+    unsigned thread)
+{
+    struct free_table   *table  = ctx;
+    char *const         *key;
+    uint64_t            *value;
+    (void)thread;
+    hashtable_for_each_range(*table, begin, end, key, value)
+        free(*key);
+    (void)value;
+}
+
+int main(int argc, char **argv)
+{
+    long    num_cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t  max_threads = num_cpus > 0 ? (size_t)num_cpus : 1;
+    size_t  size        = 8000000;
+    int     json        = 0;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (!strncmp(arg, "threads=", 8))
+            max_threads = strtoull(arg + 8, 0, 10);
+        else if (!strncmp(arg, "size=", 5))
+            size = strtoull(arg + 5, 0, 10);
+        else if (!strcmp(arg, "format=json"))
+            json = 1;
+        else if (!strcmp(arg, "format=csv"))
+            json = 0;
+        else {
+            fprintf(stderr, "Unknown argument: %s\n", arg);
+            return 1;
+        }
+    }
+    if (!max_threads || !size || max_threads > HASHTABLE_MAX_THREADS) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    struct scan_table scan_table;
+    scan_table_einit(&scan_table, 0);
+    for (uint64_t key = 0; key < size; ++key)
+        scan_table_einsert(&scan_table, key, key);
+    double  base_scan   = 0;
+    double  base_free   = 0;
+    double  base_grow   = 0;
+    double  base_build  = 0;
+    uint64_t *keys = malloc(size * sizeof(uint64_t));
+    assert(keys);
+    for (uint64_t key = 0; key < size; ++key)
+        keys[key] = key;
+    int     num_results = 0;
+    if (json)
+        printf("[\n");
+    else
+        printf("op,threads,size,seconds,speedup\n");
+    for (size_t num_threads = 1;; num_threads *= 2) {
+        if (num_threads > max_threads)
+            num_threads = max_threads;
+        struct bench_scan scan;
+        memset(&scan, 0, sizeof(scan));
+        scan.table = &scan_table;
+        uint64_t start = bench_now();
+        hashtable_parallel_for(hashtable_bucket_end(scan_table),
+            (unsigned)num_threads, bench_scan_range, &scan);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < num_threads; ++i)
+            sum += scan.sums[i];
+        double scan_seconds = (double)(bench_now() - start) / 1e9;
+        assert(sum == (uint64_t)size * (size - 1) / 2);
+
+        struct free_table free_table;
+        free_table_einit(&free_table, size);
+        for (uint64_t i = 0; i < size; ++i) {
+            char *key = malloc(24);
+            assert(key);
+            sprintf(key, "%llu", (unsigned long long)i);
+            free_table_einsert(&free_table, key, i);
+        }
+        start = bench_now();
+        hashtable_parallel_for(hashtable_bucket_end(free_table),
+            (unsigned)num_threads, bench_free_range, &free_table);
+        free_table_clear(&free_table);
+        double free_seconds = (double)(bench_now() - start) / 1e9;
+        free_table_destroy(&free_table);
+
+        struct hashtable_config config = {0};
+        config.parallel_for = hashtable_parallel_for;
+        config.num_threads  = (unsigned)num_threads;
+        struct scan_table grow_table;
+        scan_table_einit_ext(&grow_table, 0, &config);
+        start = bench_now();
+        for (uint64_t key = 0; key < size; ++key)
+            scan_table_einsert(&grow_table, key, key);
+        double grow_seconds = (double)(bench_now() - start) / 1e9;
+        assert(hashtable_num_values(grow_table) == size);
+        scan_table_destroy(&grow_table);
+
+        scan_table_einit_ext(&grow_table, 0, &config);
+        start = bench_now();
+        if (scan_table_build(&grow_table, keys, keys, size,
+            HASHTABLE_BUILD_UNIQUE)) {
+            fprintf(stderr, "Failed to build table\n");
+            return 1;
+        }
+        double build_seconds = (double)(bench_now() - start) / 1e9;
+        assert(hashtable_num_values(grow_table) == size);
+        scan_table_destroy(&grow_table);
+
+        if (num_threads == 1) {
+            base_scan   = scan_seconds;
+            base_free   = free_seconds;
+            base_grow   = grow_seconds;
+            base_build  = build_seconds;
+        }
+        const char  *names[4]   = {"scan", "free", "grow", "build"};
+        double      seconds[4]  = {scan_seconds, free_seconds, grow_seconds,
+            build_seconds};
+        double      base[4]     = {base_scan, base_free, base_grow,
+            base_build};
+        for (int op = 0; op < 4; ++op) {
+            if (json)
+                printf("%s  {\"op\": \"%s\", \"threads\": %zu, "
+                    "\"size\": %zu, \"seconds\": %.4f, \"speedup\": %.2f}",
+                    num_results ? ",\n" : "", names[op], num_threads, size,
+                    seconds[op], base[op] / seconds[op]);
+            else
+                printf("%s,%zu,%zu,%.4f,%.2f\n", names[op], num_threads,
+                    size, seconds[op], base[op] / seconds[op]);
+            num_results++;
+        }
+        fflush(stdout);
+        if (num_threads == max_threads)
+            break;
+    }
+    if (json)
+        printf("\n]\n");
+    scan_table_destroy(&scan_table);
+    free(keys);
+    return 0;
+}
@@ -1,9 +1,13 @@
+#define HASHTABLE_CONCURRENT
 #include "../hashtable.h"
 #include <stdio.h>
 #include <time.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 typedef long long unsigned llu_t;
 
@@ -17,6 +21,138 @@ typedef struct {
     int val;
 } entry_t;
 
+static size_t str_hash(const void *key, size_t size)
+    {(void)size; return hashtable_str_hash(*(const char**)key);}
+
+static int str_compare(const void *a, const void *b, size_t size)
+    {(void)size; return strcmp(*(const char**)a, *(const char**)b);}
+
+hashtable_define_ext(str_table, const char *, uint32_t, str_hash, str_compare,
+    hashtable_copy_key, 0);
+hashtable_define_str(sso_table, uint32_t);
+hashtable_define_ext(view_table, struct hashtable_str_view, uint32_t,
+    hashtable_str_view_hash, hashtable_str_view_compare,
+    hashtable_str_view_copy, hashtable_str_view_free);
+hashtable_define(id_table, uint64_t, uint32_t);
+hashtable_define_concurrent(shared_table, uint64_t, uint64_t, 16);
+hashtable_define_read_mostly(route_table, uint64_t, uint64_t);
+
+#define TEST_THREADS    4
+#define TEST_KEYS       20000
+
+struct test_thread {
+    pthread_t           thread;
+    unsigned            index;
+    struct shared_table *shared;
+    struct route_table  *routes;
+    size_t              num_values;
+    int                 *done;
+};
+
+static uint64_t test_splitmix(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Inserts, erases and finds keys congruent to the thread's index, which no
+ * other thread touches, and checks each result against a reference copy */
+static void *test_shared_thread(void *arg)
+{
+    struct test_thread  *thread     = arg;
+    uint64_t            *reference  = calloc(TEST_KEYS, sizeof(uint64_t));
+    uint64_t            rng         = thread->index + 1;
+    assert(reference);
+    for (int i = 0; i < 20 * TEST_KEYS; ++i) {
+        uint64_t r      = test_splitmix(&rng);
+        uint64_t slot   = (r >> 8) % TEST_KEYS;
+        uint64_t key    = slot * TEST_THREADS + thread->index;
+        uint64_t value;
+        switch (r % 4) {
+        case 0:
+        case 1:
+            if (!shared_table_find(thread->shared, key, &value))
+                value = 0;
+            assert(value == reference[slot]);
+            break;
+        case 2:
+            if (!reference[slot])
+                reference[slot] = r | 1;
+            shared_table_insert(thread->shared, key, r | 1);
+            break;
+        default:
+            shared_table_erase(thread->shared, key);
+            reference[slot] = 0;
+        }
+    }
+    thread->num_values = 0;
+    for (uint64_t slot = 0; slot < TEST_KEYS; ++slot) {
+        uint64_t value;
+        uint64_t key = slot * TEST_THREADS + thread->index;
+        int found = shared_table_find(thread->shared, key, &value);
+        assert(found == !!reference[slot]);
+        assert(!found || value == reference[slot]);
+        thread->num_values += found;
+    }
+    free(reference);
+    return 0;
+}
+
+/* Looks keys up until the writer is done. Every value the writer inserts is
+ * derived from its key, so any other value was read from a torn bucket. */
+static void *test_route_reader(void *arg)
+{
+    struct test_thread  *thread = arg;
+    uint64_t            rng     = thread->index + 1;
+    while (!__atomic_load_n(thread->done, __ATOMIC_ACQUIRE)) {
+        uint64_t key = test_splitmix(&rng) % TEST_KEYS;
+        uint64_t value;
+        if (route_table_find(thread->routes, key, &value)) {
+            assert(value == key * 3 + 1);
+            thread->num_values++;
+        }
+    }
+    return 0;
+}
+
+/* Counts the arrays of a table, to check that read-mostly tables free the
+ * arrays they retain for readers when destroyed */
+static void *test_count_alloc(void *ctx, size_t size)
+{
+    ++*(long*)ctx;
+    return malloc(size);
+}
+
+static void test_count_release(void *ctx, void *ptr)
+{
+    --*(long*)ctx;
+    free(ptr);
+}
+
+/* Fails to copy every seventh uint32_t key, like an allocating copy_key that
+ * runs out of memory */
+static int test_failing_copy(void *dst, const void *src, size_t size)
+{
+    uint32_t key;
+    memcpy(&key, src, sizeof(key));
+    if (key % 7 == 3)
+        return 1;
+    memcpy(dst, src, size);
+    return 0;
+}
+
+/* Stands in for threads by calling fn for 16 ranges in reverse order */
+static void reverse_parallel_for(size_t end, unsigned num_threads,
+    void (*fn)(void *ctx, size_t begin, size_t end, unsigned thread),
+    void *ctx)
+{
+    (void)num_threads;
+    for (unsigned i = 16; i-- > 0;)
+        fn(ctx, end * i / 16, end * (i + 1) / 16, i);
+}
+
 int get_monotonic_time(sys_time_t *ret_time)
 {
     struct timespec timespec;
@@ -29,11 +165,35 @@ int get_monotonic_time(sys_time_t *ret_time)
 
 int main(int argc, char **argv)
 {
+    /* Pass "swiss", "robin_hood", "incremental" or "soa" as arguments to run
+     * on tables created with the corresponding flags, and "load_factor=N" or
+     * "growth_factor=N" to set the config fields */
+    struct hashtable_config config = {0};
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "swiss"))
+            config.flags |= HASHTABLE_SWISS;
+        else if (!strcmp(argv[i], "robin_hood"))
+            config.flags |= HASHTABLE_ROBIN_HOOD;
+        else if (!strcmp(argv[i], "incremental"))
+            config.flags |= HASHTABLE_INCREMENTAL;
+        else if (!strcmp(argv[i], "soa"))
+            config.flags |= HASHTABLE_SOA;
+        else if (!strncmp(argv[i], "load_factor=", 12))
+            config.load_factor = (unsigned)atoi(argv[i] + 12);
+        else if (!strncmp(argv[i], "growth_factor=", 14))
+            config.growth_factor = (unsigned)atoi(argv[i] + 14);
+    }
     sys_time_t start_time, end_time;
     if (get_monotonic_time(&start_time))
         return 1;
     hashtable(uint32_t, int) table;
-    hashtable_init(table, 8, 0);
+    int init_err;
+    hashtable_init_ext(table, 8, &config, &init_err);
+    if (init_err) {
+        /* Such as "soa incremental", which no engine supports */
+        printf("Config rejected\n");
+        return 0;
+    }
     uint32_t num_items = 1000000;
     for (uint32_t i = 0; i < num_items; ++i) {
         int v = (int)i;
@@ -68,6 +228,31 @@ int main(int argc, char **argv)
     for (int i = 0; i < num_iterations; ++i) {
         assert(entries[i].found);
     }
+    free(entries);
+    const uint32_t  *key_ref;
+    int             *value_ref;
+    size_t          num_refs    = 0;
+    hashtable_for_each_ref(table, key_ref, value_ref) {
+        assert((int)*key_ref == *value_ref);
+        *value_ref = -*value_ref;
+        num_refs++;
+    }
+    assert(num_refs == num_items);
+    /* Uneven ranges that together cover every bucket position */
+    num_refs = 0;
+    for (size_t begin = 0, step = 1; begin < hashtable_bucket_end(table);
+        begin += step, step = step * 3 + 1) {
+        hashtable_for_each_range(table, begin, begin + step, key_ref,
+            value_ref) {
+            assert((int)*key_ref == -*value_ref);
+            num_refs++;
+        }
+    }
+    assert(num_refs == num_items);
+    for (uint32_t i = 0; i < num_items; ++i) {
+        int *value = hashtable_find(table, i, hashtable_hash(&i, sizeof(i)));
+        assert(value && *value == -(int)i);
+    }
     uint32_t num_failed_erases = 0;
     for (uint32_t i = 0; i < num_items; ++i) {
         size_t num_values = hashtable_num_values(table);
@@ -90,5 +275,534 @@ int main(int argc, char **argv)
         num_failed_erases, num_buckets, num_iterations);
     printf("Time: %llu ms\n", end_ms - start_ms);
     hashtable_clear(table, 0);
+
+    /* String keys, found once each and then looked up as misses */
+    if (get_monotonic_time(&start_time))
+        return 1;
+    char (*strs)[16] = malloc(2 * (size_t)num_items * sizeof(*strs));
+    for (uint32_t i = 0; i < 2 * num_items; ++i)
+        sprintf(strs[i], "key-%u", i);
+    struct str_table str_table;
+    str_table_einit_ext(&str_table, 8, &config);
+    for (uint32_t i = 0; i < num_items; ++i)
+        str_table_einsert(&str_table, strs[i], i);
+#ifdef HASHTABLE_STATS
+    memset(&hashtable_stats, 0, sizeof(hashtable_stats));
+#endif
+    uint32_t num_str_found = 0;
+    for (uint32_t i = 0; i < 2 * num_items; ++i) {
+        uint32_t *value = str_table_find(&str_table, strs[i]);
+        assert(!value == (i >= num_items));
+        if (value && *value == i)
+            num_str_found++;
+    }
+    str_table_destroy(&str_table);
+    free(strs);
+    if (get_monotonic_time(&end_time))
+        return 2;
+    start_ms  = (llu_t)start_time.sec * 1000ULL + (llu_t)start_time.msec;
+    end_ms    = (llu_t)end_time.sec * 1000ULL + (llu_t)end_time.msec;
+    printf("Number of string keys found: %u/%u\n", num_str_found, num_items);
+#ifdef HASHTABLE_STATS
+    printf("String key comparisons: %lu\n"
+        "String key comparisons avoided by hash: %lu\n",
+        hashtable_stats.num_key_compares, hashtable_stats.num_hash_rejects);
+#endif
+    printf("String time: %llu ms\n", end_ms - start_ms);
+
+    /* Capacity management */
+    uint32_t num_reserved = 10000;
+    int err;
+    hashtable_init_ext(table, 8, &config, &err);
+    assert(!err);
+    hashtable_reserve(table, num_reserved, &err);
+    assert(!err);
+    num_buckets = hashtable_num_buckets(table);
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        v = (int)i;
+        hashtable_einsert(table, i, hashtable_hash(&i, sizeof(i)), v);
+    }
+    assert(hashtable_num_buckets(table) == num_buckets);
+    for (uint32_t i = 100; i < num_reserved; ++i)
+        hashtable_erase(table, i, hashtable_hash(&i, sizeof(i)));
+    hashtable_shrink_to_fit(table, &err);
+    assert(!err && hashtable_num_buckets(table) < num_buckets);
+    hashtable_rehash(table, 4 * num_buckets, &err);
+    assert(!err && hashtable_num_buckets(table) == 4 * num_buckets);
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        int *value = hashtable_find(table, i, hashtable_hash(&i, sizeof(i)));
+        assert(!value == (i >= 100));
+        assert(!value || *value == (int)i);
+    }
+    printf("Buckets reserved for %u values: %lu\n", num_reserved,
+        num_buckets);
+    hashtable_destroy(table, 0);
+
+    /* Batched insertion and lookup, with keys 0-99 already present */
+    uint32_t    *batch_keys     = malloc(2 * num_reserved * sizeof(uint32_t));
+    size_t      *batch_hashes   = malloc(2 * num_reserved * sizeof(size_t));
+    int         *batch_values   = malloc(2 * num_reserved * sizeof(int));
+    void        **batch_found   = malloc(2 * num_reserved * sizeof(void*));
+    assert(batch_keys && batch_hashes && batch_values && batch_found);
+    hashtable_init_ext(table, 0, &config, 0);
+    for (uint32_t i = 0; i < 2 * num_reserved; ++i) {
+        batch_keys[i]   = i;
+        batch_hashes[i] = hashtable_hash(&i, sizeof(i));
+        batch_values[i] = (int)i;
+    }
+    hashtable_insert_batch(table, batch_keys, batch_hashes, batch_values, 100,
+        &err);
+    hashtable_insert_batch(table, batch_keys, batch_hashes, batch_values,
+        num_reserved, &err);
+    assert(!err && hashtable_num_values(table) == num_reserved);
+    size_t num_batch_found = hashtable_find_batch(table, batch_keys,
+        batch_hashes, 2 * num_reserved, batch_found);
+    assert(num_batch_found == num_reserved);
+    for (uint32_t i = 0; i < 2 * num_reserved; ++i) {
+        assert(!batch_found[i] == (i >= num_reserved));
+        assert(!batch_found[i] || *(int*)batch_found[i] == (int)i);
+    }
+    hashtable_destroy(table, 0);
+    free(batch_keys);
+    free(batch_hashes);
+    free(batch_values);
+    free(batch_found);
+
+    /* A string table whose buckets and keys are released with their arena */
+    struct hashtable_arena      arena;
+    hashtable_arena_init(&arena, 4096);
+    struct hashtable_allocator  allocator   = hashtable_arena_allocator(&arena);
+    struct hashtable_config     arena_config = config;
+    arena_config.allocator = &allocator;
+    str_table_einit_ext(&str_table, 0, &arena_config);
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        char str[16];
+        sprintf(str, "key-%u", i);
+        const char *key = hashtable_arena_strdup(&arena, str);
+        assert(key);
+        str_table_einsert(&str_table, key, i);
+    }
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        char str[16];
+        sprintf(str, "key-%u", i);
+        uint32_t *value = str_table_find(&str_table, str);
+        assert(value && *value == i);
+    }
+
+    /* Lookups by views of a longer string and by precomputed hashes */
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        char str[24];
+        int len = sprintf(str, "key-%u-suffix", i) - 7;
+        struct hashtable_str_view view = hashtable_str_view(str, (size_t)len);
+        size_t hash = hashtable_str_view_hash(&view, sizeof(view));
+        uint32_t *value = str_table_find_by(&str_table, &view, sizeof(view),
+            hash, hashtable_str_compare_view);
+        assert(value && *value == i);
+        const char *key = str;
+        str[len] = 0;
+        assert(str_table_hash(key) == hash);
+        assert(str_table_find_hashed(&str_table, key, hash) == value);
+        view.len--;
+        assert(!hashtable_exists_by(str_table, &view, sizeof(view),
+            hashtable_str_view_hash(&view, sizeof(view)),
+            hashtable_str_compare_view) || i >= 10);
+    }
+    for (uint32_t i = 0; i < num_reserved; i += 2) {
+        char str[16];
+        struct hashtable_str_view view = hashtable_str_view(str,
+            (size_t)sprintf(str, "key-%u", i));
+        hashtable_erase_by(str_table, &view, sizeof(view),
+            hashtable_str_view_hash(&view, sizeof(view)),
+            hashtable_str_compare_view, 0);
+    }
+    assert(hashtable_num_values(str_table) == num_reserved / 2);
+    hashtable_arena_release(&arena);
+
+    /* Built-in string keys, short ones inline and long ones spilled */
+    struct sso_table sso_table;
+    sso_table_einit_ext(&sso_table, 0, &config);
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        char str[48];
+        int len = sprintf(str, i % 2 ? "key-%u" : "a-much-longer-key-%u", i);
+        sso_table_einsert(&sso_table, str, (size_t)len, i);
+        assert(sso_table_insert(&sso_table, str, (size_t)len, i) == 2);
+    }
+    for (uint32_t i = 0; i < num_reserved; i += 4) {
+        char str[48];
+        int len = sprintf(str, i % 2 ? "key-%u" : "a-much-longer-key-%u", i);
+        sso_table_erase(&sso_table, str, (size_t)len);
+    }
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        char str[48];
+        int len = sprintf(str, i % 2 ? "key-%u" : "a-much-longer-key-%u", i);
+        uint32_t *value = sso_table_find(&sso_table, str, (size_t)len);
+        assert(!value == !(i % 4));
+        assert(!value || *value == i);
+        assert(!sso_table_exists(&sso_table, str + 1, (size_t)len - 1));
+    }
+    struct hashtable_str sso_key;
+    uint32_t sso_value;
+    num_iterations = 0;
+    hashtable_for_each_pair(sso_table, sso_key, sso_value) {
+        char str[48];
+        int len = sprintf(str, sso_value % 2 ? "key-%u" :
+            "a-much-longer-key-%u", sso_value);
+        assert(hashtable_str_len(&sso_key) == (size_t)len);
+        assert(!memcmp(hashtable_str_data(&sso_key), str, (size_t)len));
+        num_iterations++;
+    }
+    assert(num_iterations == num_reserved - num_reserved / 4);
+    sso_table_destroy(&sso_table);
+
+    /* String views into a buffer of keys without terminating nulls */
+    char    *view_buffer    = malloc(16 * (size_t)num_reserved);
+    size_t  *view_offsets   = malloc((num_reserved + 1) * sizeof(size_t));
+    assert(view_buffer && view_offsets);
+    view_offsets[0] = 0;
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        char str[16];
+        int len = sprintf(str, "%u", i);
+        memcpy(view_buffer + view_offsets[i], str, (size_t)len);
+        view_offsets[i + 1] = view_offsets[i] + (size_t)len;
+    }
+    struct view_table view_table;
+    view_table_einit_ext(&view_table, 0, &config);
+    for (uint32_t i = 0; i < num_reserved; ++i)
+        view_table_einsert(&view_table, hashtable_str_view(
+            view_buffer + view_offsets[i], view_offsets[i + 1] -
+            view_offsets[i]), i);
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        struct hashtable_str_view key = hashtable_str_view(
+            view_buffer + view_offsets[i],
+            view_offsets[i + 1] - view_offsets[i]);
+        uint32_t *value = view_table_find(&view_table, key);
+        assert(value && *value == i);
+        /* The view extended by the next key's first digit */
+        key.len++;
+        value = view_table_find(&view_table, key);
+        assert(!value || *value != i);
+        view_table_erase(&view_table, hashtable_str_view(
+            view_buffer + view_offsets[i], view_offsets[i + 1] -
+            view_offsets[i]));
+    }
+    assert(!hashtable_num_values(view_table));
+    view_table_destroy(&view_table);
+    free(view_buffer);
+    free(view_offsets);
+
+    /* Bucket arrays mapped on huge pages, growing past 2 MB */
+    struct hashtable_pages  pages           = {HASHTABLE_PAGES_HUGE, 0};
+    struct hashtable_config pages_config    = config;
+    allocator               = hashtable_page_allocator(&pages);
+    pages_config.allocator  = &allocator;
+    hashtable_init_ext(table, 0, &pages_config, &err);
+    assert(!err);
+    for (uint32_t i = 0; i < 20 * num_reserved; ++i) {
+        v = (int)i;
+        hashtable_einsert(table, i, hashtable_hash(&i, sizeof(i)), v);
+    }
+    for (uint32_t i = 0; i < 20 * num_reserved; ++i) {
+        int *value = hashtable_find(table, i, hashtable_hash(&i, sizeof(i)));
+        assert(value && *value == (int)i);
+    }
+    hashtable_destroy(table, 0);
+
+    /* Growth past 65536 buckets rebuilt in ranges by parallel_for */
+    struct hashtable_config parallel_config = config;
+    parallel_config.parallel_for = reverse_parallel_for;
+    hashtable_init_ext(table, 0, &parallel_config, &err);
+    assert(!err);
+    for (uint32_t i = 0; i < 50 * num_reserved; ++i) {
+        v = (int)i;
+        hashtable_einsert(table, i, hashtable_hash(&i, sizeof(i)), v);
+    }
+    for (uint32_t i = 0; i < 50 * num_reserved; ++i) {
+        int *value = hashtable_find(table, i, hashtable_hash(&i, sizeof(i)));
+        assert(value && *value == (int)i);
+    }
+    for (uint32_t i = 0; i < 50 * num_reserved; i += 2)
+        hashtable_erase(table, i, hashtable_hash(&i, sizeof(i)));
+    hashtable_rehash(table, 4 * hashtable_num_buckets(table), &err);
+    assert(!err && hashtable_num_values(table) == 25 * num_reserved);
+    for (uint32_t i = 0; i < 50 * num_reserved; ++i)
+        assert(hashtable_exists(table, i, hashtable_hash(&i, sizeof(i))) ==
+            (int)(i % 2));
+    hashtable_destroy(table, 0);
+
+    /* Bulk builds of keys that all occur twice, serial and in ranges */
+    size_t      num_build   = 50 * (size_t)num_reserved;
+    uint32_t    *build_keys     = malloc(2 * num_build * sizeof(uint32_t));
+    size_t      *build_hashes   = malloc(2 * num_build * sizeof(size_t));
+    int         *build_values   = malloc(2 * num_build * sizeof(int));
+    assert(build_keys && build_hashes && build_values);
+    for (size_t i = 0; i < 2 * num_build; ++i) {
+        build_keys[i]   = (uint32_t)(i % num_build);
+        build_hashes[i] = hashtable_hash(&build_keys[i], sizeof(uint32_t));
+        build_values[i] = (int)i;
+    }
+    for (unsigned policy = 0; policy < 6; ++policy) {
+        hashtable_init_ext(table, 0, policy < 3 ? &config : &parallel_config,
+            &err);
+        assert(!err);
+        hashtable_build(table, build_keys, build_hashes, build_values,
+            2 * num_build, policy % 3, &err);
+        assert(err == (policy % 3 == HASHTABLE_BUILD_UNIQUE ? 2 : 0));
+        assert(hashtable_num_values(table) == num_build);
+        for (uint32_t i = 0; i < num_build; ++i) {
+            int *value = hashtable_find(table, i,
+                hashtable_hash(&i, sizeof(i)));
+            assert(value && *value == (int)(policy % 3 ==
+                HASHTABLE_BUILD_KEEP_LAST ? i + num_build : i));
+        }
+        hashtable_destroy(table, 0);
+    }
+    /* Failed copies and zero hashes, handled alike by both paths */
+    for (int parallel = 0; parallel < 2; ++parallel) {
+        hashtable_init_ext(table, 0, parallel ? &parallel_config : &config,
+            &err);
+        assert(!err);
+        hashtable_build_ext(table, build_keys, build_hashes, build_values,
+            num_build, HASHTABLE_BUILD_KEEP_FIRST, hashtable_compare_keys,
+            test_failing_copy, &err);
+        assert(err == 3);
+        for (uint32_t i = 0; i < num_build; ++i)
+            assert(hashtable_exists(table, i, build_hashes[i]) == (i % 7 != 3));
+        hashtable_destroy(table, 0);
+        hashtable_init_ext(table, 0, parallel ? &parallel_config : &config,
+            &err);
+        assert(!err);
+        build_hashes[num_build - 1] = 0;
+        hashtable_build(table, build_keys, build_hashes, build_values,
+            num_build, HASHTABLE_BUILD_KEEP_FIRST, &err);
+        assert(err == 1 && hashtable_num_values(table) == 0);
+        build_hashes[num_build - 1] = hashtable_hash(
+            &build_keys[num_build - 1], sizeof(uint32_t));
+        hashtable_destroy(table, 0);
+    }
+    free(build_keys);
+    free(build_hashes);
+    free(build_values);
+    const char *build_strs[] = {"a", "b", "c", "a"};
+    uint32_t    build_ids[] = {0, 1, 2, 3};
+    str_table_einit_ext(&str_table, 0, &config);
+    assert(!str_table_build(&str_table, build_strs, build_ids, 4,
+        HASHTABLE_BUILD_KEEP_LAST));
+    assert(hashtable_num_values(str_table) == 3);
+    assert(*str_table_find(&str_table, "a") == 3);
+    assert(str_table_build(&str_table, build_strs, build_ids, 2,
+        HASHTABLE_BUILD_UNIQUE) == 2);
+    str_table_destroy(&str_table);
+
+    /* The one 64-bit key whose hash folds to 0, which marks a free bucket */
+    uint64_t zero_key = 0xA0761D6478BD642FULL;
+    assert(hashtable_hash(&zero_key, sizeof(zero_key)));
+    hashtable(uint64_t, int) wide_keys;
+    hashtable_init_ext(wide_keys, 0, &config, &err);
+    assert(!err);
+    v = 1;
+    hashtable_insert(wide_keys, zero_key, hashtable_hash_u64(zero_key), v,
+        &err);
+    int *zero_value = hashtable_find(wide_keys, zero_key,
+        hashtable_hash_u64(zero_key));
+    assert(!err && zero_value && *zero_value == 1);
+    hashtable_destroy(wide_keys, 0);
+
+    /* A table zeroed instead of initialized, then reused after destroying */
+    hashtable(uint32_t, int) zeroed = {0};
+    for (int round = 0; round < 2; ++round) {
+        for (uint32_t i = 0; i < num_reserved; ++i) {
+            v = (int)i;
+            hashtable_insert(zeroed, i, hashtable_hash(&i, sizeof(i)), v,
+                &err);
+            assert(!err);
+        }
+        assert(hashtable_num_values(zeroed) == num_reserved);
+        for (uint32_t i = 0; i < num_reserved; ++i) {
+            int *value = hashtable_find(zeroed, i,
+                hashtable_hash(&i, sizeof(i)));
+            assert(value && *value == (int)i);
+        }
+        hashtable_destroy(zeroed, 0);
+    }
+
+    /* Growth factors bucket counts cannot honour are rejected at init */
+    const unsigned growth_factors[] = {150, 300, 50000, 400};
+    for (int i = 0; i < 4; ++i) {
+        struct hashtable_config growth_config = config;
+        growth_config.growth_factor = growth_factors[i];
+        hashtable_init_ext(table, 64, &growth_config, &err);
+        assert(err == (i < 3));
+        if (err)
+            continue;
+        size_t num_initial = hashtable_num_buckets(table);
+        for (uint32_t j = 0; j < num_initial; ++j) {
+            v = (int)j;
+            hashtable_einsert(table, j, hashtable_hash(&j, sizeof(j)), v);
+        }
+        assert(hashtable_num_buckets(table) == 4 * num_initial);
+        hashtable_destroy(table, 0);
+    }
+
+    /* Threads modifying disjoint keys of a sharded table, then readers of a
+     * read-mostly table that a writer grows, erases from and clears */
+    struct test_thread  threads[TEST_THREADS];
+    struct shared_table shared;
+    assert(!shared_table_init_ext(&shared, 0, &config));
+    for (unsigned i = 0; i < TEST_THREADS; ++i) {
+        threads[i].index    = i;
+        threads[i].shared   = &shared;
+        assert(!pthread_create(&threads[i].thread, 0, test_shared_thread,
+            &threads[i]));
+    }
+    size_t num_shared = 0;
+    for (unsigned i = 0; i < TEST_THREADS; ++i) {
+        pthread_join(threads[i].thread, 0);
+        num_shared += threads[i].num_values;
+    }
+    assert(shared_table_num_values(&shared) == num_shared);
+    shared_table_destroy(&shared);
+    long                        num_arrays      = 0;
+    struct hashtable_allocator  counter         = {test_count_alloc,
+        test_count_release, &num_arrays, 0};
+    struct hashtable_config     route_config    = config;
+    route_config.flags      &= ~HASHTABLE_INCREMENTAL;
+    route_config.allocator  = &counter;
+    struct route_table routes;
+    int done = 0;
+    assert(!route_table_init_ext(&routes, 0, &route_config));
+    for (unsigned i = 0; i < TEST_THREADS; ++i) {
+        threads[i].index        = i;
+        threads[i].routes       = &routes;
+        threads[i].num_values   = 0;
+        threads[i].done         = &done;
+        assert(!pthread_create(&threads[i].thread, 0, test_route_reader,
+            &threads[i]));
+    }
+    for (int round = 0; round < 4; ++round) {
+        for (uint64_t key = 0; key < TEST_KEYS; ++key)
+            route_table_einsert(&routes, key, key * 3 + 1);
+        for (uint64_t key = round % 2; key < TEST_KEYS; key += 2)
+            route_table_erase(&routes, key);
+        assert(route_table_num_values(&routes) == TEST_KEYS / 2);
+        route_table_clear(&routes);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    for (unsigned i = 0; i < TEST_THREADS; ++i)
+        pthread_join(threads[i].thread, 0);
+    assert(num_arrays > 1);
+    route_table_destroy(&routes);
+    assert(num_arrays == 0);
+
+    /* Saved tables, mapped read-only, mapped copy-on-write and read */
+    char table_path[64];
+    snprintf(table_path, sizeof(table_path), "/tmp/hashtable_test_%ld.bin",
+        (long)getpid());
+    size_t hash_id = hashtable_hash_id(sizeof(uint32_t));
+    hashtable_init_ext(table, 0, &config, &err);
+    assert(!err);
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        v = (int)i;
+        hashtable_einsert(table, i, hashtable_hash(&i, sizeof(i)), v);
+    }
+    for (uint32_t i = 0; i < num_reserved; i += 3)
+        hashtable_erase(table, i, hashtable_hash(&i, sizeof(i)));
+    hashtable_save(table, table_path, hash_id, &err);
+    assert(!err);
+    size_t num_saved = hashtable_num_values(table);
+    hashtable_destroy(table, 0);
+    const unsigned load_flags[] = {0, HASHTABLE_LOAD_WRITABLE,
+        HASHTABLE_LOAD_COPY | HASHTABLE_LOAD_VERIFY};
+    for (int mode = 0; mode < 3; ++mode) {
+        hashtable_load(table, table_path, hash_id, load_flags[mode], 0, &err);
+        assert(!err && hashtable_num_values(table) == num_saved);
+        for (uint32_t i = 0; i < num_reserved; ++i) {
+            int *value = hashtable_find(table, i,
+                hashtable_hash(&i, sizeof(i)));
+            assert(!value == (i % 3 == 0));
+            assert(!value || *value == (int)i);
+        }
+#ifdef __linux__
+        if (!mode) {
+            /* A read-only mapping rejects every change */
+            uint32_t key = 0;
+            size_t hash = hashtable_hash(&key, sizeof(key));
+            hashtable_insert(table, key, hash, v, &err);
+            assert(err == 1);
+            assert(hashtable_erase(table, key, hash) == 1);
+            assert(hashtable_clear(table, 0) == 1);
+            hashtable_rehash(table, 0, &err);
+            assert(err == 1);
+            hashtable_build(table, &key, &hash, &v, 1,
+                HASHTABLE_BUILD_KEEP_FIRST, &err);
+            assert(err == 1);
+        }
+#endif
+        for (uint32_t i = num_reserved; mode && i < 4 * num_reserved; ++i) {
+            v = (int)i;
+            hashtable_einsert(table, i, hashtable_hash(&i, sizeof(i)), v);
+        }
+        assert(hashtable_num_values(table) ==
+            (mode ? num_saved + 3 * (size_t)num_reserved : num_saved));
+        hashtable_destroy(table, 0);
+    }
+    hashtable_load(table, table_path, hash_id + 1, 0, 0, &err);
+    assert(err == 1);
+    hashtable(uint64_t, int) wide_table;
+    hashtable_load(wide_table, table_path, 0, 0, 0, &err);
+    assert(err == 1);
+    struct id_table id_table;
+    id_table_einit_ext(&id_table, 0, &config);
+    for (uint64_t i = 0; i < num_reserved; ++i)
+        id_table_einsert(&id_table, i << 32, (uint32_t)i);
+    assert(!id_table_save(&id_table, table_path));
+    id_table_destroy(&id_table);
+    assert(!id_table_load(&id_table, table_path, 0, 0));
+    assert(*id_table_find(&id_table, (uint64_t)7 << 32) == 7);
+    assert(!id_table_find(&id_table, 7));
+    id_table_destroy(&id_table);
+    struct str_table saved_strs;
+    str_table_einit(&saved_strs, 0);
+    assert(str_table_save(&saved_strs, table_path) == 1);
+    str_table_destroy(&saved_strs);
+    assert(str_table_load(&saved_strs, table_path, 0, 0) == 1);
+    remove(table_path);
+
+    /* Compact buckets, grown from empty so that every key is rehashed */
+    hashtable_compact(uint32_t, int) compact;
+    assert(sizeof(compact._buckets[0]) == sizeof(uint32_t) + sizeof(int));
+    hashtable_init_ext(compact, 0, &config, &err);
+    if (config.flags & HASHTABLE_SOA) {
+        assert(err == 1);
+        return 0;
+    }
+    assert(!err);
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        v = (int)i;
+        hashtable_einsert(compact, i, hashtable_hash(&i, sizeof(i)), v);
+    }
+    for (uint32_t i = 0; i < num_reserved; i += 2)
+        hashtable_erase(compact, i, hashtable_hash(&i, sizeof(i)));
+    hashtable_rehash(compact, 0, &err);
+    assert(!err && hashtable_num_values(compact) == num_reserved / 2);
+    for (uint32_t i = 0; i < num_reserved; ++i) {
+        int *value = hashtable_find(compact, i, hashtable_hash(&i, sizeof(i)));
+        assert(!value == !(i % 2));
+        assert(!value || *value == (int)i);
+    }
+    num_iterations = 0;
+    hashtable_for_each_pair(compact, k, v) {
+        assert(k % 2 && (int)k == v);
+        num_iterations++;
+    }
+    assert(num_iterations == num_reserved / 2);
+    num_refs = 0;
+    hashtable_for_each_ref(compact, key_ref, value_ref) {
+        assert(*key_ref % 2 && (int)*key_ref == *value_ref);
+        num_refs++;
+    }
+    assert(num_refs == num_reserved / 2);
+    printf("Compact buckets for %u values: %lu\n", num_reserved / 2,
+        hashtable_num_buckets(compact));
+    hashtable_destroy(compact, 0);
     return 0;
 }
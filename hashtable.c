@@ -17,18 +17,63 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
 #include "hashtable.h"
 
-#define HASHTABLE_LOAD_FACTOR   70
-#define HASHTABLE_GROWTH_FACTOR 2
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define HASHTABLE_GROUP_WIDTH 32
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define HASHTABLE_GROUP_WIDTH 16
+  #define HASHTABLE_SSE2
+#else
+  #define HASHTABLE_GROUP_WIDTH 16
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+  #include <intrin.h>
+#endif
+
+#if defined(__linux__)
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/syscall.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #define HASHTABLE_MMAP
+#endif
+
+#if defined(HASHTABLE_CRC32_HASH) && defined(__SSE4_2__)
+  #include <nmmintrin.h>
+  #define _hashtable_crc32(crc, v) ((uint32_t)_mm_crc32_u64((crc), (v)))
+#elif defined(HASHTABLE_CRC32_HASH) && defined(__ARM_FEATURE_CRC32)
+  #include <arm_acle.h>
+  #define _hashtable_crc32(crc, v) __crc32cd((crc), (v))
+#endif
+
+/* Control tags of HASHTABLE_SWISS tables. A used bucket's tag holds the low 7
+ * bits of its mixed hash, so the high bit is only set for free buckets. */
+#define HASHTABLE_CTRL_EMPTY    0x80
+#define HASHTABLE_CTRL_DELETED  0xFE
+
+/* Number of buckets in use at load_factor percent */
+#define HASHTABLE_MAX_LOAD(num_buckets, load_factor) \
+    ((num_buckets) / 100 * (load_factor) + \
+        (num_buckets) % 100 * (load_factor) / 100)
 
 static void _hashtable_default_panic(void);
 
 void (*hashtable_panic)(void) = _hashtable_default_panic;
 
-size_t hashtable_hash(const void *key, size_t size)
+#ifdef HASHTABLE_STATS
+struct hashtable_stats hashtable_stats;
+#endif
+
+size_t hashtable_fnv_hash(const void *key, size_t size)
 {
 #if UINTPTR_MAX == 0xFFFFFFFF
     size_t hash = 0x811C9DC5;
@@ -49,7 +94,7 @@ size_t hashtable_hash(const void *key, size_t size)
 #endif
 }
 
-size_t hashtable_str_hash(const char *key)
+size_t hashtable_fnv_str_hash(const char *key)
 {
 #if UINTPTR_MAX == 0xFFFFFFFF
     size_t hash = 0x811C9DC5;
@@ -70,6 +115,101 @@ size_t hashtable_str_hash(const char *key)
 #endif
 }
 
+static inline uint64_t _hashtable_read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t _hashtable_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+size_t _hashtable_hash_bytes(const void *key, size_t size)
+{
+    const unsigned char *p      = key;
+    uint64_t            seed    = HASHTABLE_HASH_P0;
+    uint64_t            a, b;
+    if (size <= 16) {
+        /* Overlapping reads cover short keys without a loop */
+        if (size >= 4) {
+            size_t off = (size >> 3) << 2;
+            a = (_hashtable_read32(p) << 32) | _hashtable_read32(p + off);
+            b = (_hashtable_read32(p + size - 4) << 32) |
+                _hashtable_read32(p + size - 4 - off);
+        } else if (size > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) |
+                p[size - 1];
+            b = 0;
+        } else
+            a = b = 0;
+    } else {
+        size_t i = size;
+#ifdef _hashtable_crc32
+        uint32_t c0 = (uint32_t)seed, c1 = (uint32_t)(seed >> 32);
+        for (; i > 16; i -= 16, p += 16) {
+            c0 = _hashtable_crc32(c0, _hashtable_read64(p));
+            c1 = _hashtable_crc32(c1, _hashtable_read64(p + 8));
+        }
+        seed ^= ((uint64_t)c1 << 32) | c0;
+#else
+        if (i > 48) {
+            uint64_t s1 = seed, s2 = seed;
+            do {
+                seed = _hashtable_mum(_hashtable_read64(p) ^ HASHTABLE_HASH_P1,
+                    _hashtable_read64(p + 8) ^ seed);
+                s1 = _hashtable_mum(_hashtable_read64(p + 16) ^
+                    HASHTABLE_HASH_P2, _hashtable_read64(p + 24) ^ s1);
+                s2 = _hashtable_mum(_hashtable_read64(p + 32) ^
+                    HASHTABLE_HASH_P3, _hashtable_read64(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+        for (; i > 16; i -= 16, p += 16)
+            seed = _hashtable_mum(_hashtable_read64(p) ^ HASHTABLE_HASH_P1,
+                _hashtable_read64(p + 8) ^ seed);
+#endif
+        a = _hashtable_read64(p + i - 16);
+        b = _hashtable_read64(p + i - 8);
+    }
+    uint64_t m = _hashtable_mum(a ^ HASHTABLE_HASH_P1, b ^ seed);
+    size_t hash = (size_t)_hashtable_mum(m ^ HASHTABLE_HASH_P0 ^ size,
+        HASHTABLE_HASH_P2);
+    return hash | !hash;
+}
+
+size_t hashtable_str_hash(const char *key)
+    {return _hashtable_hash_bytes(key, strlen(key));}
+
+int hashtable_str_view_copy(void *dst, const void *src, size_t size)
+{
+    struct hashtable_str_view view;
+    (void)size;
+    memcpy(&view, src, sizeof(view));
+    char *data = malloc(view.len + 1);
+    if (!data)
+        return 1;
+    if (view.len)
+        memcpy(data, view.data, view.len);
+    data[view.len] = 0;
+    view.data = data;
+    memcpy(dst, &view, sizeof(view));
+    return 0;
+}
+
+void hashtable_str_view_free(void *key)
+{
+    struct hashtable_str_view view;
+    memcpy(&view, key, sizeof(view));
+    free((char*)view.data);
+}
+
 int hashtable_copy_key(void *dst, const void *src, size_t size)
 {
     memcpy(dst, src, size);
@@ -79,232 +219,2478 @@ int hashtable_copy_key(void *dst, const void *src, size_t size)
 int hashtable_compare_keys(const void *a, const void *b, size_t size)
     {return memcmp(a, b, size);}
 
-void *_hashtable_init(size_t *num_buckets, size_t num, size_t bucket_size,
-    size_t *num_values, int *ret_err)
+/* Bucket counts are kept at powers of two so that probing can mask the hash
+ * instead of dividing by the bucket count. Returns 0 on overflow. */
+static size_t _hashtable_round_up_pow2(size_t num)
 {
-    void *ret = calloc(num, bucket_size);
-    if (!ret && num) {
-        if (ret_err)
-            *ret_err = 1;
-        return ret;
+    size_t ret = 1;
+    while (ret < num) {
+        if (ret > SIZE_MAX / 2)
+            return 0;
+        ret <<= 1;
     }
-    *num_buckets = num;
-    *num_values = 0;
-    if (ret_err)
-        *ret_err = 0;
     return ret;
 }
 
-void _hashtable_clear(unsigned char *buckets, size_t num_buckets,
-    size_t bucket_size, size_t *num_values, size_t key_off, size_t hash_off,
-    void (*free_key)(void *key))
+/* Whether a growth factor keeps bucket counts powers of two, that is whether
+ * it is 100 times a power of two above 1 */
+static int _hashtable_valid_growth_factor(uint64_t growth_factor)
 {
-    if (!free_key) {
-        for (size_t i = 0; i < num_buckets; ++i) {
-            unsigned char *bucket = buckets + i * bucket_size;
-            memset(bucket + hash_off, 0, sizeof(size_t));
-        }
+    uint64_t factor = growth_factor / 100;
+    return growth_factor > 100 && growth_factor == (unsigned)growth_factor &&
+        !(growth_factor % 100) && !(factor & (factor - 1));
+}
+
+/* Returns the bucket count a table of num_buckets grows to, or 0 on
+ * overflow. */
+static size_t _hashtable_grown_size(size_t num_buckets,
+    unsigned growth_factor)
+{
+    if (num_buckets > SIZE_MAX / growth_factor)
+        return 0;
+    /* _hashtable_init() only accepts factors keeping this a power of two */
+    size_t num_new_buckets = num_buckets * growth_factor / 100;
+    return num_new_buckets ? num_new_buckets : 8;
+}
+
+/* Bucket arrays come from the table's allocator, or from malloc() and free()
+ * if it has none. */
+static void *_hashtable_alloc(const struct hashtable_allocator *allocator,
+    size_t size)
+{
+    if (!allocator->alloc)
+        return malloc(size);
+    return allocator->alloc(allocator->ctx, size);
+}
+
+/* Like _hashtable_alloc(), but allocates num zeroed elements like calloc().
+ * Returns 0 on overflow, and may return 0 for an empty array. */
+static void *_hashtable_calloc(const struct hashtable_allocator *allocator,
+    size_t num, size_t size)
+{
+    if (!allocator->alloc)
+        return calloc(num, size);
+    if (!num || !size || num > SIZE_MAX / size)
+        return 0;
+    void *ret = allocator->alloc(allocator->ctx, num * size);
+    if (ret && !allocator->zeroed)
+        memset(ret, 0, num * size);
+    return ret;
+}
+
+static void _hashtable_free(const struct hashtable_allocator *allocator,
+    void *ptr)
+{
+    if (!allocator->alloc)
+        free(ptr);
+    else if (ptr && allocator->release)
+        allocator->release(allocator->ctx, ptr);
+}
+
+/* Free a bucket array replaced by a resize, or keep it until the table is
+ * destroyed if lock-free readers may still be probing it. Kept arrays are
+ * chained through their first bytes, which such readers would only see
+ * after the table's version has already changed under them. */
+static void _hashtable_retire(unsigned char *buckets, size_t num_buckets,
+    struct _hashtable_state *state)
+{
+    if (!(state->flags & _HASHTABLE_RETAIN_BUCKETS) || !num_buckets) {
+        _hashtable_free(&state->allocator, buckets);
+        return;
+    }
+    memcpy(buckets, &state->retired, sizeof(state->retired));
+    state->retired = buckets;
+}
+
+/* The hashes, keys and values of a bucket array, each seen as an array with
+ * its own stride, so that code outside the probing engines can handle both
+ * bucket layouts. */
+struct _hashtable_arrays {
+    unsigned char   *hashes;
+    unsigned char   *keys;
+    unsigned char   *values;
+    size_t          hash_stride;
+    size_t          key_stride;
+    size_t          value_stride;
+};
+
+/* Allocate the zeroed arrays of a HASHTABLE_SOA table. Returns 0 if
+ * num_buckets is 0 or on failure. */
+static unsigned char *_hashtable_soa_alloc(
+    const struct hashtable_allocator *allocator, size_t num_buckets,
+    size_t key_size, size_t value_size)
+{
+    size_t bucket_size = sizeof(size_t) + key_size + value_size;
+    if (!num_buckets ||
+        num_buckets > (SIZE_MAX - 2 * HASHTABLE_SOA_ALIGN) / bucket_size)
+        return 0;
+    return _hashtable_calloc(allocator,
+        _hashtable_soa_align(num_buckets * sizeof(size_t)) +
+        _hashtable_soa_align(num_buckets * key_size) +
+        num_buckets * value_size, 1);
+}
+
+static inline struct _hashtable_arrays _hashtable_arrays(
+    unsigned char *buckets, size_t num_buckets,
+    const struct _hashtable_state *state, size_t bucket_size, size_t key_off,
+    size_t value_off, size_t hash_off)
+{
+    struct _hashtable_arrays ret = {0, 0, 0, bucket_size, bucket_size,
+        bucket_size};
+    if (!buckets)
+        return ret;
+    if (state->flags & HASHTABLE_SOA) {
+        ret.hashes          = buckets;
+        ret.keys            = buckets +
+            _hashtable_soa_align(num_buckets * sizeof(size_t));
+        ret.values          = ret.keys +
+            _hashtable_soa_align(num_buckets * state->key_stride);
+        ret.hash_stride     = sizeof(size_t);
+        ret.key_stride      = state->key_stride;
+        ret.value_stride    = state->value_stride;
     } else {
-        const size_t zero = 0;
-        for (size_t i = 0; i < num_buckets; ++i) {
-            unsigned char *bucket = buckets + i * bucket_size;
-            if (memcmp(bucket + hash_off, &zero, sizeof(size_t))) {
-                free_key(bucket + key_off);
-                memset(bucket + hash_off, 0, sizeof(size_t));
-            }
-        }
+        ret.hashes  = buckets + hash_off;
+        ret.keys    = buckets + key_off;
+        ret.values  = buckets + value_off;
     }
-    *num_values = 0;
+    return ret;
 }
 
-void _hashtable_destroy(void *table, size_t table_size, unsigned char *buckets,
-    void (*free_key)(void *), size_t num_buckets, size_t bucket_size,
-    size_t key_off, size_t hash_off, size_t num_values)
-{
-    if (free_key && num_values) {
-        const size_t zero = 0;
-        for (size_t i = 0; i < num_buckets; ++i) {
-            unsigned char *bucket = buckets + i * bucket_size;
-            if (memcmp(bucket + hash_off, &zero, sizeof(size_t)))
-                free_key(bucket + key_off);
+static inline size_t _hashtable_array_hash(const struct _hashtable_arrays *a,
+    size_t i)
+{
+    size_t hash;
+    memcpy(&hash, a->hashes + i * a->hash_stride, sizeof(hash));
+    return hash;
+}
+
+static inline int _hashtable_bucket_in_use(const struct _hashtable_arrays *a,
+    const unsigned char *ctrl, size_t i)
+{
+    if (ctrl)
+        return !(ctrl[i] & 0x80);
+    return _hashtable_array_hash(a, i) != 0;
+}
+
+/* =============================================================================
+ * HASHTABLE_SWISS engine
+ * The control tags live in the same allocation as the buckets, directly after
+ * them, and are probed in groups of HASHTABLE_GROUP_WIDTH. Groups are aligned
+ * to multiples of the group width and visited in triangular order, which
+ * covers every group of a power-of-two sized table exactly once.
+ * ===========================================================================*/
+static inline unsigned _hashtable_ctz(uint32_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(mask);
+#elif defined(_MSC_VER)
+    unsigned long ret;
+    _BitScanForward(&ret, mask);
+    return (unsigned)ret;
+#else
+    unsigned ret = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++ret;
+    }
+    return ret;
+#endif
+}
+
+/* Bit i of the result is set if group[i] == tag */
+static inline uint32_t _hashtable_group_match(const unsigned char *group,
+    unsigned char tag)
+{
+#if defined(__AVX2__)
+    __m256i ctrl = _mm256_loadu_si256((const __m256i*)group);
+    return (uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char)tag)));
+#elif defined(HASHTABLE_SSE2)
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < HASHTABLE_GROUP_WIDTH; ++i)
+        mask |= (uint32_t)(group[i] == tag) << i;
+    return mask;
+#endif
+}
+
+/* Bit i of the result is set if group[i] is empty or deleted */
+static inline uint32_t _hashtable_group_match_free(const unsigned char *group)
+{
+#if defined(__AVX2__)
+    return (uint32_t)_mm256_movemask_epi8(
+        _mm256_loadu_si256((const __m256i*)group));
+#elif defined(HASHTABLE_SSE2)
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_loadu_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < HASHTABLE_GROUP_WIDTH; ++i)
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+static unsigned char *_hashtable_swiss_alloc(
+    const struct hashtable_allocator *allocator, size_t num_buckets,
+    size_t bucket_size, unsigned char **ret_ctrl)
+{
+    if (num_buckets > SIZE_MAX / (bucket_size + 1))
+        return 0;
+    unsigned char *buckets = _hashtable_alloc(allocator,
+        num_buckets * (bucket_size + 1));
+    if (!buckets)
+        return 0;
+    *ret_ctrl = buckets + num_buckets * bucket_size;
+    memset(*ret_ctrl, HASHTABLE_CTRL_EMPTY, num_buckets);
+    return buckets;
+}
+
+static size_t _hashtable_swiss_find_free(const unsigned char *ctrl,
+    size_t num_buckets, size_t mix)
+{
+    size_t group_mask   = num_buckets / HASHTABLE_GROUP_WIDTH - 1;
+    size_t group        = (mix >> 7) & group_mask;
+    for (size_t step = 0;;) {
+        uint32_t mask = _hashtable_group_match_free(
+            ctrl + group * HASHTABLE_GROUP_WIDTH);
+        if (mask)
+            return group * HASHTABLE_GROUP_WIDTH + _hashtable_ctz(mask);
+        group = (group + ++step) & group_mask;
+        assert(step <= group_mask);
+    }
+}
+
+/* Move every entry into a new allocation of num_new_buckets buckets. Returns
+ * 0 if out of memory. */
+static unsigned char *_hashtable_swiss_rebuild(unsigned char *buckets,
+    size_t *num_buckets, struct _hashtable_state *state, size_t bucket_size,
+    size_t hash_off, size_t num_new_buckets)
+{
+    unsigned char *new_ctrl;
+    unsigned char *new_buckets = _hashtable_swiss_alloc(&state->allocator,
+        num_new_buckets, bucket_size, &new_ctrl);
+    if (!new_buckets)
+        return 0;
+    for (size_t i = 0; i < *num_buckets; ++i) {
+        if (state->ctrl[i] & 0x80)
+            continue;
+        unsigned char *old_bucket = buckets + i * bucket_size;
+        size_t old_hash;
+        if (state->flags & _HASHTABLE_NO_HASH)
+            old_hash = state->compute_hash(old_bucket, state->key_size);
+        else
+            memcpy(&old_hash, old_bucket + hash_off, sizeof(old_hash));
+        size_t mix  = _hashtable_mix(old_hash);
+        size_t j    = _hashtable_swiss_find_free(new_ctrl, num_new_buckets,
+            mix);
+        memcpy(new_buckets + j * bucket_size, old_bucket, bucket_size);
+        new_ctrl[j] = (unsigned char)(mix & 0x7F);
+    }
+    _hashtable_retire(buckets, *num_buckets, state);
+    state->ctrl         = new_ctrl;
+    state->num_deleted  = 0;
+    *num_buckets        = num_new_buckets;
+    return new_buckets;
+}
+
+/* Rebuild the table into a new allocation, growing it unless most of the
+ * used tags are deleted ones. Returns 0 if out of memory. */
+static unsigned char *_hashtable_swiss_rehash(unsigned char *buckets,
+    size_t *num_buckets, size_t num_values, struct _hashtable_state *state,
+    size_t bucket_size, size_t hash_off)
+{
+    size_t num_new_buckets = *num_buckets;
+    if (!num_new_buckets)
+        num_new_buckets = HASHTABLE_GROUP_WIDTH;
+    else if (num_values >=
+        HASHTABLE_MAX_LOAD(*num_buckets, _hashtable_load_factor(state)) / 2) {
+        num_new_buckets = _hashtable_grown_size(*num_buckets,
+            _hashtable_growth_factor(state));
+        if (!num_new_buckets)
+            return 0;
+    }
+    return _hashtable_swiss_rebuild(buckets, num_buckets, state, bucket_size,
+        hash_off, num_new_buckets);
+}
+
+/* Returns the index of the bucket holding key, or SIZE_MAX. If ret_free is
+ * not NULL, the first free bucket on the probe sequence is written to it, or
+ * SIZE_MAX if none was seen. */
+static size_t _hashtable_swiss_lookup(const void *HASHTABLE_RESTRICT key,
+    size_t key_size, size_t hash, const unsigned char *buckets,
+    size_t num_buckets, const struct _hashtable_state *state,
+    size_t bucket_size, size_t key_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    size_t *ret_free)
+{
+    if (ret_free)
+        *ret_free = SIZE_MAX;
+    if (!num_buckets)
+        return SIZE_MAX;
+    const unsigned char *ctrl   = state->ctrl;
+    size_t          mix         = _hashtable_mix(hash);
+    unsigned char   tag         = (unsigned char)(mix & 0x7F);
+    size_t          group_mask  = num_buckets / HASHTABLE_GROUP_WIDTH - 1;
+    size_t          group       = (mix >> 7) & group_mask;
+    for (size_t step = 0; step <= group_mask;) {
+        const unsigned char *group_ctrl = ctrl + group * HASHTABLE_GROUP_WIDTH;
+        for (uint32_t mask = _hashtable_group_match(group_ctrl, tag); mask;
+            mask &= mask - 1) {
+            size_t i = group * HASHTABLE_GROUP_WIDTH + _hashtable_ctz(mask);
+            const unsigned char *bucket = buckets + i * bucket_size;
+            size_t item_hash = hash;
+            /* Without stored hashes, the tag is all there is to compare */
+            if (!(state->flags & _HASHTABLE_NO_HASH))
+                memcpy(&item_hash, bucket + hash_off, sizeof(item_hash));
+            if (_hashtable_keys_match(item_hash, hash, compare_keys,
+                bucket + key_off, key, key_size))
+                return i;
         }
+        uint32_t free_mask = _hashtable_group_match_free(group_ctrl);
+        if (ret_free && *ret_free == SIZE_MAX && free_mask)
+            *ret_free = group * HASHTABLE_GROUP_WIDTH +
+                _hashtable_ctz(free_mask);
+        if (_hashtable_group_match(group_ctrl, HASHTABLE_CTRL_EMPTY))
+            break;
+        group = (group + ++step) & group_mask;
     }
-    free(buckets);
-    memset(table, 0, table_size);
+    return SIZE_MAX;
 }
 
-void *_hashtable_insert(int *ret_err, unsigned char *HASHTABLE_RESTRICT buckets,
+static void *_hashtable_swiss_insert(int *ret_err,
+    unsigned char *HASHTABLE_RESTRICT buckets,
     size_t *HASHTABLE_RESTRICT num_buckets,
-    size_t *HASHTABLE_RESTRICT num_values, size_t bucket_size, size_t key_off,
-    size_t value_off, size_t hash_off, void *HASHTABLE_RESTRICT key,
-    size_t key_size, size_t hash, void *HASHTABLE_RESTRICT value,
-    size_t value_size,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    void *HASHTABLE_RESTRICT value, size_t value_size,
     int (*compare_keys)(const void *a, const void *b, size_t size),
     int (*copy_key)(void *dst, const void *src, size_t size))
 {
-    if (!hash) {
+    size_t slot;
+    if (_hashtable_swiss_lookup(key, key_size, hash, buckets, *num_buckets,
+        state, bucket_size, key_off, hash_off, compare_keys,
+        &slot) != SIZE_MAX) {
+        /* Key already exists */
         if (ret_err)
-            *ret_err = 1;
+            *ret_err = 2;
         return buckets;
     }
-    /* Resize if num_values / num_buckets >= HASHTABLE_LOAD_FACTOR percent */
-    if (!*num_buckets ||
-        (size_t)100 * (*num_values) / (*num_buckets) >= HASHTABLE_LOAD_FACTOR)
-    {
-        size_t num_new_buckets = (*num_buckets) *
-            (HASHTABLE_GROWTH_FACTOR * 100) / 100;
-        if (num_new_buckets == 0)
-            num_new_buckets = 8;
-        else if (num_new_buckets == *num_buckets)
-            num_new_buckets = 2 * (*num_buckets);
-        unsigned char *new_buckets = calloc(num_new_buckets, bucket_size);
+    size_t mix = _hashtable_mix(hash);
+    /* Reusing a deleted tag never requires growing */
+    if (slot == SIZE_MAX || (state->ctrl[slot] == HASHTABLE_CTRL_EMPTY &&
+        *num_values + state->num_deleted >=
+            HASHTABLE_MAX_LOAD(*num_buckets, _hashtable_load_factor(state)))) {
+        unsigned char *new_buckets = _hashtable_swiss_rehash(buckets,
+            num_buckets, *num_values, state, bucket_size, hash_off);
         if (!new_buckets) {
             if (ret_err)
                 *ret_err = 4;
             return buckets;
         }
-        for (size_t i = 0; i < (*num_buckets); ++i) {
-            unsigned char *old_bucket = buckets + i * bucket_size;
-            size_t  old_hash;
-            memcpy(&old_hash, old_bucket + hash_off, sizeof(hash));
-            if (!old_hash) /* Bucket not in use */
-                continue;
-            for (size_t j = old_hash % num_new_buckets;;) {
-                unsigned char *new_bucket = new_buckets + j * bucket_size;
-                size_t new_item_hash;
-                memcpy(&new_item_hash, new_bucket + hash_off,
-                    sizeof(new_item_hash));
-                if (!new_item_hash) {
-                    memcpy(new_bucket, old_bucket, bucket_size);
-                    break;
-                }
-                j = (j + 1) % num_new_buckets;
-                assert(j != old_hash % num_new_buckets);
-            }
-        }
-        free(buckets);
-        buckets         = new_buckets;
-        *num_buckets    = num_new_buckets;
-    }
-    /* Find a free slot now that we're sure there's space */
-    size_t bucket_index = (size_t)(hash % (size_t)(*num_buckets));
-    for (size_t i = bucket_index;;) {
-        unsigned char *bucket = buckets + i * bucket_size;
-        size_t item_hash;
-        memcpy(&item_hash, bucket + hash_off, sizeof(item_hash));
-        if (!item_hash) {
-            if (copy_key(bucket + key_off, key, key_size)) {
-                if (ret_err)
-                    *ret_err = 3;
-                return buckets;
-            }
-            memcpy(bucket + value_off, value, value_size);
-            memcpy(bucket + hash_off, &hash, sizeof(size_t));
-            if (ret_err)
-                *ret_err = 0;
-            (*num_values)++;
-            return buckets;
-        } else if (!compare_keys(bucket + key_off, key, key_size)) {
-            /* Key already exists */
-            if (ret_err)
-                *ret_err = 2;
-            return buckets;
-        }
-        i = (i + 1) % *num_buckets;
-        assert(i != (bucket_index));
+        buckets = new_buckets;
+        slot    = _hashtable_swiss_find_free(state->ctrl, *num_buckets, mix);
     }
-}
-
-void *_hashtable_find(const void *HASHTABLE_RESTRICT key, size_t key_size,
-    size_t hash, unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
-    size_t bucket_size, size_t key_off, size_t value_off, size_t hash_off,
-    int (*compare_keys)(const void *a, const void *b, size_t size))
-{
-    if (!num_buckets)
-        return 0;
-    size_t bucket_index = hash % num_buckets;
-    for (size_t i = bucket_index;;) {
-        unsigned char *bucket = buckets + i * bucket_size;
-        size_t item_hash;
-        memcpy(&item_hash, bucket + hash_off, sizeof(item_hash));
-        if (!item_hash)
-            return 0;
-        if (!compare_keys(bucket + key_off, key, key_size))
-            return bucket + value_off;
-        i = (i + 1) % num_buckets;
-        if (i == bucket_index)
-            return 0;
+    unsigned char *bucket = buckets + slot * bucket_size;
+    if (copy_key(bucket + key_off, key, key_size)) {
+        if (ret_err)
+            *ret_err = 3;
+        return buckets;
     }
-    return 0;
+    memcpy(bucket + value_off, value, value_size);
+    if (!(state->flags & _HASHTABLE_NO_HASH))
+        memcpy(bucket + hash_off, &hash, sizeof(size_t));
+    if (state->ctrl[slot] == HASHTABLE_CTRL_DELETED)
+        state->num_deleted--;
+    state->ctrl[slot] = (unsigned char)(mix & 0x7F);
+    (*num_values)++;
+    if (ret_err)
+        *ret_err = 0;
+    return buckets;
 }
 
-void _hashtable_erase(unsigned char *HASHTABLE_RESTRICT buckets,
+static void _hashtable_swiss_erase(unsigned char *HASHTABLE_RESTRICT buckets,
     size_t num_buckets, size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state,
     void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
     size_t bucket_size, size_t key_off, size_t hash_off,
     int (*compare_keys)(const void *a, const void *b, size_t size),
     void (*free_key)(void *key))
 {
-    if (!*num_values)
+    size_t i = _hashtable_swiss_lookup(key, key_size, hash, buckets,
+        num_buckets, state, bucket_size, key_off, hash_off, compare_keys,
+        0);
+    if (i == SIZE_MAX)
         return;
-    size_t bucket_index = hash % num_buckets;
-    for (size_t i = bucket_index; ; i = (i + 1) % num_buckets) {
-        unsigned char *bucket = buckets + i * bucket_size;
+    if (free_key)
+        free_key(buckets + i * bucket_size + key_off);
+    /* A group that still has an empty tag has never been full, so no probe
+     * sequence has continued past it and the tag can be emptied. */
+    const unsigned char *group_ctrl = state->ctrl +
+        i / HASHTABLE_GROUP_WIDTH * HASHTABLE_GROUP_WIDTH;
+    if (_hashtable_group_match(group_ctrl, HASHTABLE_CTRL_EMPTY))
+        state->ctrl[i] = HASHTABLE_CTRL_EMPTY;
+    else {
+        state->ctrl[i] = HASHTABLE_CTRL_DELETED;
+        state->num_deleted++;
+    }
+    (*num_values)--;
+}
+
+/* =============================================================================
+ * Common entry points
+ * ===========================================================================*/
+void *_hashtable_init(size_t *num_buckets, size_t num, size_t bucket_size,
+    size_t key_size, size_t value_off, size_t hash_off, size_t *num_values,
+    struct _hashtable_state *state, const struct hashtable_config *config,
+    int *ret_err)
+{
+    unsigned flags          = config ? config->flags : 0;
+    unsigned load_factor    = config ? config->load_factor : 0;
+    unsigned growth_factor  = config ? config->growth_factor : 0;
+    size_t (*compute_hash)(const void *data, size_t size) =
+        config && config->compute_hash ? config->compute_hash : hashtable_hash;
+    struct hashtable_allocator allocator = {0, 0, 0, 0};
+    if (config && config->allocator)
+        allocator = *config->allocator;
+    /* The _hash member of a compact bucket aliases its key */
+    if (hash_off < value_off)
+        flags |= HASHTABLE_SWISS | _HASHTABLE_NO_HASH;
+    if (!load_factor)
+        load_factor = (flags & HASHTABLE_SWISS) ?
+            HASHTABLE_SWISS_LOAD_FACTOR : HASHTABLE_LOAD_FACTOR;
+    if (!growth_factor)
+        growth_factor = HASHTABLE_GROWTH_FACTOR * 100;
+    /* Probe sequences get very long as a table approaches full load */
+    if (load_factor > 95 || !_hashtable_valid_growth_factor(growth_factor) ||
+        ((flags & HASHTABLE_SOA) &&
+            (flags & (HASHTABLE_SWISS | HASHTABLE_INCREMENTAL)))) {
+        if (ret_err)
+            *ret_err = 1;
+        return 0;
+    }
+    if (num) {
+        num = _hashtable_round_up_pow2(num);
+        if (!num) {
+            if (ret_err)
+                *ret_err = 1;
+            return 0;
+        }
+        if ((flags & HASHTABLE_SWISS) && num < HASHTABLE_GROUP_WIDTH)
+            num = HASHTABLE_GROUP_WIDTH;
+    }
+    /* A bucket's key starts it, so the value offset is the padded key size */
+    size_t          key_stride      = value_off;
+    size_t          value_stride    = hash_off - value_off;
+    void            *ret;
+    unsigned char   *ctrl           = 0;
+    if (flags & HASHTABLE_SWISS)
+        ret = num ? _hashtable_swiss_alloc(&allocator, num, bucket_size, &ctrl)
+            : 0;
+    else if (flags & HASHTABLE_SOA)
+        ret = _hashtable_soa_alloc(&allocator, num, key_stride, value_stride);
+    else
+        ret = _hashtable_calloc(&allocator, num, bucket_size);
+    if (!ret && num) {
+        if (ret_err)
+            *ret_err = 1;
+        return ret;
+    }
+    *num_buckets        = num;
+    *num_values         = 0;
+    memset(state, 0, sizeof(*state));
+    state->ctrl             = ctrl;
+    state->flags            = flags;
+    state->load_factor      = load_factor;
+    state->growth_factor    = growth_factor;
+    state->key_stride       = key_stride;
+    state->value_stride     = value_stride;
+    state->compute_hash     = compute_hash;
+    state->key_size         = key_size;
+    state->allocator        = allocator;
+    state->parallel_for     = config ? config->parallel_for : 0;
+    state->num_threads      = config ? config->num_threads : 0;
+    if (ret_err)
+        *ret_err = 0;
+    return ret;
+}
+
+/* Call free_key on the key of every used bucket, including the old buckets of
+ * an incremental resize. */
+static void _hashtable_free_keys(unsigned char *buckets, size_t num_buckets,
+    const struct _hashtable_state *state, size_t bucket_size, size_t key_off,
+    size_t value_off, size_t hash_off, void (*free_key)(void *key))
+{
+    struct _hashtable_arrays arrays = _hashtable_arrays(buckets, num_buckets,
+        state, bucket_size, key_off, value_off, hash_off);
+    for (size_t i = 0; i < num_buckets; ++i) {
+        if (_hashtable_bucket_in_use(&arrays, state->ctrl, i))
+            free_key(arrays.keys + i * arrays.key_stride);
+    }
+    struct _hashtable_arrays old_arrays = _hashtable_arrays(
+        state->old_buckets, state->num_old_buckets, state, bucket_size,
+        key_off, value_off, hash_off);
+    for (size_t i = 0; i < state->num_old_buckets; ++i) {
+        if (_hashtable_bucket_in_use(&old_arrays, 0, i))
+            free_key(old_arrays.keys + i * old_arrays.key_stride);
+    }
+}
+
+int _hashtable_clear(unsigned char *buckets, size_t num_buckets,
+    size_t bucket_size, size_t *num_values, struct _hashtable_state *state,
+    size_t key_off, size_t value_off, size_t hash_off,
+    void (*free_key)(void *key))
+{
+    if (state->flags & _HASHTABLE_READ_ONLY)
+        return 1;
+    if (free_key && *num_values)
+        _hashtable_free_keys(buckets, num_buckets, state, bucket_size, key_off,
+            value_off, hash_off, free_key);
+    _hashtable_free(&state->allocator, state->old_buckets);
+    state->old_buckets      = 0;
+    state->num_old_buckets  = 0;
+    state->num_old_values   = 0;
+    state->migrate_left     = 0;
+    if (state->ctrl) {
+        memset(state->ctrl, HASHTABLE_CTRL_EMPTY, num_buckets);
+        state->num_deleted = 0;
+    } else {
+        struct _hashtable_arrays arrays = _hashtable_arrays(buckets,
+            num_buckets, state, bucket_size, key_off, value_off, hash_off);
+        for (size_t i = 0; i < num_buckets; ++i)
+            memset(arrays.hashes + i * arrays.hash_stride, 0, sizeof(size_t));
+    }
+    *num_values = 0;
+    return 0;
+}
+
+void _hashtable_destroy(void *table, size_t table_size, unsigned char *buckets,
+    void (*free_key)(void *), size_t num_buckets, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off, size_t num_values,
+    const struct _hashtable_state *state)
+{
+    if (free_key && num_values)
+        _hashtable_free_keys(buckets, num_buckets, state, bucket_size, key_off,
+            value_off, hash_off, free_key);
+    _hashtable_free(&state->allocator, state->old_buckets);
+    _hashtable_free(&state->allocator, buckets);
+    for (unsigned char *retired = state->retired; retired;) {
+        unsigned char *next;
+        memcpy(&next, retired, sizeof(next));
+        _hashtable_free(&state->allocator, retired);
+        retired = next;
+    }
+    if (state->flags & _HASHTABLE_MAPPED)
+        free(state->allocator.ctx);
+    memset(table, 0, table_size);
+}
+
+/* Copy a used bucket into a linear probing table known not to contain its
+ * key. */
+static void _hashtable_linear_place(unsigned char *buckets,
+    size_t num_buckets, size_t bucket_size, size_t hash_off, unsigned flags,
+    const unsigned char *bucket)
+{
+    size_t hash;
+    memcpy(&hash, bucket + hash_off, sizeof(hash));
+    size_t index    = _hashtable_bucket_index(hash, num_buckets);
+    size_t j        = index;
+    for (size_t dist = 0;; ++dist) {
         size_t item_hash;
-        memcpy(&item_hash, bucket + hash_off, sizeof(item_hash));
-        if (compare_keys(bucket + key_off, key, key_size))
-            continue;
-        if (free_key)
-            free_key(bucket + key_off);
-        memset(bucket, 0, bucket_size);
-        /* Move any neighbouring buckets back if they have been pushed forward
-         * previously. */
-        unsigned char *previous_bucket = bucket;
-        for (size_t j = (i + 1) % num_buckets;;) {
-            unsigned char *other_bucket = buckets + j * bucket_size;
-            size_t other_hash;
-            memcpy(&other_hash, other_bucket + hash_off, sizeof(other_hash));
-            if (!other_hash)
-                break;
-            size_t other_bucket_index = other_hash % num_buckets;
-            /* If the neighboring bucket's index is not the current index, it
-             * must have been moved forward, so we now move it to the previous
-             * free slot. */
-            if (other_bucket_index != j) {
-                memcpy(previous_bucket, other_bucket, bucket_size);
-                memset(other_bucket + hash_off, 0, sizeof(size_t));
-                previous_bucket = other_bucket;
-            }
-            j = (j + 1) % num_buckets;
+        memcpy(&item_hash, buckets + j * bucket_size + hash_off,
+            sizeof(item_hash));
+        if (!item_hash)
+            break;
+        if ((flags & HASHTABLE_ROBIN_HOOD) &&
+            _hashtable_probe_distance(item_hash, j, num_buckets) < dist) {
+            _hashtable_shift_run(buckets, num_buckets, bucket_size, hash_off,
+                j);
+            break;
         }
-        (*num_values)--;
-        return;
+        j = (j + 1) & (num_buckets - 1);
+        assert(j != index);
     }
+    memcpy(buckets + j * bucket_size, bucket, bucket_size);
 }
 
-int _hashtable_for_each_pair(size_t *HASHTABLE_RESTRICT i,
-    size_t *HASHTABLE_RESTRICT j, void *HASHTABLE_RESTRICT ret_key,
-    void *HASHTABLE_RESTRICT ret_value, size_t key_size, size_t value_size,
-    size_t num_values, unsigned char *HASHTABLE_RESTRICT buckets,
-    size_t bucket_size, size_t key_off, size_t hash_off, size_t value_off)
+/* =============================================================================
+ * Parallel rebuild
+ * With a parallel_for callback, a linear probing table that grows is rebuilt
+ * in chunks of HASHTABLE_PARALLEL_CHUNK new buckets, each call of the
+ * callback's function placing the entries whose home bucket is in its own
+ * chunks. An entry's new home masked by the old bucket count is its old home,
+ * so the entries of a chunk lie in the old buckets at the same offset, from
+ * their home on up to the next free bucket. Entries are only placed within
+ * their chunk, so calls never write to the same buckets. The few entries
+ * whose probe would run past the end of their chunk are placed afterwards by
+ * the calling thread.
+ * ===========================================================================*/
+#define HASHTABLE_PARALLEL_CHUNK 1024
+/* Smallest table whose rebuild is split between threads */
+#define HASHTABLE_PARALLEL_MIN_BUCKETS 65536
+
+struct _hashtable_rebuild {
+    const unsigned char *buckets;
+    size_t              num_buckets;
+    unsigned char       *new_buckets;
+    size_t              num_new_buckets;
+    size_t              bucket_size;
+    size_t              hash_off;
+    unsigned            flags;
+    /* For each chunk, the number of old buckets scanned before the first
+     * entry that did not fit into the chunk, or SIZE_MAX */
+    size_t              *overflow;
+};
+
+/* Like _hashtable_linear_place(), but only uses the buckets below end. Returns
+ * 1 without changing the table if the bucket does not fit. */
+static int _hashtable_linear_place_below(unsigned char *buckets,
+    size_t num_buckets, size_t end, size_t bucket_size, size_t hash_off,
+    unsigned flags, const unsigned char *bucket)
 {
-    /* i = bucket
-     * j = value_num */
-    if (*j >= num_values)
-        return 0;
-    for (;;) {
-        unsigned char *bucket = buckets + (*i) * bucket_size;
+    size_t hash;
+    memcpy(&hash, bucket + hash_off, sizeof(hash));
+    size_t j = _hashtable_bucket_index(hash, num_buckets);
+    for (size_t dist = 0; j < end; ++j, ++dist) {
         size_t item_hash;
-        memcpy(&item_hash, bucket + hash_off, sizeof(item_hash));
-        ++(*i);
+        memcpy(&item_hash, buckets + j * bucket_size + hash_off,
+            sizeof(item_hash));
         if (!item_hash)
-            continue;
-        memcpy(ret_key, bucket + key_off, key_size);
-        memcpy(ret_value, bucket + value_off, value_size);
-        ++(*j);
+            break;
+        if ((flags & HASHTABLE_ROBIN_HOOD) &&
+            _hashtable_probe_distance(item_hash, j, num_buckets) < dist) {
+            /* Shift the run up to its empty bucket, as
+             * _hashtable_shift_run() does, if it ends below end */
+            size_t empty = j + 1;
+            for (;; ++empty) {
+                if (empty == end)
+                    return 1;
+                memcpy(&item_hash, buckets + empty * bucket_size + hash_off,
+                    sizeof(item_hash));
+                if (!item_hash)
+                    break;
+            }
+            memmove(buckets + (j + 1) * bucket_size, buckets + j * bucket_size,
+                (empty - j) * bucket_size);
+            break;
+        }
+    }
+    if (j == end)
+        return 1;
+    memcpy(buckets + j * bucket_size, bucket, bucket_size);
+    return 0;
+}
+
+/* Visit the old buckets holding the entries of chunk, starting after skip of
+ * them. Entries are placed into the chunk, unless serial is set, in which
+ * case entries missing from the new table are placed anywhere. */
+static void _hashtable_rebuild_chunk(struct _hashtable_rebuild *r,
+    size_t chunk, size_t skip, int serial)
+{
+    size_t begin    = chunk * HASHTABLE_PARALLEL_CHUNK;
+    size_t end      = begin + HASHTABLE_PARALLEL_CHUNK;
+    size_t mask     = r->num_buckets - 1;
+    for (size_t n = skip, i = (begin + skip) & mask; n < r->num_buckets;
+        ++n, i = (i + 1) & mask) {
+        const unsigned char *bucket = r->buckets + i * r->bucket_size;
+        size_t hash;
+        memcpy(&hash, bucket + r->hash_off, sizeof(hash));
+        if (!hash) {
+            if (n >= HASHTABLE_PARALLEL_CHUNK)
+                break;
+            continue;
+        }
+        size_t home = _hashtable_bucket_index(hash, r->num_new_buckets);
+        if (home < begin || home >= end)
+            continue;
+        if (!serial) {
+            if (_hashtable_linear_place_below(r->new_buckets,
+                r->num_new_buckets, end, r->bucket_size, r->hash_off,
+                r->flags, bucket) && r->overflow[chunk] == SIZE_MAX)
+                r->overflow[chunk] = n;
+            continue;
+        }
+        /* Skip entries the parallel pass placed */
+        size_t j = home;
+        for (;;) {
+            const unsigned char *placed = r->new_buckets +
+                j * r->bucket_size;
+            size_t item_hash;
+            memcpy(&item_hash, placed + r->hash_off, sizeof(item_hash));
+            if (!item_hash) {
+                _hashtable_linear_place(r->new_buckets, r->num_new_buckets,
+                    r->bucket_size, r->hash_off, r->flags, bucket);
+                break;
+            }
+            if (!memcmp(placed, bucket, r->bucket_size))
+                break;
+            j = (j + 1) & (r->num_new_buckets - 1);
+        }
+    }
+}
+
+static void _hashtable_rebuild_chunks(void *ctx, size_t begin, size_t end,
+    unsigned thread)
+{
+    (void)thread;
+    for (size_t chunk = begin; chunk < end; ++chunk)
+        _hashtable_rebuild_chunk(ctx, chunk, 0, 0);
+}
+
+/* Place the used buckets of a linear probing table into the zeroed
+ * new_buckets through the table's parallel_for. Returns 0, leaving
+ * new_buckets untouched, if the table is too small or if out of memory. */
+static int _hashtable_parallel_rebuild(const unsigned char *buckets,
+    size_t num_buckets, unsigned char *new_buckets, size_t num_new_buckets,
+    size_t bucket_size, size_t hash_off, const struct _hashtable_state *state)
+{
+    if (!state->parallel_for || num_buckets < HASHTABLE_PARALLEL_MIN_BUCKETS ||
+        num_new_buckets < num_buckets)
+        return 0;
+    size_t num_chunks = num_new_buckets / HASHTABLE_PARALLEL_CHUNK;
+    struct _hashtable_rebuild r = {buckets, num_buckets, new_buckets,
+        num_new_buckets, bucket_size, hash_off, state->flags,
+        malloc(num_chunks * sizeof(size_t))};
+    if (!r.overflow)
+        return 0;
+    for (size_t chunk = 0; chunk < num_chunks; ++chunk)
+        r.overflow[chunk] = SIZE_MAX;
+    state->parallel_for(num_chunks, state->num_threads,
+        _hashtable_rebuild_chunks, &r);
+    for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+        if (r.overflow[chunk] != SIZE_MAX)
+            _hashtable_rebuild_chunk(&r, chunk, r.overflow[chunk], 1);
+    }
+    free(r.overflow);
+    return 1;
+}
+
+/* Move every entry of a linear probing table into a new allocation of
+ * num_new_buckets buckets. Returns 0 if out of memory. */
+static unsigned char *_hashtable_linear_rebuild(unsigned char *buckets,
+    size_t *num_buckets, struct _hashtable_state *state, size_t bucket_size,
+    size_t hash_off, size_t num_new_buckets)
+{
+    unsigned char *new_buckets = _hashtable_calloc(&state->allocator,
+        num_new_buckets, bucket_size);
+    if (!new_buckets)
+        return 0;
+    int parallel = _hashtable_parallel_rebuild(buckets, *num_buckets,
+        new_buckets, num_new_buckets, bucket_size, hash_off, state);
+    for (size_t i = 0; !parallel && i < *num_buckets; ++i) {
+        unsigned char *old_bucket = buckets + i * bucket_size;
+        size_t  old_hash;
+        memcpy(&old_hash, old_bucket + hash_off, sizeof(old_hash));
+        if (!old_hash) /* Bucket not in use */
+            continue;
+        _hashtable_linear_place(new_buckets, num_new_buckets, bucket_size,
+            hash_off, state->flags, old_bucket);
+    }
+    _hashtable_retire(buckets, *num_buckets, state);
+    *num_buckets = num_new_buckets;
+    return new_buckets;
+}
+
+unsigned char *_hashtable_grow(unsigned char *buckets, size_t *num_buckets,
+    size_t bucket_size, size_t hash_off, struct _hashtable_state *state)
+{
+    size_t num_new_buckets = _hashtable_grown_size(*num_buckets,
+        _hashtable_growth_factor(state));
+    if (!num_new_buckets)
+        return 0;
+    return _hashtable_linear_rebuild(buckets, num_buckets, state, bucket_size,
+        hash_off, num_new_buckets);
+}
+
+/* =============================================================================
+ * HASHTABLE_SOA engine
+ * The linear probing engine, optionally with Robin Hood placement, over a
+ * bucket array split into an array of hashes, an array of keys and an array
+ * of values. Probing reads the dense hashes and leaves the keys and values
+ * alone until a hash matches.
+ * ===========================================================================*/
+static inline struct _hashtable_arrays _hashtable_soa_arrays(
+    unsigned char *buckets, size_t num_buckets,
+    const struct _hashtable_state *state)
+    {return _hashtable_arrays(buckets, num_buckets, state, 0, 0, 0, 0);}
+
+static inline void _hashtable_soa_move(const struct _hashtable_arrays *dst,
+    size_t j, const struct _hashtable_arrays *src, size_t i)
+{
+    memcpy(dst->hashes + j * sizeof(size_t), src->hashes + i * sizeof(size_t),
+        sizeof(size_t));
+    memcpy(dst->keys + j * dst->key_stride, src->keys + i * src->key_stride,
+        src->key_stride);
+    memcpy(dst->values + j * dst->value_stride,
+        src->values + i * src->value_stride, src->value_stride);
+}
+
+/* Same as _hashtable_close_gap() */
+static void _hashtable_soa_close_gap(const struct _hashtable_arrays *a,
+    size_t num_buckets, unsigned flags, size_t gap)
+{
+    for (size_t j = gap;;) {
+        j = (j + 1) & (num_buckets - 1);
+        size_t item_hash = _hashtable_array_hash(a, j);
+        if (!item_hash)
+            break;
+        size_t home = _hashtable_bucket_index(item_hash, num_buckets);
+        if ((flags & HASHTABLE_ROBIN_HOOD) && home == j)
+            break;
+        if (gap <= j ? (gap < home && home <= j) : (gap < home || home <= j))
+            continue;
+        _hashtable_soa_move(a, gap, a, j);
+        gap = j;
+    }
+    memset(a->hashes + gap * sizeof(size_t), 0, sizeof(size_t));
+}
+
+/* Same as _hashtable_shift_run() */
+static void _hashtable_soa_shift_run(const struct _hashtable_arrays *a,
+    size_t num_buckets, size_t i)
+{
+    size_t mask = num_buckets - 1;
+    size_t end  = i;
+    do
+        end = (end + 1) & mask;
+    while (_hashtable_array_hash(a, end));
+    for (size_t j = end; j != i;) {
+        size_t prev = (j - 1) & mask;
+        _hashtable_soa_move(a, j, a, prev);
+        j = prev;
+    }
+}
+
+/* Returns the index of the bucket holding key, or SIZE_MAX. The index the key
+ * would be inserted at is written to ret_free if not NULL. */
+static size_t _hashtable_soa_lookup(const struct _hashtable_arrays *a,
+    size_t num_buckets, unsigned flags, const void *HASHTABLE_RESTRICT key,
+    size_t key_size, size_t hash,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    size_t *ret_free)
+{
+    if (!num_buckets)
+        return SIZE_MAX;
+    size_t bucket_index = _hashtable_bucket_index(hash, num_buckets);
+    for (size_t i = bucket_index, dist = 0;; ++dist) {
+        size_t item_hash = _hashtable_array_hash(a, i);
+        if (!item_hash) {
+            if (ret_free)
+                *ret_free = i;
+            return SIZE_MAX;
+        }
+        if (_hashtable_keys_match(item_hash, hash, compare_keys,
+            a->keys + i * a->key_stride, key, key_size))
+            return i;
+        if ((flags & HASHTABLE_ROBIN_HOOD) &&
+            _hashtable_probe_distance(item_hash, i, num_buckets) < dist) {
+            if (ret_free)
+                *ret_free = i;
+            return SIZE_MAX;
+        }
+        i = (i + 1) & (num_buckets - 1);
+        /* Growth always leaves an empty bucket, so only find gets here */
+        if (i == bucket_index)
+            return SIZE_MAX;
+    }
+}
+
+/* Move every entry into a new allocation of num_new_buckets buckets. Returns
+ * 0 if out of memory. */
+static unsigned char *_hashtable_soa_rebuild(unsigned char *buckets,
+    size_t *num_buckets, struct _hashtable_state *state,
+    size_t num_new_buckets)
+{
+    unsigned char *new_buckets = _hashtable_soa_alloc(&state->allocator,
+        num_new_buckets, state->key_stride, state->value_stride);
+    if (!new_buckets)
+        return 0;
+    struct _hashtable_arrays a = _hashtable_soa_arrays(buckets, *num_buckets,
+        state);
+    struct _hashtable_arrays b = _hashtable_soa_arrays(new_buckets,
+        num_new_buckets, state);
+    for (size_t i = 0; i < *num_buckets; ++i) {
+        size_t hash = _hashtable_array_hash(&a, i);
+        if (!hash)
+            continue;
+        size_t j = _hashtable_bucket_index(hash, num_new_buckets);
+        for (size_t dist = 0;; ++dist) {
+            size_t item_hash = _hashtable_array_hash(&b, j);
+            if (!item_hash)
+                break;
+            if ((state->flags & HASHTABLE_ROBIN_HOOD) &&
+                _hashtable_probe_distance(item_hash, j, num_new_buckets) <
+                    dist) {
+                _hashtable_soa_shift_run(&b, num_new_buckets, j);
+                break;
+            }
+            j = (j + 1) & (num_new_buckets - 1);
+        }
+        _hashtable_soa_move(&b, j, &a, i);
+    }
+    _hashtable_retire(buckets, *num_buckets, state);
+    *num_buckets = num_new_buckets;
+    return new_buckets;
+}
+
+static void *_hashtable_soa_insert(int *ret_err,
+    unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    void *HASHTABLE_RESTRICT value, size_t value_size,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size))
+{
+    if (!hash) {
+        if (ret_err)
+            *ret_err = 1;
+        return buckets;
+    }
+    if (_hashtable_linear_needs_growth(*num_values, *num_buckets,
+        _hashtable_load_factor(state))) {
+        size_t num_new_buckets = _hashtable_grown_size(*num_buckets,
+            _hashtable_growth_factor(state));
+        unsigned char *new_buckets = num_new_buckets ? _hashtable_soa_rebuild(
+            buckets, num_buckets, state, num_new_buckets) : 0;
+        if (!new_buckets) {
+            if (ret_err)
+                *ret_err = 4;
+            return buckets;
+        }
+        buckets = new_buckets;
+    }
+    struct _hashtable_arrays a = _hashtable_soa_arrays(buckets, *num_buckets,
+        state);
+    size_t i = SIZE_MAX;
+    if (_hashtable_soa_lookup(&a, *num_buckets, state->flags, key, key_size,
+        hash, compare_keys, &i) != SIZE_MAX) {
+        /* Key already exists */
+        if (ret_err)
+            *ret_err = 2;
+        return buckets;
+    }
+    assert(i != SIZE_MAX);
+    if (_hashtable_array_hash(&a, i))
+        _hashtable_soa_shift_run(&a, *num_buckets, i);
+    if (copy_key(a.keys + i * a.key_stride, key, key_size)) {
+        /* Undo a possible shift */
+        _hashtable_soa_close_gap(&a, *num_buckets, state->flags, i);
+        if (ret_err)
+            *ret_err = 3;
+        return buckets;
+    }
+    memcpy(a.values + i * a.value_stride, value, value_size);
+    memcpy(a.hashes + i * sizeof(size_t), &hash, sizeof(size_t));
+    (*num_values)++;
+    if (ret_err)
+        *ret_err = 0;
+    return buckets;
+}
+
+static void *_hashtable_soa_find(const void *HASHTABLE_RESTRICT key,
+    size_t key_size, size_t hash, unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t num_buckets, const struct _hashtable_state *state,
+    int (*compare_keys)(const void *a, const void *b, size_t size))
+{
+    struct _hashtable_arrays a = _hashtable_soa_arrays(buckets, num_buckets,
+        state);
+    size_t i = _hashtable_soa_lookup(&a, num_buckets, state->flags, key,
+        key_size, hash, compare_keys, 0);
+    return i == SIZE_MAX ? 0 : a.values + i * a.value_stride;
+}
+
+static void _hashtable_soa_erase(unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t num_buckets, size_t *HASHTABLE_RESTRICT num_values,
+    const struct _hashtable_state *HASHTABLE_RESTRICT state,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    void (*free_key)(void *key))
+{
+    struct _hashtable_arrays a = _hashtable_soa_arrays(buckets, num_buckets,
+        state);
+    size_t i = _hashtable_soa_lookup(&a, num_buckets, state->flags, key,
+        key_size, hash, compare_keys, 0);
+    if (i == SIZE_MAX)
+        return;
+    if (free_key)
+        free_key(a.keys + i * a.key_stride);
+    _hashtable_soa_close_gap(&a, num_buckets, state->flags, i);
+    (*num_values)--;
+}
+
+/* =============================================================================
+ * HASHTABLE_INCREMENTAL growth
+ * Old buckets are moved over one whole probe run at a time, starting from an
+ * empty old bucket. Every run left in the old array is therefore complete, so
+ * the old array can still be searched and erased from as a regular linear
+ * probing table while the moved buckets read as empty.
+ * ===========================================================================*/
+#define HASHTABLE_MIGRATION_STEP 32
+
+/* Visit at least num_steps old buckets, moving the used ones, and then carry
+ * on to the end of the current run. */
+static void _hashtable_migrate(unsigned char *buckets, size_t num_buckets,
+    struct _hashtable_state *state, size_t bucket_size, size_t hash_off,
+    size_t num_steps)
+{
+    size_t mask = state->num_old_buckets - 1;
+    while (state->migrate_left) {
+        unsigned char *old_bucket = state->old_buckets +
+            state->migrate_pos * bucket_size;
+        size_t hash;
+        memcpy(&hash, old_bucket + hash_off, sizeof(hash));
+        if (hash) {
+            _hashtable_linear_place(buckets, num_buckets, bucket_size,
+                hash_off, state->flags, old_bucket);
+            memset(old_bucket + hash_off, 0, sizeof(size_t));
+            state->num_old_values--;
+        } else if (!num_steps)
+            break;
+        state->migrate_pos = (state->migrate_pos + 1) & mask;
+        state->migrate_left--;
+        if (num_steps)
+            num_steps--;
+    }
+    if (!state->migrate_left) {
+        _hashtable_free(&state->allocator, state->old_buckets);
+        state->old_buckets      = 0;
+        state->num_old_buckets  = 0;
+    }
+}
+
+static unsigned char *_hashtable_start_migration(unsigned char *buckets,
+    size_t *num_buckets, size_t num_values, struct _hashtable_state *state,
+    size_t bucket_size, size_t hash_off)
+{
+    size_t num_new_buckets = _hashtable_grown_size(*num_buckets,
+        _hashtable_growth_factor(state));
+    if (!num_new_buckets)
+        return 0;
+    unsigned char *new_buckets = _hashtable_calloc(&state->allocator,
+        num_new_buckets, bucket_size);
+    if (!new_buckets)
+        return 0;
+    /* The load factor guarantees an empty bucket to start from */
+    size_t start = 0;
+    for (;; ++start) {
+        size_t hash;
+        memcpy(&hash, buckets + start * bucket_size + hash_off, sizeof(hash));
+        if (!hash)
+            break;
+    }
+    state->old_buckets      = buckets;
+    state->num_old_buckets  = *num_buckets;
+    state->num_old_values   = num_values;
+    state->migrate_pos      = start;
+    state->migrate_left     = *num_buckets;
+    *num_buckets            = num_new_buckets;
+    return new_buckets;
+}
+
+static void *_hashtable_incremental_insert(int *ret_err,
+    unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    void *HASHTABLE_RESTRICT value, size_t value_size,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size))
+{
+    if (!hash) {
+        if (ret_err)
+            *ret_err = 1;
+        return buckets;
+    }
+    if (state->old_buckets)
+        _hashtable_migrate(buckets, *num_buckets, state, bucket_size, hash_off,
+            HASHTABLE_MIGRATION_STEP);
+    if (!state->old_buckets && *num_buckets &&
+        _hashtable_linear_needs_growth(*num_values, *num_buckets,
+            _hashtable_load_factor(state))) {
+        unsigned char *new_buckets = _hashtable_start_migration(buckets,
+            num_buckets, *num_values, state, bucket_size, hash_off);
+        if (!new_buckets) {
+            if (ret_err)
+                *ret_err = 4;
+            return buckets;
+        }
+        buckets = new_buckets;
+        _hashtable_migrate(buckets, *num_buckets, state, bucket_size, hash_off,
+            HASHTABLE_MIGRATION_STEP);
+    }
+    if (state->old_buckets && _hashtable_linear_find(key, key_size, hash,
+        state->old_buckets, state->num_old_buckets, state->flags, bucket_size,
+        key_off, 0, hash_off, compare_keys)) {
+        /* Key already exists */
+        if (ret_err)
+            *ret_err = 2;
+        return buckets;
+    }
+    /* The new buckets only need room for the values already moved to them */
+    size_t num_new_values = *num_values - state->num_old_values;
+    buckets = _hashtable_linear_insert(ret_err, buckets, num_buckets,
+        &num_new_values, state, bucket_size, key_off, value_off,
+        hash_off, key, key_size, hash, value, value_size, compare_keys,
+        copy_key);
+    *num_values = num_new_values + state->num_old_values;
+    return buckets;
+}
+
+static void _hashtable_incremental_erase(
+    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    size_t bucket_size, size_t key_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    void (*free_key)(void *key))
+{
+    if (state->old_buckets)
+        _hashtable_migrate(buckets, num_buckets, state, bucket_size, hash_off,
+            HASHTABLE_MIGRATION_STEP);
+    size_t num_new_values = *num_values - state->num_old_values;
+    size_t num_old_values = state->num_old_values;
+    _hashtable_linear_erase(buckets, num_buckets, &num_new_values,
+        state->flags, key, key_size, hash, bucket_size, key_off, hash_off,
+        compare_keys, free_key);
+    if (state->old_buckets &&
+        num_new_values + num_old_values == *num_values) {
+        _hashtable_linear_erase(state->old_buckets, state->num_old_buckets,
+            &num_old_values, state->flags, key, key_size, hash, bucket_size,
+            key_off, hash_off, compare_keys, free_key);
+        state->num_old_values = num_old_values;
+    }
+    *num_values = num_new_values + state->num_old_values;
+}
+
+/* =============================================================================
+ * Capacity management
+ * ===========================================================================*/
+/* Smallest bucket count holding num_values without growing, or 0 if it cannot
+ * be represented. */
+static size_t _hashtable_min_buckets(size_t num_values,
+    const struct _hashtable_state *state)
+{
+    size_t num_buckets;
+    if (state->flags & HASHTABLE_SWISS) {
+        num_buckets = HASHTABLE_GROUP_WIDTH;
+        while (num_values >
+            HASHTABLE_MAX_LOAD(num_buckets, _hashtable_load_factor(state))) {
+            if (num_buckets > SIZE_MAX / 2)
+                return 0;
+            num_buckets *= 2;
+        }
+        return num_buckets;
+    }
+    if (num_values > SIZE_MAX / 100)
+        return 0;
+    num_buckets = 8;
+    while (num_values && _hashtable_linear_needs_growth(num_values - 1,
+        num_buckets, _hashtable_load_factor(state))) {
+        if (num_buckets > SIZE_MAX / 2)
+            return 0;
+        num_buckets *= 2;
+    }
+    return num_buckets;
+}
+
+void *_hashtable_rehash(int *ret_err, unsigned char *buckets,
+    size_t *num_buckets, size_t num_values, struct _hashtable_state *state,
+    size_t bucket_size, size_t hash_off, size_t num)
+{
+    size_t num_new_buckets = _hashtable_min_buckets(num_values, state);
+    if (num > num_new_buckets)
+        num_new_buckets = _hashtable_round_up_pow2(num);
+    if (!num_new_buckets || (state->flags & _HASHTABLE_READ_ONLY)) {
+        if (ret_err)
+            *ret_err = 1;
+        return buckets;
+    }
+    /* Finish an ongoing incremental resize so all entries are in one array */
+    if (state->old_buckets)
+        _hashtable_migrate(buckets, *num_buckets, state, bucket_size, hash_off,
+            SIZE_MAX);
+    unsigned char *new_buckets = buckets;
+    if (num_new_buckets != *num_buckets || state->num_deleted) {
+        if (state->flags & HASHTABLE_SWISS)
+            new_buckets = _hashtable_swiss_rebuild(buckets, num_buckets, state,
+                bucket_size, hash_off, num_new_buckets);
+        else if (state->flags & HASHTABLE_SOA)
+            new_buckets = _hashtable_soa_rebuild(buckets, num_buckets, state,
+                num_new_buckets);
+        else
+            new_buckets = _hashtable_linear_rebuild(buckets, num_buckets,
+                state, bucket_size, hash_off, num_new_buckets);
+        if (!new_buckets) {
+            if (ret_err)
+                *ret_err = 4;
+            return buckets;
+        }
+    }
+    if (ret_err)
+        *ret_err = 0;
+    return new_buckets;
+}
+
+void *_hashtable_reserve(int *ret_err, unsigned char *buckets,
+    size_t *num_buckets, size_t num_values, struct _hashtable_state *state,
+    size_t bucket_size, size_t hash_off, size_t num)
+{
+    if (num < num_values)
+        num = num_values;
+    size_t num_new_buckets = _hashtable_min_buckets(num, state);
+    if (!num_new_buckets || (state->flags & _HASHTABLE_READ_ONLY)) {
+        if (ret_err)
+            *ret_err = 1;
+        return buckets;
+    }
+    if (num_new_buckets <= *num_buckets) {
+        if (ret_err)
+            *ret_err = 0;
+        return buckets;
+    }
+    return _hashtable_rehash(ret_err, buckets, num_buckets, num_values, state,
+        bucket_size, hash_off, num_new_buckets);
+}
+
+void *_hashtable_insert(int *ret_err, unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    void *HASHTABLE_RESTRICT value, size_t value_size,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size))
+{
+    if (state->flags & _HASHTABLE_READ_ONLY) {
+        if (ret_err)
+            *ret_err = 1;
+        return buckets;
+    }
+    if (state->flags & HASHTABLE_SWISS)
+        return _hashtable_swiss_insert(ret_err, buckets, num_buckets,
+            num_values, state, bucket_size, key_off, value_off, hash_off, key,
+            key_size, hash, value, value_size, compare_keys, copy_key);
+    if (state->flags & HASHTABLE_SOA)
+        return _hashtable_soa_insert(ret_err, buckets, num_buckets, num_values,
+            state, key, key_size, hash, value, value_size, compare_keys,
+            copy_key);
+    if (state->flags & HASHTABLE_INCREMENTAL)
+        return _hashtable_incremental_insert(ret_err, buckets, num_buckets,
+            num_values, state, bucket_size, key_off, value_off, hash_off, key,
+            key_size, hash, value, value_size, compare_keys, copy_key);
+    return _hashtable_linear_insert(ret_err, buckets, num_buckets, num_values,
+        state, bucket_size, key_off, value_off, hash_off, key, key_size, hash,
+        value, value_size, compare_keys, copy_key);
+}
+
+void *_hashtable_find(const void *HASHTABLE_RESTRICT key, size_t key_size,
+    size_t hash, unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    const struct _hashtable_state *state, size_t bucket_size, size_t key_off,
+    size_t value_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size))
+{
+    if (state->flags & HASHTABLE_SWISS) {
+        size_t i = _hashtable_swiss_lookup(key, key_size, hash, buckets,
+            num_buckets, state, bucket_size, key_off, hash_off,
+            compare_keys, 0);
+        return i == SIZE_MAX ? 0 : buckets + i * bucket_size + value_off;
+    }
+    if (state->flags & HASHTABLE_SOA)
+        return _hashtable_soa_find(key, key_size, hash, buckets, num_buckets,
+            state, compare_keys);
+    void *ret = _hashtable_linear_find(key, key_size, hash, buckets,
+        num_buckets, state->flags, bucket_size, key_off, value_off, hash_off,
+        compare_keys);
+    if (!ret && state->old_buckets)
+        ret = _hashtable_linear_find(key, key_size, hash, state->old_buckets,
+            state->num_old_buckets, state->flags, bucket_size, key_off,
+            value_off, hash_off, compare_keys);
+    return ret;
+}
+
+int _hashtable_erase(unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t num_buckets, size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    size_t bucket_size, size_t key_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    void (*free_key)(void *key))
+{
+    if (state->flags & _HASHTABLE_READ_ONLY)
+        return 1;
+    if (!*num_values)
+        return 0;
+    if (state->flags & HASHTABLE_SWISS) {
+        _hashtable_swiss_erase(buckets, num_buckets, num_values, state, key,
+            key_size, hash, bucket_size, key_off, hash_off, compare_keys,
+            free_key);
+        return 0;
+    }
+    if (state->flags & HASHTABLE_SOA) {
+        _hashtable_soa_erase(buckets, num_buckets, num_values, state, key,
+            key_size, hash, compare_keys, free_key);
+        return 0;
+    }
+    if (state->flags & HASHTABLE_INCREMENTAL) {
+        _hashtable_incremental_erase(buckets, num_buckets, num_values, state,
+            key, key_size, hash, bucket_size, key_off, hash_off, compare_keys,
+            free_key);
+        return 0;
+    }
+    _hashtable_linear_erase(buckets, num_buckets, num_values, state->flags, key,
+        key_size, hash, bucket_size, key_off, hash_off, compare_keys, free_key);
+    return 0;
+}
+
+/* =============================================================================
+ * Batched operations
+ * A key's first cache line is prefetched HASHTABLE_PREFETCH_DISTANCE keys
+ * before it is probed, so that many memory accesses are in flight at once
+ * instead of one at a time. Lookups fetch the tags of a HASHTABLE_SWISS table,
+ * or the hashes of a HASHTABLE_SOA table, another HASHTABLE_PREFETCH_DISTANCE
+ * keys earlier, so that the matching bucket, key or value can then be
+ * prefetched as well.
+ * ===========================================================================*/
+#define HASHTABLE_PREFETCH_DISTANCE 8
+
+#if defined(__GNUC__) || defined(__clang__)
+  #define _hashtable_prefetch(addr) __builtin_prefetch(addr)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  #define _hashtable_prefetch(addr) \
+    _mm_prefetch((const char*)(addr), _MM_HINT_T0)
+#else
+  #define _hashtable_prefetch(addr) ((void)(addr))
+#endif
+
+/* Prefetch the first memory a lookup of hash reads: the home bucket, the home
+ * group of tags of a HASHTABLE_SWISS table or the home hash of a HASHTABLE_SOA
+ * table. */
+static inline void _hashtable_prefetch_home(const unsigned char *buckets,
+    size_t num_buckets, const struct _hashtable_state *state,
+    size_t bucket_size, size_t hash)
+{
+    if (!num_buckets)
+        return;
+    if (state->ctrl) {
+        size_t group_mask   = num_buckets / HASHTABLE_GROUP_WIDTH - 1;
+        size_t group        = (_hashtable_mix(hash) >> 7) & group_mask;
+        _hashtable_prefetch(state->ctrl + group * HASHTABLE_GROUP_WIDTH);
+    } else if (state->flags & HASHTABLE_SOA)
+        _hashtable_prefetch(buckets +
+            _hashtable_bucket_index(hash, num_buckets) * sizeof(size_t));
+    else
+        _hashtable_prefetch(buckets +
+            _hashtable_bucket_index(hash, num_buckets) * bucket_size);
+}
+
+/* Prefetch the bucket of the first tag match in the home group of a
+ * HASHTABLE_SWISS table, whose tags should already be cached, or the key and
+ * value of a HASHTABLE_SOA table whose home hash matches. */
+static inline void _hashtable_prefetch_match(unsigned char *buckets,
+    size_t num_buckets, const struct _hashtable_state *state,
+    size_t bucket_size, size_t hash)
+{
+    if (!num_buckets)
+        return;
+    if (state->flags & HASHTABLE_SOA) {
+        struct _hashtable_arrays a = _hashtable_soa_arrays(buckets,
+            num_buckets, state);
+        size_t i = _hashtable_bucket_index(hash, num_buckets);
+        if (_hashtable_array_hash(&a, i) == hash) {
+            _hashtable_prefetch(a.keys + i * a.key_stride);
+            _hashtable_prefetch(a.values + i * a.value_stride);
+        }
+        return;
+    }
+    if (!state->ctrl)
+        return;
+    size_t      mix         = _hashtable_mix(hash);
+    size_t      group_mask  = num_buckets / HASHTABLE_GROUP_WIDTH - 1;
+    size_t      group       = (mix >> 7) & group_mask;
+    uint32_t    mask        = _hashtable_group_match(
+        state->ctrl + group * HASHTABLE_GROUP_WIDTH,
+        (unsigned char)(mix & 0x7F));
+    if (mask)
+        _hashtable_prefetch(buckets + (group * HASHTABLE_GROUP_WIDTH +
+            _hashtable_ctz(mask)) * bucket_size);
+}
+
+size_t _hashtable_find_batch(const void *HASHTABLE_RESTRICT keys,
+    size_t key_size, const size_t *HASHTABLE_RESTRICT hashes, size_t n,
+    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    const struct _hashtable_state *state, size_t bucket_size, size_t key_off,
+    size_t value_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    void **HASHTABLE_RESTRICT ret_values)
+{
+    const unsigned char *key        = keys;
+    size_t              num_found   = 0;
+    size_t              distance    = HASHTABLE_PREFETCH_DISTANCE;
+    for (size_t i = 0; i < n && i < 2 * distance; ++i)
+        _hashtable_prefetch_home(buckets, num_buckets, state, bucket_size,
+            hashes[i]);
+    for (size_t i = 0; i < n; ++i, key += key_size) {
+        if (i + 2 * distance < n)
+            _hashtable_prefetch_home(buckets, num_buckets, state, bucket_size,
+                hashes[i + 2 * distance]);
+        if (i + distance < n)
+            _hashtable_prefetch_match(buckets, num_buckets, state,
+                bucket_size, hashes[i + distance]);
+        void *value = _hashtable_find(key, key_size, hashes[i], buckets,
+            num_buckets, state, bucket_size, key_off, value_off, hash_off,
+            compare_keys);
+        if (value)
+            num_found++;
+        if (ret_values)
+            ret_values[i] = value;
+    }
+    return num_found;
+}
+
+void *_hashtable_insert_batch(int *ret_err,
+    unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off,
+    const void *HASHTABLE_RESTRICT keys, size_t key_size,
+    const size_t *HASHTABLE_RESTRICT hashes,
+    const void *HASHTABLE_RESTRICT values, size_t value_size, size_t n,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size))
+{
+    /* Grow once up front so that prefetched buckets are not moved by a resize
+     * halfway through the batch */
+    int err = 0;
+    if (n > SIZE_MAX - *num_values)
+        err = 1;
+    else
+        buckets = _hashtable_reserve(&err, buckets, num_buckets, *num_values,
+            state, bucket_size, hash_off, *num_values + n);
+    const unsigned char *key    = keys;
+    const unsigned char *value  = values;
+    size_t              distance = HASHTABLE_PREFETCH_DISTANCE;
+    for (size_t i = 0; !err && i < n && i < distance; ++i)
+        _hashtable_prefetch_home(buckets, *num_buckets, state, bucket_size,
+            hashes[i]);
+    for (size_t i = 0; !err && i < n; ++i) {
+        if (i + distance < n)
+            _hashtable_prefetch_home(buckets, *num_buckets, state, bucket_size,
+                hashes[i + distance]);
+        buckets = _hashtable_insert(&err, buckets, num_buckets, num_values,
+            state, bucket_size, key_off, value_off, hash_off, (void*)key,
+            key_size, hashes[i], (void*)value, value_size, compare_keys,
+            copy_key);
+        /* Keys already in the table are skipped */
+        if (err == 2)
+            err = 0;
+        key     += key_size;
+        value   += value_size;
+    }
+    if (ret_err)
+        *ret_err = err;
+    return buckets;
+}
+
+/* A parallel build first groups the entries by home bucket, in groups of
+ * HASHTABLE_BUILD_GROUP chunks, so that each call placing the entries of a
+ * range of chunks only visits the groups overlapping it. The input is split
+ * into at most HASHTABLE_BUILD_MAX_SLICES slices of at least
+ * HASHTABLE_BUILD_SLICE entries. Each slice counts its entries per group, and
+ * after a prefix sum over the counts of all slices scatters their indices to
+ * the group's part of the order array, so that the entries of a group stay in
+ * input order. */
+#define HASHTABLE_BUILD_GROUP       64
+#define HASHTABLE_BUILD_SLICE       4096
+#define HASHTABLE_BUILD_MAX_SLICES  4096
+
+/* Per chunk results of a parallel build, written only by the call that owns
+ * the chunk */
+struct _hashtable_build_chunk {
+    size_t  num_placed;
+    int     err;            /* 2 if a duplicate was seen, or 3 */
+};
+
+struct _hashtable_build {
+    unsigned char                   *buckets;
+    size_t                          num_buckets;
+    size_t                          bucket_size;
+    size_t                          key_off;
+    size_t                          value_off;
+    size_t                          hash_off;
+    unsigned                        flags;
+    unsigned                        policy;
+    const unsigned char             *keys;
+    size_t                          key_size;
+    const size_t                    *hashes;
+    const unsigned char             *values;
+    size_t                          value_size;
+    size_t                          n;
+    int (*compare_keys)(const void *a, const void *b, size_t size);
+    int (*copy_key)(void *dst, const void *src, size_t size);
+    /* Set for the entries whose probe ran past the end of their call's
+     * range, which the calling thread inserts afterwards */
+    unsigned char                   *deferred;
+    struct _hashtable_build_chunk   *chunks;
+    size_t                          num_groups;
+    size_t                          num_slices;
+    size_t                          slice_size;
+    /* The count of each group's entries in each slice, at
+     * group * num_slices + slice, followed by those of zero hashes. The
+     * prefix sum turns them into the offsets of the entries in order. */
+    size_t                          *counts;
+    /* Entry indices by group, those of group g starting at group_starts[g] */
+    size_t                          *order;
+    size_t                          *group_starts;
+};
+
+static inline size_t _hashtable_build_group(const struct _hashtable_build *b,
+    size_t hash)
+{
+    return _hashtable_bucket_index(hash, b->num_buckets) /
+        (HASHTABLE_PARALLEL_CHUNK * HASHTABLE_BUILD_GROUP);
+}
+
+/* Count the entries of slices [begin, end) per group */
+static void _hashtable_build_count(void *ctx, size_t begin, size_t end,
+    unsigned thread)
+{
+    const struct _hashtable_build *b = ctx;
+    (void)thread;
+    for (size_t slice = begin; slice < end; ++slice) {
+        size_t last = (slice + 1) * b->slice_size;
+        if (last > b->n)
+            last = b->n;
+        for (size_t i = slice * b->slice_size; i < last; ++i) {
+            size_t group = b->hashes[i] ?
+                _hashtable_build_group(b, b->hashes[i]) : b->num_groups;
+            b->counts[group * b->num_slices + slice]++;
+        }
+    }
+}
+
+/* Write the indices of the entries of slices [begin, end) to order, at the
+ * offsets the prefix sum left in counts */
+static void _hashtable_build_scatter(void *ctx, size_t begin, size_t end,
+    unsigned thread)
+{
+    const struct _hashtable_build *b = ctx;
+    (void)thread;
+    for (size_t slice = begin; slice < end; ++slice) {
+        size_t last = (slice + 1) * b->slice_size;
+        if (last > b->n)
+            last = b->n;
+        for (size_t i = slice * b->slice_size; i < last; ++i) {
+            size_t group = _hashtable_build_group(b, b->hashes[i]);
+            b->order[b->counts[group * b->num_slices + slice]++] = i;
+        }
+    }
+}
+
+/* Insert entry i of a parallel build into the buckets below end, handling a
+ * duplicate key according to the policy. Returns 1 without changing the
+ * table if the entry does not fit. */
+static int _hashtable_build_place(const struct _hashtable_build *b,
+    size_t end, size_t i)
+{
+    const unsigned char *key    = b->keys + i * b->key_size;
+    const unsigned char *value  = b->values + i * b->value_size;
+    size_t              hash    = b->hashes[i];
+    size_t              home    = _hashtable_bucket_index(hash,
+        b->num_buckets);
+    struct _hashtable_build_chunk *chunk = &b->chunks[home /
+        HASHTABLE_PARALLEL_CHUNK];
+    size_t j    = home;
+    size_t empty = 0;
+    for (size_t dist = 0;; ++j, ++dist) {
+        if (j == end)
+            return 1;
+        unsigned char *bucket = b->buckets + j * b->bucket_size;
+        size_t item_hash;
+        memcpy(&item_hash, bucket + b->hash_off, sizeof(item_hash));
+        if (!item_hash) {
+            empty = j;
+            break;
+        }
+        if (_hashtable_keys_match(item_hash, hash, b->compare_keys,
+            bucket + b->key_off, key, b->key_size)) {
+            if (b->policy == HASHTABLE_BUILD_KEEP_LAST)
+                memcpy(bucket + b->value_off, value, b->value_size);
+            else if (b->policy == HASHTABLE_BUILD_UNIQUE && !chunk->err)
+                chunk->err = 2;
+            return 0;
+        }
+        if ((b->flags & HASHTABLE_ROBIN_HOOD) &&
+            _hashtable_probe_distance(item_hash, j, b->num_buckets) < dist) {
+            /* Shift the run up to its empty bucket if it ends below end */
+            for (empty = j + 1;; ++empty) {
+                if (empty == end)
+                    return 1;
+                memcpy(&item_hash, b->buckets + empty * b->bucket_size +
+                    b->hash_off, sizeof(item_hash));
+                if (!item_hash)
+                    break;
+            }
+            memmove(b->buckets + (j + 1) * b->bucket_size,
+                b->buckets + j * b->bucket_size, (empty - j) * b->bucket_size);
+            break;
+        }
+    }
+    unsigned char *bucket = b->buckets + j * b->bucket_size;
+    if (b->copy_key(bucket + b->key_off, key, b->key_size)) {
+        /* Undo the shift */
+        memmove(bucket, bucket + b->bucket_size, (empty - j) * b->bucket_size);
+        memset(b->buckets + empty * b->bucket_size + b->hash_off, 0,
+            sizeof(size_t));
+        chunk->err = 3;
+        return 0;
+    }
+    memcpy(bucket + b->value_off, value, b->value_size);
+    memcpy(bucket + b->hash_off, &hash, sizeof(hash));
+    chunk->num_placed++;
+    return 0;
+}
+
+/* Insert the entries whose home bucket is in chunks [begin, end), visiting
+ * only the groups overlapping them and writing only to their buckets */
+static void _hashtable_build_chunks(void *ctx, size_t begin, size_t end,
+    unsigned thread)
+{
+    const struct _hashtable_build *b = ctx;
+    (void)thread;
+    size_t first        = begin * HASHTABLE_PARALLEL_CHUNK;
+    size_t last         = end * HASHTABLE_PARALLEL_CHUNK;
+    size_t group_end    = (end + HASHTABLE_BUILD_GROUP - 1) /
+        HASHTABLE_BUILD_GROUP;
+    for (size_t k = b->group_starts[begin / HASHTABLE_BUILD_GROUP];
+        k < b->group_starts[group_end]; ++k) {
+        size_t i    = b->order[k];
+        size_t home = _hashtable_bucket_index(b->hashes[i], b->num_buckets);
+        if (home >= first && home < last && _hashtable_build_place(b, last, i))
+            b->deferred[i] = 1;
+    }
+}
+
+/* Group the entries by home bucket through the table's parallel_for, in one
+ * counting and one scattering pass over the hashes. Returns 1 without
+ * scattering if a hash is 0. */
+static int _hashtable_build_group_entries(struct _hashtable_build *b,
+    const struct _hashtable_state *state)
+{
+    state->parallel_for(b->num_slices, state->num_threads,
+        _hashtable_build_count, b);
+    size_t offset = 0;
+    for (size_t group = 0; group < b->num_groups; ++group) {
+        b->group_starts[group] = offset;
+        size_t *counts = b->counts + group * b->num_slices;
+        for (size_t slice = 0; slice < b->num_slices; ++slice) {
+            size_t count = counts[slice];
+            counts[slice] = offset;
+            offset += count;
+        }
+    }
+    b->group_starts[b->num_groups] = offset;
+    if (offset != b->n)
+        return 1;
+    state->parallel_for(b->num_slices, state->num_threads,
+        _hashtable_build_scatter, b);
+    return 0;
+}
+
+/* Insert the n entries into a default linear probing table with enough
+ * buckets through the table's parallel_for. Returns 0, leaving the table
+ * untouched, if the table is not suitable or if out of memory. Otherwise
+ * returns 1 and writes an error code to ret_err. */
+static int _hashtable_parallel_build(int *ret_err, unsigned char **buckets,
+    size_t *num_buckets, size_t *num_values, struct _hashtable_state *state,
+    size_t bucket_size, size_t key_off, size_t value_off, size_t hash_off,
+    const void *keys, size_t key_size, const size_t *hashes,
+    const void *values, size_t value_size, size_t n, unsigned policy,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size))
+{
+    if (!state->parallel_for ||
+        *num_buckets < HASHTABLE_PARALLEL_MIN_BUCKETS ||
+        (state->flags & (HASHTABLE_SWISS | HASHTABLE_SOA |
+            HASHTABLE_INCREMENTAL)))
+        return 0;
+    size_t num_chunks = *num_buckets / HASHTABLE_PARALLEL_CHUNK;
+    size_t num_groups = num_chunks / HASHTABLE_BUILD_GROUP;
+    size_t slice_size = n / HASHTABLE_BUILD_MAX_SLICES + 1;
+    if (slice_size < HASHTABLE_BUILD_SLICE)
+        slice_size = HASHTABLE_BUILD_SLICE;
+    size_t num_slices = (n + slice_size - 1) / slice_size;
+    struct _hashtable_build b = {*buckets, *num_buckets, bucket_size, key_off,
+        value_off, hash_off, state->flags, policy, keys, key_size, hashes,
+        values, value_size, n, compare_keys, copy_key, calloc(n, 1),
+        calloc(num_chunks, sizeof(struct _hashtable_build_chunk)), num_groups,
+        num_slices, slice_size,
+        calloc((num_groups + 1) * num_slices, sizeof(size_t)),
+        n <= SIZE_MAX / sizeof(size_t) ? malloc(n * sizeof(size_t)) : 0,
+        malloc((num_groups + 1) * sizeof(size_t))};
+    int allocated = n && b.deferred && b.chunks && b.counts && b.order &&
+        b.group_starts;
+    int zero_hash = allocated && _hashtable_build_group_entries(&b, state);
+    if (allocated && !zero_hash)
+        state->parallel_for(num_chunks, state->num_threads,
+            _hashtable_build_chunks, &b);
+    free(b.counts);
+    free(b.order);
+    free(b.group_starts);
+    if (!allocated || zero_hash) {
+        free(b.deferred);
+        free(b.chunks);
+        if (zero_hash)
+            *ret_err = 1;
+        return zero_hash;
+    }
+    int err = 0;
+    for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+        *num_values += b.chunks[chunk].num_placed;
+        if (b.chunks[chunk].err > err)
+            err = b.chunks[chunk].err;
+    }
+    const unsigned char *deferred = b.deferred;
+    while ((deferred = memchr(deferred, 1, n - (size_t)(deferred -
+        b.deferred)))) {
+        size_t i = (size_t)(deferred++ - b.deferred);
+        int insert_err;
+        void *key   = (void*)(b.keys + i * key_size);
+        void *value = (void*)(b.values + i * value_size);
+        *buckets = _hashtable_insert(&insert_err, *buckets, num_buckets,
+            num_values, state, bucket_size, key_off, value_off, hash_off, key,
+            key_size, hashes[i], value, value_size, compare_keys, copy_key);
+        if (insert_err == 2 && policy == HASHTABLE_BUILD_KEEP_LAST)
+            memcpy(_hashtable_find(key, key_size, hashes[i], *buckets,
+                *num_buckets, state, bucket_size, key_off, value_off, hash_off,
+                compare_keys), value, value_size);
+        if (insert_err == 2 && policy != HASHTABLE_BUILD_UNIQUE)
+            insert_err = 0;
+        if (insert_err > err)
+            err = insert_err;
+    }
+    free(b.deferred);
+    free(b.chunks);
+    *ret_err = err;
+    return 1;
+}
+
+void *_hashtable_build(int *ret_err, unsigned char *buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off,
+    const void *HASHTABLE_RESTRICT keys, size_t key_size,
+    const size_t *HASHTABLE_RESTRICT hashes,
+    const void *HASHTABLE_RESTRICT values, size_t value_size, size_t n,
+    unsigned policy,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size))
+{
+    int err = 0;
+    if (n > SIZE_MAX - *num_values || policy > HASHTABLE_BUILD_UNIQUE)
+        err = 1;
+    else
+        buckets = _hashtable_reserve(&err, buckets, num_buckets, *num_values,
+            state, bucket_size, hash_off, *num_values + n);
+    if (err || _hashtable_parallel_build(&err, &buckets, num_buckets,
+        num_values, state, bucket_size, key_off, value_off, hash_off, keys,
+        key_size, hashes, values, value_size, n, policy, compare_keys,
+        copy_key)) {
+        if (ret_err)
+            *ret_err = err;
+        return buckets;
+    }
+    /* Like the parallel build, reject a zero hash before inserting anything */
+    for (size_t i = 0; !err && i < n; ++i) {
+        if (!hashes[i])
+            err = 1;
+    }
+    /* Same as _hashtable_insert_batch(), apart from duplicates and keys that
+     * cannot be copied, which are skipped as by the parallel build */
+    const unsigned char *key        = keys;
+    const unsigned char *value      = values;
+    size_t              distance    = HASHTABLE_PREFETCH_DISTANCE;
+    int                 duplicate   = 0;
+    int                 copy_failed = 0;
+    for (size_t i = 0; !err && i < n && i < distance; ++i)
+        _hashtable_prefetch_home(buckets, *num_buckets, state, bucket_size,
+            hashes[i]);
+    for (size_t i = 0; !err && i < n; ++i) {
+        if (i + distance < n)
+            _hashtable_prefetch_home(buckets, *num_buckets, state, bucket_size,
+                hashes[i + distance]);
+        buckets = _hashtable_insert(&err, buckets, num_buckets, num_values,
+            state, bucket_size, key_off, value_off, hash_off, (void*)key,
+            key_size, hashes[i], (void*)value, value_size, compare_keys,
+            copy_key);
+        if (err == 2) {
+            if (policy == HASHTABLE_BUILD_KEEP_LAST)
+                memcpy(_hashtable_find(key, key_size, hashes[i], buckets,
+                    *num_buckets, state, bucket_size, key_off, value_off,
+                    hash_off, compare_keys), value, value_size);
+            duplicate   = 1;
+            err         = 0;
+        } else if (err == 3) {
+            copy_failed = 1;
+            err         = 0;
+        }
+        key     += key_size;
+        value   += value_size;
+    }
+    if (!err && copy_failed)
+        err = 3;
+    else if (!err && duplicate && policy == HASHTABLE_BUILD_UNIQUE)
+        err = 2;
+    if (ret_err)
+        *ret_err = err;
+    return buckets;
+}
+
+int _hashtable_for_each_pair(size_t *HASHTABLE_RESTRICT i,
+    size_t *HASHTABLE_RESTRICT j, void *HASHTABLE_RESTRICT ret_key,
+    void *HASHTABLE_RESTRICT ret_value, size_t key_size, size_t value_size,
+    size_t num_values, unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t num_buckets, const struct _hashtable_state *state,
+    size_t bucket_size, size_t key_off, size_t hash_off, size_t value_off)
+{
+    /* i = bucket, counting the old buckets of an incremental resize first
+     * j = value_num */
+    if (*j >= num_values)
+        return 0;
+    struct _hashtable_arrays old_arrays = _hashtable_arrays(
+        state->old_buckets, state->num_old_buckets, state, bucket_size,
+        key_off, value_off, hash_off);
+    struct _hashtable_arrays arrays = _hashtable_arrays(buckets, num_buckets,
+        state, bucket_size, key_off, value_off, hash_off);
+    for (;;) {
+        const struct _hashtable_arrays  *a;
+        size_t                          k;
+        int                             in_use;
+        if (*i < state->num_old_buckets) {
+            a       = &old_arrays;
+            k       = *i;
+            in_use  = _hashtable_bucket_in_use(a, 0, k);
+        } else {
+            a       = &arrays;
+            k       = *i - state->num_old_buckets;
+            in_use  = _hashtable_bucket_in_use(a, state->ctrl, k);
+        }
+        ++(*i);
+        if (!in_use)
+            continue;
+        memcpy(ret_key, a->keys + k * a->key_stride, key_size);
+        memcpy(ret_value, a->values + k * a->value_stride, value_size);
+        ++(*j);
         return 1;
     }
 }
 
 static void _hashtable_default_panic(void)
     {abort();}
+
+/* =============================================================================
+ * Arena allocator
+ * Each block starts with a header holding a pointer to the previous block.
+ * Blocks of allocations larger than half the block size are chained behind the
+ * newest block, which keeps serving smaller allocations.
+ * ===========================================================================*/
+
+/* Alignment of arena allocations, enough for any type malloc() returns */
+#define HASHTABLE_ARENA_ALIGN 16
+
+static inline size_t _hashtable_arena_align(size_t size)
+{
+    return (size + HASHTABLE_ARENA_ALIGN - 1) &
+        ~(size_t)(HASHTABLE_ARENA_ALIGN - 1);
+}
+
+#define HASHTABLE_ARENA_HEADER \
+    _hashtable_arena_align(sizeof(unsigned char*))
+
+void hashtable_arena_init(struct hashtable_arena *arena, size_t block_size)
+{
+    arena->block        = 0;
+    arena->used         = 0;
+    arena->size         = 0;
+    arena->block_size   = block_size ? block_size : HASHTABLE_ARENA_BLOCK_SIZE;
+}
+
+void *hashtable_arena_alloc(struct hashtable_arena *arena, size_t size)
+{
+    if (size > SIZE_MAX - HASHTABLE_ARENA_HEADER - HASHTABLE_ARENA_ALIGN)
+        return 0;
+    size = _hashtable_arena_align(size ? size : 1);
+    if (arena->block && size <= arena->size - arena->used) {
+        void *ret = arena->block + arena->used;
+        arena->used += size;
+        return ret;
+    }
+    if (arena->block && size > arena->block_size / 2) {
+        unsigned char *block = malloc(HASHTABLE_ARENA_HEADER + size);
+        if (!block)
+            return 0;
+        /* Chain behind the newest block */
+        unsigned char *next;
+        memcpy(&next, arena->block, sizeof(next));
+        memcpy(block, &next, sizeof(next));
+        memcpy(arena->block, &block, sizeof(block));
+        return block + HASHTABLE_ARENA_HEADER;
+    }
+    size_t block_size = HASHTABLE_ARENA_HEADER + size;
+    if (block_size < arena->block_size)
+        block_size = arena->block_size;
+    unsigned char *block = malloc(block_size);
+    if (!block)
+        return 0;
+    memcpy(block, &arena->block, sizeof(arena->block));
+    arena->block    = block;
+    arena->size     = block_size;
+    arena->used     = HASHTABLE_ARENA_HEADER + size;
+    return block + HASHTABLE_ARENA_HEADER;
+}
+
+char *hashtable_arena_strdup(struct hashtable_arena *arena, const char *str)
+{
+    size_t size = strlen(str) + 1;
+    char *ret = hashtable_arena_alloc(arena, size);
+    if (ret)
+        memcpy(ret, str, size);
+    return ret;
+}
+
+void hashtable_arena_release(struct hashtable_arena *arena)
+{
+    for (unsigned char *block = arena->block; block;) {
+        unsigned char *next;
+        memcpy(&next, block, sizeof(next));
+        free(block);
+        block = next;
+    }
+    hashtable_arena_init(arena, arena->block_size);
+}
+
+static void *_hashtable_arena_alloc_callback(void *ctx, size_t size)
+    {return hashtable_arena_alloc(ctx, size);}
+
+struct hashtable_allocator hashtable_arena_allocator(
+    struct hashtable_arena *arena)
+{
+    struct hashtable_allocator ret = {_hashtable_arena_alloc_callback, 0,
+        arena, 0};
+    return ret;
+}
+
+/* =============================================================================
+ * Page allocator
+ * Each mapping starts with a header holding its length, a cache line ahead of
+ * the memory handed to the table. Huge page sized mappings are aligned by
+ * mapping an extra huge page and unmapping the unaligned ends.
+ * ===========================================================================*/
+#ifdef HASHTABLE_MMAP
+
+#define HASHTABLE_PAGES_HEADER      64
+#define HASHTABLE_HUGE_PAGE_SIZE    ((size_t)2 << 20)
+#define HASHTABLE_GIANT_PAGE_SIZE   ((size_t)1 << 30)
+
+/* From linux/mempolicy.h and linux/mman.h, which may be missing */
+#define HASHTABLE_MPOL_BIND         2
+#define HASHTABLE_MPOL_INTERLEAVE   3
+#define HASHTABLE_MPOL_F_MEMS_ALLOWED (1 << 2)
+#define HASHTABLE_MAP_HUGE_SHIFT    26
+
+static inline size_t _hashtable_round_up(size_t size, size_t multiple)
+    {return (size + multiple - 1) & ~(multiple - 1);}
+
+/* Apply the NUMA policy of pages to a mapping before its first touch */
+static void _hashtable_pages_bind(const struct hashtable_pages *pages,
+    void *map, size_t length)
+{
+#if defined(SYS_mbind) && defined(SYS_get_mempolicy)
+    int mode;
+    if (pages->flags & HASHTABLE_PAGES_INTERLEAVE)
+        mode = HASHTABLE_MPOL_INTERLEAVE;
+    else if (pages->flags & HASHTABLE_PAGES_BIND)
+        mode = HASHTABLE_MPOL_BIND;
+    else
+        return;
+    unsigned long node_mask = pages->node_mask;
+    /* The kernel reads one bit less than the node count it is passed */
+    unsigned long max_node  = 8 * sizeof(node_mask) + 1;
+    if (!node_mask && syscall(SYS_get_mempolicy, 0, &node_mask, max_node, 0,
+        HASHTABLE_MPOL_F_MEMS_ALLOWED))
+        return;
+    syscall(SYS_mbind, map, length, mode, &node_mask, max_node, 0);
+#else
+    (void)pages;
+    (void)map;
+    (void)length;
+#endif
+}
+
+/* Map length bytes aligned to alignment, or return MAP_FAILED */
+static unsigned char *_hashtable_pages_map(size_t length, size_t alignment,
+    int flags)
+{
+    if (alignment <= HASHTABLE_PAGES_HEADER)
+        return mmap(0, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    unsigned char *map = mmap(0, length + alignment, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (map == MAP_FAILED)
+        return map;
+    size_t head = _hashtable_round_up((size_t)map, alignment) - (size_t)map;
+    if (head)
+        munmap(map, head);
+    munmap(map + head + length, alignment - head);
+    return map + head;
+}
+
+static void *_hashtable_pages_alloc(void *ctx, size_t size)
+{
+    const struct hashtable_pages *pages = ctx;
+    if (size > SIZE_MAX - HASHTABLE_PAGES_HEADER -
+        2 * HASHTABLE_GIANT_PAGE_SIZE)
+        return 0;
+    size_t          length  = size + HASHTABLE_PAGES_HEADER;
+    unsigned char   *map    = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (pages->flags & HASHTABLE_PAGES_HUGETLB) {
+        size_t page_size = HASHTABLE_HUGE_PAGE_SIZE;
+        int    page_bits = 21;
+        if ((pages->flags & HASHTABLE_PAGES_1GB) &&
+            length >= HASHTABLE_GIANT_PAGE_SIZE) {
+            page_size = HASHTABLE_GIANT_PAGE_SIZE;
+            page_bits = 30;
+        }
+        if (length >= page_size) {
+            length  = _hashtable_round_up(length, page_size);
+            map     = _hashtable_pages_map(length, 0, MAP_HUGETLB |
+                (page_bits << HASHTABLE_MAP_HUGE_SHIFT));
+        }
+    }
+#endif
+    if (map == MAP_FAILED) {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        if (length >= HASHTABLE_HUGE_PAGE_SIZE &&
+            (pages->flags & (HASHTABLE_PAGES_HUGE | HASHTABLE_PAGES_HUGETLB)))
+            page_size = HASHTABLE_HUGE_PAGE_SIZE;
+        length  = _hashtable_round_up(length, page_size);
+        map     = _hashtable_pages_map(length, page_size, 0);
+        if (map == MAP_FAILED)
+            return 0;
+#ifdef MADV_HUGEPAGE
+        if (page_size == HASHTABLE_HUGE_PAGE_SIZE)
+            madvise(map, length, MADV_HUGEPAGE);
+#endif
+    }
+    _hashtable_pages_bind(pages, map, length);
+    memcpy(map, &length, sizeof(length));
+    return map + HASHTABLE_PAGES_HEADER;
+}
+
+static void _hashtable_pages_release(void *ctx, void *ptr)
+{
+    (void)ctx;
+    unsigned char *map = (unsigned char*)ptr - HASHTABLE_PAGES_HEADER;
+    size_t length;
+    memcpy(&length, map, sizeof(length));
+    munmap(map, length);
+}
+
+struct hashtable_allocator hashtable_page_allocator(
+    const struct hashtable_pages *pages)
+{
+    struct hashtable_allocator ret = {_hashtable_pages_alloc,
+        _hashtable_pages_release, (void*)pages, 1};
+    return ret;
+}
+
+#else
+
+static void *_hashtable_pages_alloc(void *ctx, size_t size)
+    {(void)ctx; return malloc(size);}
+
+static void _hashtable_pages_release(void *ctx, void *ptr)
+    {(void)ctx; free(ptr);}
+
+struct hashtable_allocator hashtable_page_allocator(
+    const struct hashtable_pages *pages)
+{
+    struct hashtable_allocator ret = {_hashtable_pages_alloc,
+        _hashtable_pages_release, (void*)pages, 0};
+    return ret;
+}
+
+#endif
+
+/* =============================================================================
+ * Saving and loading
+ * A saved table is a header padded to HASHTABLE_FILE_HEADER bytes, followed by
+ * its bucket array as it lies in memory: the buckets and then the control
+ * tags of a HASHTABLE_SWISS table, or the three arrays of a HASHTABLE_SOA
+ * table. Padding the header to a page leaves the buckets of a mapped file
+ * page aligned. The fields of the header are 64 bits wide and stored in the
+ * byte order of the machine, whose files other machines reject by their
+ * magic.
+ * ===========================================================================*/
+#define HASHTABLE_FILE_HEADER   4096
+#define HASHTABLE_FILE_MAGIC    0x314C4254484E554DULL /* "MUNHTBL1" */
+#define HASHTABLE_FILE_VERSION  1
+
+struct _hashtable_file_header {
+    uint64_t    magic;
+    uint64_t    version;
+    uint64_t    size_t_size;
+    /* Control tags per group, which places the pairs of a HASHTABLE_SWISS
+     * table */
+    uint64_t    group_width;
+    uint64_t    bucket_size;
+    uint64_t    key_size;
+    uint64_t    value_off;
+    uint64_t    hash_off;
+    uint64_t    hash_id;
+    uint64_t    flags;
+    uint64_t    load_factor;
+    uint64_t    growth_factor;
+    uint64_t    num_buckets;
+    uint64_t    num_values;
+    uint64_t    num_deleted;
+    uint64_t    data_size;          /* Bytes following the header */
+    uint64_t    checksum;           /* Of the bytes following the header */
+    uint64_t    header_checksum;    /* Of the fields above */
+};
+
+/* A checksum that does not depend on the build, unlike _hashtable_hash_bytes()
+ * with HASHTABLE_CRC32_HASH. */
+static uint64_t _hashtable_checksum(const void *data, size_t size)
+{
+    const unsigned char *bytes  = data;
+    uint64_t            sum     = HASHTABLE_FILE_MAGIC;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        sum = (sum ^ word) * 0x9E3779B97F4A7C15ULL;
+        sum ^= sum >> 32;
+    }
+    for (; size; ++bytes, --size)
+        sum = (sum ^ *bytes) * 0x9E3779B97F4A7C15ULL;
+    return sum ^ (sum >> 32);
+}
+
+static size_t _hashtable_data_size(size_t num_buckets,
+    const struct _hashtable_state *state, size_t bucket_size)
+{
+    if (state->flags & HASHTABLE_SOA)
+        return _hashtable_soa_align(num_buckets * sizeof(size_t)) +
+            _hashtable_soa_align(num_buckets * state->key_stride) +
+            num_buckets * state->value_stride;
+    if (state->flags & HASHTABLE_SWISS)
+        return num_buckets * (bucket_size + 1);
+    return num_buckets * bucket_size;
+}
+
+size_t hashtable_hash_id(size_t key_size)
+{
+    unsigned char   stack[64];
+    unsigned char   *key    = key_size <= sizeof(stack) ? stack :
+        malloc(key_size);
+    if (!key)
+        return 0;
+    memset(key, 0, key_size);
+    size_t id = hashtable_hash(key, key_size);
+    for (size_t i = 0; i < key_size; ++i)
+        key[i] = (unsigned char)(i * 0x9D + 0x5B);
+    id = id * 31 + hashtable_hash(key, key_size);
+    if (key != stack)
+        free(key);
+    return id ? id : 1;
+}
+
+void _hashtable_save(int *ret_err, const char *path, size_t hash_id,
+    unsigned char *buckets, size_t num_buckets, size_t num_values,
+    struct _hashtable_state *state, size_t bucket_size, size_t key_size,
+    size_t value_off, size_t hash_off)
+{
+    if (state->migrate_left)
+        _hashtable_migrate(buckets, num_buckets, state, bucket_size, hash_off,
+            state->migrate_left);
+    size_t data_size = buckets ?
+        _hashtable_data_size(num_buckets, state, bucket_size) : 0;
+    struct _hashtable_file_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic            = HASHTABLE_FILE_MAGIC;
+    header.version          = HASHTABLE_FILE_VERSION;
+    header.size_t_size      = sizeof(size_t);
+    header.group_width      = HASHTABLE_GROUP_WIDTH;
+    header.bucket_size      = bucket_size;
+    header.key_size         = key_size;
+    header.value_off        = value_off;
+    header.hash_off         = hash_off;
+    header.hash_id          = hash_id;
+    header.flags            = state->flags & ~(_HASHTABLE_RETAIN_BUCKETS |
+        _HASHTABLE_MAPPED | _HASHTABLE_READ_ONLY);
+    header.load_factor      = _hashtable_load_factor(state);
+    header.growth_factor    = _hashtable_growth_factor(state);
+    header.num_buckets      = num_buckets;
+    header.num_values       = num_values;
+    header.num_deleted      = state->num_deleted;
+    header.data_size        = data_size;
+    header.checksum         = _hashtable_checksum(buckets, data_size);
+    header.header_checksum  = _hashtable_checksum(&header,
+        offsetof(struct _hashtable_file_header, header_checksum));
+    unsigned char padded[HASHTABLE_FILE_HEADER] = {0};
+    memcpy(padded, &header, sizeof(header));
+    FILE *file = fopen(path, "wb");
+    int err = !file ||
+        fwrite(padded, 1, sizeof(padded), file) != sizeof(padded) ||
+        (data_size && fwrite(buckets, 1, data_size, file) != data_size);
+    if (file && fclose(file))
+        err = 1;
+    if (ret_err)
+        *ret_err = err ? 5 : 0;
+}
+
+/* Check a header against the one expected by the table it is loaded into.
+ * Returns 0 or 1 as hashtable_load() does. */
+static int _hashtable_file_check(const struct _hashtable_file_header *header,
+    const struct _hashtable_file_header *expected)
+{
+    struct _hashtable_state state;
+    const uint64_t engines = HASHTABLE_SWISS | HASHTABLE_ROBIN_HOOD |
+        HASHTABLE_INCREMENTAL | HASHTABLE_SOA | _HASHTABLE_NO_HASH;
+    if (header->magic != HASHTABLE_FILE_MAGIC ||
+        header->version != HASHTABLE_FILE_VERSION ||
+        header->header_checksum != _hashtable_checksum(header,
+            offsetof(struct _hashtable_file_header, header_checksum)))
+        return 1;
+    if (header->size_t_size != expected->size_t_size ||
+        header->bucket_size != expected->bucket_size ||
+        header->key_size != expected->key_size ||
+        header->value_off != expected->value_off ||
+        header->hash_off != expected->hash_off ||
+        (expected->hash_id && header->hash_id != expected->hash_id) ||
+        ((header->flags & HASHTABLE_SWISS) &&
+            header->group_width != expected->group_width))
+        return 1;
+    /* Only what _hashtable_init() accepts, so that corrupt counts cannot send
+     * a probe past the end of the buckets */
+    if ((header->flags & ~engines) ||
+        ((header->flags & HASHTABLE_SOA) &&
+            (header->flags & (HASHTABLE_SWISS | HASHTABLE_INCREMENTAL))) ||
+        !header->load_factor || header->load_factor > 95 ||
+        !_hashtable_valid_growth_factor(header->growth_factor) ||
+        (header->num_buckets & (header->num_buckets - 1)) ||
+        header->num_buckets > (SIZE_MAX - 2 * HASHTABLE_SOA_ALIGN) /
+            (header->bucket_size + sizeof(size_t) + 1) ||
+        (header->num_buckets ? header->num_values >= header->num_buckets :
+            header->num_values != 0) ||
+        header->num_deleted > header->num_buckets ||
+        ((header->flags & HASHTABLE_SWISS) && header->num_buckets &&
+            header->num_buckets < HASHTABLE_GROUP_WIDTH))
+        return 1;
+    state.flags         = (unsigned)header->flags;
+    state.key_stride    = (size_t)header->value_off;
+    state.value_stride  = (size_t)(header->hash_off - header->value_off);
+    size_t data_size    = (size_t)header->num_buckets ?
+        _hashtable_data_size((size_t)header->num_buckets, &state,
+            (size_t)header->bucket_size) : 0;
+    return header->data_size != data_size;
+}
+
+/* Read the file into memory from allocator. Returns 0 for an empty table. */
+static unsigned char *_hashtable_load_copy(int *ret_err, const char *path,
+    const struct _hashtable_file_header *expected,
+    struct _hashtable_file_header *header,
+    const struct hashtable_allocator *allocator)
+{
+    unsigned char   *ret    = 0;
+    FILE            *file   = fopen(path, "rb");
+    *ret_err = 5;
+    if (!file)
+        return 0;
+    if (fread(header, sizeof(*header), 1, file) != 1)
+        *ret_err = ferror(file) ? 5 : 1;
+    else if (!(*ret_err = _hashtable_file_check(header, expected))) {
+        size_t size = (size_t)header->data_size;
+        ret = size ? _hashtable_alloc(allocator, size) : 0;
+        if (size && !ret)
+            *ret_err = 4;
+        else if (fseek(file, HASHTABLE_FILE_HEADER, SEEK_SET) ||
+            (size && fread(ret, 1, size, file) != size) ||
+            getc(file) != EOF) {
+            *ret_err = ferror(file) ? 5 : 1;
+            _hashtable_free(allocator, ret);
+            ret = 0;
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+#ifdef HASHTABLE_MMAP
+
+/* The allocator ctx of a table loaded from a mapped file. Arrays the table
+ * grows into come from malloc(). The record outlives the mapping until the
+ * table is destroyed, so that an array that malloc() places where the mapped
+ * buckets were is not taken for them. */
+struct _hashtable_file_map {
+    unsigned char   *map;
+    size_t          length;
+};
+
+static void *_hashtable_file_alloc(void *ctx, size_t size)
+    {(void)ctx; return malloc(size);}
+
+static void _hashtable_file_release(void *ctx, void *ptr)
+{
+    struct _hashtable_file_map *file_map = ctx;
+    if (file_map->map && ptr == file_map->map + HASHTABLE_FILE_HEADER) {
+        munmap(file_map->map, file_map->length);
+        file_map->map = 0;
+    } else
+        free(ptr);
+}
+
+/* Map the file and point allocator at its record. Returns 0 for an empty
+ * table. */
+static unsigned char *_hashtable_load_map(int *ret_err, const char *path,
+    unsigned flags, const struct _hashtable_file_header *expected,
+    struct _hashtable_file_header *header,
+    struct hashtable_allocator *allocator)
+{
+    struct stat file_stat;
+    int         fd  = open(path, O_RDONLY | O_CLOEXEC);
+    *ret_err = 5;
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &file_stat) || pread(fd, header, sizeof(*header), 0) < 0) {
+        close(fd);
+        return 0;
+    }
+    uint64_t size = (uint64_t)file_stat.st_size;
+    *ret_err = 1;
+    if (size < HASHTABLE_FILE_HEADER ||
+        _hashtable_file_check(header, expected) ||
+        size - HASHTABLE_FILE_HEADER != header->data_size) {
+        close(fd);
+        return 0;
+    }
+    *ret_err = 0;
+    if (!header->data_size) {
+        close(fd);
+        return 0;
+    }
+    int prot        = PROT_READ;
+    int map_flags   = MAP_PRIVATE;
+    if (flags & HASHTABLE_LOAD_WRITABLE)
+        prot |= PROT_WRITE;
+#ifdef MAP_POPULATE
+    if (flags & HASHTABLE_LOAD_POPULATE)
+        map_flags |= MAP_POPULATE;
+#endif
+    size_t                      length      = (size_t)size;
+    struct _hashtable_file_map  *file_map   = malloc(sizeof(*file_map));
+    unsigned char               *map        = file_map ?
+        mmap(0, length, prot, map_flags, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        *ret_err = file_map ? 5 : 4;
+        free(file_map);
+        return 0;
+    }
+    file_map->map       = map;
+    file_map->length    = length;
+    allocator->alloc    = _hashtable_file_alloc;
+    allocator->release  = _hashtable_file_release;
+    allocator->ctx      = file_map;
+    allocator->zeroed   = 0;
+    return map + HASHTABLE_FILE_HEADER;
+}
+
+#endif
+
+void *_hashtable_load(int *ret_err, const char *path, size_t hash_id,
+    unsigned flags, size_t *HASHTABLE_RESTRICT num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_size, size_t value_off, size_t hash_off,
+    const struct hashtable_config *config)
+{
+    struct _hashtable_file_header header;
+    struct _hashtable_file_header expected;
+    memset(&expected, 0, sizeof(expected));
+    expected.size_t_size    = sizeof(size_t);
+    expected.group_width    = HASHTABLE_GROUP_WIDTH;
+    expected.bucket_size    = bucket_size;
+    expected.key_size       = key_size;
+    expected.value_off      = value_off;
+    expected.hash_off       = hash_off;
+    expected.hash_id        = hash_id;
+    struct hashtable_allocator allocator = {0, 0, 0, 0};
+    if (config && config->allocator)
+        allocator = *config->allocator;
+    unsigned char   *buckets;
+    int             err;
+    int             mapped  = 0;
+#ifdef HASHTABLE_MMAP
+    if (!(flags & HASHTABLE_LOAD_COPY)) {
+        buckets = _hashtable_load_map(&err, path, flags, &expected, &header,
+            &allocator);
+        mapped  = buckets != 0;
+    } else
+#endif
+        buckets = _hashtable_load_copy(&err, path, &expected, &header,
+            &allocator);
+    if (!err && (flags & HASHTABLE_LOAD_VERIFY) &&
+        _hashtable_checksum(buckets, (size_t)header.data_size) !=
+            header.checksum) {
+        _hashtable_free(&allocator, buckets);
+        if (mapped)
+            free(allocator.ctx);
+        buckets = 0;
+        err     = 1;
+    }
+    if (err) {
+        if (ret_err)
+            *ret_err = err;
+        return 0;
+    }
+    *num_buckets        = (size_t)header.num_buckets;
+    *num_values         = (size_t)header.num_values;
+    memset(state, 0, sizeof(*state));
+    state->flags            = (unsigned)header.flags;
+    if (mapped)
+        state->flags |= _HASHTABLE_MAPPED;
+    if (mapped && !(flags & HASHTABLE_LOAD_WRITABLE))
+        state->flags |= _HASHTABLE_READ_ONLY;
+    if (config)
+        state->flags |= config->flags & _HASHTABLE_RETAIN_BUCKETS;
+    if ((state->flags & HASHTABLE_SWISS) && buckets)
+        state->ctrl = buckets + *num_buckets * bucket_size;
+    state->num_deleted      = (size_t)header.num_deleted;
+    state->load_factor      = (unsigned)header.load_factor;
+    state->growth_factor    = (unsigned)header.growth_factor;
+    state->key_stride       = value_off;
+    state->value_stride     = hash_off - value_off;
+    state->compute_hash     = config && config->compute_hash ?
+        config->compute_hash : hashtable_hash;
+    state->key_size         = key_size;
+    state->allocator        = allocator;
+    state->parallel_for     = config ? config->parallel_for : 0;
+    state->num_threads      = config ? config->num_threads : 0;
+    if (ret_err)
+        *ret_err = 0;
+    return buckets;
+}
@@ -19,6 +19,9 @@
 #define HASHTABLE_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 /* =============================================================================
  * hashtable()
@@ -36,13 +39,44 @@
         _hashtable_body(key_type, value_type) \
     }
 
+/* =============================================================================
+ * hashtable_compact()
+ * Declare a new hashtable variable whose buckets only hold a key and a value.
+ * Other tables store the full size_t hash of each entry in its bucket. A compact
+ * table instead probes a HASHTABLE_SWISS control tag array: each tag records
+ * whether its bucket is in use and 7 bits of the hash, which rejects most
+ * mismatching buckets before their keys are compared. Hashes are recomputed
+ * from the keys with the compute_hash function of the table's config when the
+ * table resizes, so every hash passed to the table must be computed by that
+ * function from a pointer to the key and the size of the key's type. For a
+ * table of 4-byte keys and values, a bucket takes 9 bytes instead of 16.
+ * Compact tables are always HASHTABLE_SWISS tables, may hold a hash of 0 and
+ * cannot be HASHTABLE_SOA tables. Apart from that, they are used through the
+ * same macros as any other table.
+ *
+ * PARAMETERS
+ * key_type:    The type of the key used by this table.
+ * value_type:  The type of the values contained by this table.
+ *
+ * EXAMPLE
+ * hashtable_compact(uint32_t, uint32_t) my_table;
+ * hashtable_init(my_table, 64, NULL);
+ * uint32_t key = 5, value = 10;
+ * hashtable_insert(my_table, key, hashtable_hash(&key, sizeof(key)), value,
+ *     NULL);
+ * ===========================================================================*/
+#define hashtable_compact(key_type, value_type) \
+    struct { \
+        _hashtable_compact_body(key_type, value_type) \
+    }
+
 /* =============================================================================
  * hashtable_init()
  * Initialize a hashtable.
  *
  * PARAMETERS
  * table:   The hashtable to initialize.
- * size:    Number of initial buckets.
+ * size:    Number of initial buckets. Rounded up to the next power of two.
  * ret_err: A pointer to an int to which a potential error code is written. Can
  *          be NULL. A value of 0 indicates success.
  *
@@ -50,8 +84,7 @@
  * void
  * ===========================================================================*/
 #define hashtable_init(table, size, ret_err) \
-    ((void)((table)._buckets = _hashtable_init(&(table)._num_buckets, (size), \
-        sizeof(*(table)._buckets), &(table)._num_values, (ret_err))))
+    hashtable_init_ext(table, size, 0, ret_err)
 
 /* =============================================================================
  * hashtable_einit()
@@ -60,8 +93,190 @@
  * wrong.
  * ===========================================================================*/
 #define hashtable_einit(table, size) \
+    hashtable_einit_ext(table, size, 0)
+
+/* =============================================================================
+ * struct hashtable_config
+ * Options for hashtable_init_ext(). Fields left zero select the default
+ * behaviour, so a config is best written with designated initializers.
+ *
+ * FIELDS
+ * flags:   A combination of the following flags, or 0.
+ *          HASHTABLE_SWISS: Store a separate array of 1-byte control tags
+ *          (7 bits of the hash, or an empty/deleted marker) next to the
+ *          buckets and probe it a group of 16 (SSE2) or 32 (AVX2) tags at a
+ *          time. Buckets are only touched on a tag match, which suits
+ *          read-heavy tables and allows a higher load factor. A hash of 0
+ *          may be inserted into such a table.
+ *          HASHTABLE_ROBIN_HOOD: Place entries of the default linear probing
+ *          engine by Robin Hood hashing. An inserted entry takes the bucket of
+ *          the first entry on its probe sequence that is closer to its own
+ *          home bucket, which keeps probe sequence lengths even and lets
+ *          lookups of missing keys stop as soon as they pass an entry closer to
+ *          home. Erasure shifts the following entries back. Has no effect on
+ *          HASHTABLE_SWISS tables.
+ *          HASHTABLE_INCREMENTAL: Instead of rehashing every entry at once
+ *          when the table grows, keep the old bucket array next to the new one
+ *          and move a bounded number of old buckets over on each insertion and
+ *          erasure. Lookups and hashtable_for_each_pair() see both arrays
+ *          while entries are being moved. Lookups themselves never move
+ *          entries, so a pointer returned by hashtable_find() stays valid
+ *          until the next insertion or erasure, as with any table. Has no
+ *          effect on HASHTABLE_SWISS tables.
+ *          HASHTABLE_SOA: Store the buckets of the default linear probing
+ *          engine as a structure of arrays: the hashes in one dense array,
+ *          followed by an array of keys and an array of values. Probing then
+ *          reads eight hashes per cache line and only touches a key once its
+ *          hash matches, and a value once its key matches, which pays off for
+ *          large keys or values. Moving a bucket touches three arrays instead
+ *          of one, making insertion and erasure somewhat slower. May be
+ *          combined with HASHTABLE_ROBIN_HOOD, but not with HASHTABLE_SWISS,
+ *          whose tags already keep the probed data apart from the buckets, or
+ *          with HASHTABLE_INCREMENTAL.
+ * load_factor:
+ *          The percentage of buckets in use at which the table grows, from 1
+ *          to 95. Defaults to HASHTABLE_LOAD_FACTOR, or
+ *          HASHTABLE_SWISS_LOAD_FACTOR for HASHTABLE_SWISS tables. Higher
+ *          values save memory at the cost of longer probe sequences, which
+ *          HASHTABLE_ROBIN_HOOD and HASHTABLE_SWISS tables cope with best.
+ * growth_factor:
+ *          The percentage the bucket count is multiplied by when the table
+ *          grows. Defaults to HASHTABLE_GROWTH_FACTOR * 100. Bucket counts are
+ *          powers of two, so it must be 200, 400, 800 and so on. Other values
+ *          such as 150 are rejected rather than rounded up. Memory is saved
+ *          through the load factor instead.
+ * compute_hash:
+ *          The function the hashes passed to the table were computed with,
+ *          hashtable_hash() by default. Only hashtable_compact() tables, which
+ *          store no hashes, use it: they recompute the hash of each entry from
+ *          its key when they resize. Its signature must be as follows:
+ *          size_t compute_hash(const void *data, size_t size)
+ *          The size of the key's type is passed as parameter size.
+ * allocator:
+ *          A pointer to a struct hashtable_allocator that provides the memory
+ *          of the table's bucket arrays, or NULL for calloc() and free(). The
+ *          struct is copied, so it need not outlive the call.
+ * parallel_for:
+ *          A function that calls fn for ranges covering [0, end) from several
+ *          threads and returns once all calls have returned, such as
+ *          hashtable_parallel_for(), or NULL. If set, a table of the default
+ *          linear probing engine, with or without HASHTABLE_ROBIN_HOOD, with
+ *          at least 65536 buckets is rebuilt on several threads when it
+ *          grows: each call places the entries whose new home bucket is in
+ *          its range, so threads never write to the same buckets.
+ *          HASHTABLE_SWISS and HASHTABLE_SOA tables and the entry moves of
+ *          HASHTABLE_INCREMENTAL tables stay serial. Its signature must be as
+ *          follows:
+ *          void parallel_for(size_t end, unsigned num_threads,
+ *              void (*fn)(void *ctx, size_t begin, size_t end,
+ *                  unsigned thread),
+ *              void *ctx);
+ * num_threads:
+ *          Passed to parallel_for, where 0 stands for one thread per CPU.
+ *
+ * EXAMPLE
+ * struct hashtable_config config = {.flags = HASHTABLE_SWISS};
+ * struct hashtable_config dense = {.flags = HASHTABLE_ROBIN_HOOD,
+ *     .load_factor = 90};
+ * struct hashtable_config parallel = {.parallel_for = hashtable_parallel_for};
+ * ===========================================================================*/
+struct hashtable_config {
+    unsigned flags;
+    unsigned load_factor;
+    unsigned growth_factor;
+    size_t   (*compute_hash)(const void *data, size_t size);
+    const struct hashtable_allocator *allocator;
+    void     (*parallel_for)(size_t end, unsigned num_threads,
+        void (*fn)(void *ctx, size_t begin, size_t end, unsigned thread),
+        void *ctx);
+    unsigned num_threads;
+};
+
+/* =============================================================================
+ * struct hashtable_allocator
+ * Memory callbacks of a table, set through struct hashtable_config. Bucket
+ * arrays are only ever allocated whole and freed whole: a resize allocates the
+ * new array while the old one is still being read, so there is no reallocation
+ * callback.
+ *
+ * FIELDS
+ * alloc:   Returns size bytes of memory aligned as by malloc(), or NULL if out
+ *          of memory. The memory need not be zeroed. Must have the following
+ *          signature:
+ *          void *alloc(void *ctx, size_t size);
+ * release: Frees memory returned by alloc. May be NULL if the memory is
+ *          released by other means, as with hashtable_arena_allocator(). Must
+ *          have the following signature:
+ *          void release(void *ctx, void *ptr);
+ * ctx:     Passed to both functions.
+ * zeroed:  Nonzero if alloc always returns zeroed memory, such as fresh pages
+ *          from the operating system, which the table then need not clear.
+ *
+ * EXAMPLE
+ * struct hashtable_allocator allocator = {my_pool_alloc, my_pool_free, pool,
+ *     0};
+ * struct hashtable_config config = {.allocator = &allocator};
+ * hashtable_init_ext(my_table, 64, &config, NULL);
+ * ===========================================================================*/
+struct hashtable_allocator {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*release)(void *ctx, void *ptr);
+    void *ctx;
+    int  zeroed;
+};
+
+#define HASHTABLE_SWISS         (1u << 0)
+#define HASHTABLE_ROBIN_HOOD    (1u << 1)
+#define HASHTABLE_INCREMENTAL   (1u << 2)
+#define HASHTABLE_SOA           (1u << 3)
+
+/* =============================================================================
+ * hashtable_init_ext()
+ * Like hashtable_init(), but accepts a pointer to a struct hashtable_config
+ * describing how the table should be stored and probed. The options are
+ * fixed for the table's lifetime. Apart from initialization, such a table is
+ * used through the same macros as any other table.
+ *
+ * PARAMETERS
+ * table:   The hashtable to initialize.
+ * size:    Number of initial buckets. Rounded up to the next power of two.
+ * config:  A pointer to a struct hashtable_config, or NULL for the defaults.
+ * ret_err: A pointer to an int to which a potential error code is written. Can
+ *          be NULL. A value of 0 indicates success, 1 that memory could not be
+ *          allocated or that the config is out of range.
+ *
+ * RETURN VALUE
+ * void
+ *
+ * EXAMPLE
+ * hashtable(uint32_t, int) my_table;
+ * struct hashtable_config config = {.flags = HASHTABLE_SWISS};
+ * hashtable_init_ext(my_table, 64, &config, NULL);
+ * ===========================================================================*/
+#define hashtable_init_ext(table, size, config, ret_err) \
+    ((void)((table)._buckets = _hashtable_init(&(table)._num_buckets, (size), \
+        sizeof(*(table)._buckets), \
+        sizeof((table)._buckets[0]._key), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), \
+        &(table)._num_values, &(table)._state, (config), (ret_err))))
+
+/* =============================================================================
+ * hashtable_einit_ext()
+ * Same as hashtable_init_ext(), but calls the function pointed to by
+ * hashtable_panic instead of returning an error status.
+ * ===========================================================================*/
+#define hashtable_einit_ext(table, size, config) \
     ((void)((table)._buckets = _hashtable_einit(&(table)._num_buckets, (size), \
-        sizeof((table)._buckets[0]), &(table)._num_values)))
+        sizeof((table)._buckets[0]), \
+        sizeof((table)._buckets[0]._key), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), \
+        &(table)._num_values, &(table)._state, (config))))
 
 /* =============================================================================
  * hashtable_clear()
@@ -75,22 +290,25 @@
  *              void free_key(void *key);
  *
  * RETURN VALUE
- * void
+ * 0, or 1 without changing the table if it was loaded read-only by
+ * hashtable_load().
  * ===========================================================================*/
 #define hashtable_clear(table, free_key) \
     _hashtable_clear((unsigned char*)(table)._buckets, (table)._num_buckets, \
-        sizeof((table)._buckets[0]), &(table)._num_values, \
+        sizeof((table)._buckets[0]), &(table)._num_values, &(table)._state, \
         _hashtable_ptr_offset(&(table)._buckets[0]._key, \
             &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
         _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
             &(table)._buckets[0]), \
         free_key)
 
 #define hashtable_num_buckets(table) \
-    (table._num_buckets)
+    ((table)._num_buckets)
 
 #define hashtable_num_values(table) \
-    (table._num_values)
+    ((table)._num_values)
 
 /* =============================================================================
  * hashtable_destroy()
@@ -112,8 +330,78 @@
         sizeof((table)._buckets[0]), \
         _hashtable_ptr_offset(&(table)._buckets[0]._key, \
             &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), (table)._num_values, &(table)._state)
+
+/* =============================================================================
+ * hashtable_reserve()
+ * Make room for at least num_values entries, so that inserting up to that many
+ * values in total does not grow the table. Never shrinks the table.
+ *
+ * PARAMETERS
+ * table:       The hashtable.
+ * num_values:  The number of values the table should hold without growing.
+ * ret_err:     A pointer to an int to which a potential error code is written.
+ *              Can be NULL. A value of 0 indicates success, 1 that the size is
+ *              too large or that the table was loaded read-only by
+ *              hashtable_load(), and 4 that memory could not be allocated.
+ *
+ * RETURN VALUE
+ * void
+ *
+ * EXAMPLE
+ * hashtable_reserve(my_table, num_items, NULL);
+ * for (size_t i = 0; i < num_items; ++i)
+ *     hashtable_insert(my_table, keys[i], hashes[i], values[i], NULL);
+ * ===========================================================================*/
+#define hashtable_reserve(table, num_values, ret_err) \
+    ((void)((table)._buckets = _hashtable_reserve((ret_err), \
+        (unsigned char*)(table)._buckets, &(table)._num_buckets, \
+        (table)._num_values, &(table)._state, sizeof((table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), (num_values))))
+
+/* =============================================================================
+ * hashtable_rehash()
+ * Rebuild the table with the given number of buckets, rounded up to the next
+ * power of two. If the table's current entries need more buckets than that,
+ * the smallest sufficient bucket count is used instead. Rehashing also drops
+ * any deleted entries a HASHTABLE_SWISS table is still carrying and finishes
+ * an ongoing HASHTABLE_INCREMENTAL resize.
+ *
+ * PARAMETERS
+ * table:       The hashtable.
+ * num_buckets: The requested number of buckets.
+ * ret_err:     A pointer to an int to which a potential error code is written.
+ *              Can be NULL. Same error codes as hashtable_reserve().
+ *
+ * RETURN VALUE
+ * void
+ * ===========================================================================*/
+#define hashtable_rehash(table, num_buckets, ret_err) \
+    ((void)((table)._buckets = _hashtable_rehash((ret_err), \
+        (unsigned char*)(table)._buckets, &(table)._num_buckets, \
+        (table)._num_values, &(table)._state, sizeof((table)._buckets[0]), \
         _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
-            &(table)._buckets[0]), (table)._num_values)
+            &(table)._buckets[0]), (num_buckets))))
+
+/* =============================================================================
+ * hashtable_shrink_to_fit()
+ * Shrink the table to the smallest bucket count holding its current entries,
+ * for example to return memory after erasing most of them.
+ *
+ * PARAMETERS
+ * table:       The hashtable.
+ * ret_err:     A pointer to an int to which a potential error code is written.
+ *              Can be NULL. Same error codes as hashtable_reserve().
+ *
+ * RETURN VALUE
+ * void
+ * ===========================================================================*/
+#define hashtable_shrink_to_fit(table, ret_err) \
+    hashtable_rehash(table, 0, ret_err)
 
 /* =============================================================================
  * hashtable_insert()
@@ -189,9 +477,9 @@
  * ===========================================================================*/
 #define hashtable_insert_ext(table, key, hash, value, \
     compare_keys, copy_key, ret_err) \
-    ((void)((table)._buckets = _hashtable_insert((ret_err), \
+    ((void)((table)._buckets = _hashtable_insert_impl((ret_err), \
         (unsigned char*)(table)._buckets, \
-        &(table)._num_buckets, &(table)._num_values, \
+        &(table)._num_buckets, &(table)._num_values, &(table)._state, \
         sizeof(*(table)._buckets), \
         _hashtable_ptr_offset(&(table)._buckets[0]._key, \
             &(table)._buckets[0]), \
@@ -205,7 +493,7 @@
 #define hashtable_einsert_ext(table, key, hash, value, compare_keys, copy_key) \
     ((void)((table)._buckets = _hashtable_einsert( \
         (unsigned char*)(table)._buckets, &(table)._num_buckets, \
-        &(table)._num_values, sizeof(*(table)._buckets), \
+        &(table)._num_values, &(table)._state, sizeof(*(table)._buckets), \
         _hashtable_ptr_offset(&(table)._buckets[0]._key, \
             &(table)._buckets[0]), \
         _hashtable_ptr_offset(&(table)._buckets[0]._value, \
@@ -259,9 +547,9 @@
  * A void * to the value, or NULL if value is not found.
  * ===========================================================================*/
 #define hashtable_find_ext(table, key, hash, compare_keys) \
-    _hashtable_find(&key, sizeof(key), \
+    _hashtable_find_impl(&key, sizeof(key), \
         hash, (unsigned char*)(table)._buckets, (table)._num_buckets, \
-        sizeof((table)._buckets[0]), \
+        &(table)._state, sizeof((table)._buckets[0]), \
         _hashtable_ptr_offset(&(table)._buckets[0]._key, \
             &(table)._buckets[0]), \
         _hashtable_ptr_offset(&(table)._buckets[0]._value, \
@@ -281,7 +569,8 @@
  * hash:    The hash computed from the key. Must be of type size_t.
  *
  * RETURN VALUE
- * void
+ * 0, or 1 without changing the table if it was loaded read-only by
+ * hashtable_load().
  *
  * EXAMPLE
  * size_t hash_u32(uint32_t key);       // Custom hash function
@@ -316,11 +605,11 @@
  *                  void free_key(void *key);
  *
  * RETURN VALUE
- * void
+ * Same as for hashtable_erase().
  * ===========================================================================*/
 #define hashtable_erase_ext(table, key, hash, compare_keys, free_key) \
-    _hashtable_erase((unsigned char*)(table)._buckets, (table)._num_buckets, \
-        &(table)._num_values, &key, sizeof(key), \
+    _hashtable_erase_impl((unsigned char*)(table)._buckets, (table)._num_buckets, \
+        &(table)._num_values, &(table)._state, &key, sizeof(key), \
         hash, \
         sizeof((table)._buckets[0]), \
         _hashtable_ptr_offset(&(table)._buckets[0]._key, \
@@ -365,6 +654,243 @@
 #define hashtable_exists_ext(table, key, hash, compare_keys) \
     (hashtable_find_ext(table, key, hash, compare_keys) ? 1 : 0)
 
+/* =============================================================================
+ * hashtable_find_by()
+ * Find a value by a key of any type and a hash computed by the caller, such as
+ * a string table by a struct hashtable_str_view of a buffer. Unlike for
+ * hashtable_find_ext(), the key need not be a variable of the table's key
+ * type, so no temporary key has to be built, and a hash computed once may be
+ * used to find the key in several tables.
+ *
+ * PARAMETERS
+ * table:           The hashtable to find from
+ * key:             A pointer to the key to find.
+ * key_size:        Passed to compare_keys as its size parameter.
+ * hash:            The hash of the key, equal to the hash the matching key of
+ *                  the table was inserted with. Must be of type size_t.
+ * compare_keys:    A pointer to a function that returns 0 if a key of the
+ *                  table equals the searched key. Parameter a points to the
+ *                  table's key and b is the key pointer passed to this macro.
+ *                  Signature must be as follows:
+ *                  int compare_keys(const void *a, const void *b, size_t size);
+ *
+ * RETURN VALUE
+ * A void * to the value, or NULL if value is not found.
+ *
+ * EXAMPLE
+ * hashtable(const char*, int) my_table; // Hashed by hashtable_str_hash()
+ * ...
+ * struct hashtable_str_view name = hashtable_str_view(buf + off, len);
+ * int *value = hashtable_find_by(my_table, &name, sizeof(name),
+ *     hashtable_str_view_hash(&name, sizeof(name)),
+ *     hashtable_str_compare_view);
+ * ===========================================================================*/
+#define hashtable_find_by(table, key, key_size, hash, compare_keys) \
+    _hashtable_find_impl((key), (key_size), \
+        hash, (unsigned char*)(table)._buckets, (table)._num_buckets, \
+        &(table)._state, sizeof((table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._key, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), \
+            compare_keys)
+
+/* =============================================================================
+ * hashtable_exists_by()
+ * Like hashtable_exists(), but takes the same parameters as
+ * hashtable_find_by().
+ * ===========================================================================*/
+#define hashtable_exists_by(table, key, key_size, hash, compare_keys) \
+    (hashtable_find_by(table, key, key_size, hash, compare_keys) ? 1 : 0)
+
+/* =============================================================================
+ * hashtable_erase_by()
+ * Like hashtable_erase_ext(), but takes the key, its size, the hash and
+ * compare_keys as hashtable_find_by() does. free_key is passed the table's
+ * key, as for hashtable_erase_ext().
+ * ===========================================================================*/
+#define hashtable_erase_by(table, key, key_size, hash, compare_keys, \
+    free_key) \
+    _hashtable_erase_impl((unsigned char*)(table)._buckets, (table)._num_buckets, \
+        &(table)._num_values, &(table)._state, (key), (key_size), \
+        hash, \
+        sizeof((table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._key, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), \
+        compare_keys, free_key)
+
+/* =============================================================================
+ * hashtable_find_batch()
+ * Find the values of n keys at once. The first cache line each lookup needs is
+ * prefetched several keys ahead of the probe itself, so lookups in a table
+ * much larger than the CPU caches overlap their memory accesses instead of
+ * waiting for each one in turn. Always probes the table using hashtable.c,
+ * even if HASHTABLE_INLINE is defined.
+ *
+ * PARAMETERS
+ * table:       The hashtable to find from
+ * keys:        A pointer to an array of n keys of the correct type.
+ * hashes:      A pointer to an array of the n hashes computed from keys.
+ * n:           The number of keys to find.
+ * ret_values:  An array of n void pointers, to which a pointer to the value
+ *              of each key, or NULL, is written. NULL if not needed.
+ *
+ * RETURN VALUE
+ * The number of keys found, as a size_t.
+ *
+ * EXAMPLE
+ * hashtable(uint32_t, int) my_table;
+ * ...
+ * uint32_t keys[256];
+ * size_t   hashes[256];
+ * void     *values[256];
+ * for (size_t i = 0; i < 256; ++i)
+ *     hashes[i] = hashtable_hash(&keys[i], sizeof(keys[i]));
+ * hashtable_find_batch(my_table, keys, hashes, 256, values);
+ * ===========================================================================*/
+#define hashtable_find_batch(table, keys, hashes, n, ret_values) \
+    hashtable_find_batch_ext(table, keys, hashes, n, hashtable_compare_keys, \
+        ret_values)
+
+/* =============================================================================
+ * hashtable_find_batch_ext()
+ * Like hashtable_find_batch(), but uses a custom key comparison function as
+ * hashtable_find_ext() does.
+ * ===========================================================================*/
+#define hashtable_find_batch_ext(table, keys, hashes, n, compare_keys, \
+    ret_values) \
+    _hashtable_find_batch((keys), sizeof(*(keys)), (hashes), (n), \
+        (unsigned char*)(table)._buckets, (table)._num_buckets, \
+        &(table)._state, sizeof((table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._key, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), \
+        compare_keys, (ret_values))
+
+/* =============================================================================
+ * hashtable_insert_batch()
+ * Insert n key-hash-value combinations. The table first grows to fit all of
+ * them, and the home bucket of each key is prefetched several keys ahead of its
+ * insertion. Keys already in the table are skipped, as are later duplicates
+ * within the batch.
+ *
+ * PARAMETERS
+ * table:   The hashtable
+ * keys:    A pointer to an array of n keys of the correct type.
+ * hashes:  A pointer to an array of the n hashes computed from keys.
+ * values:  A pointer to an array of n values of the correct type.
+ * n:       The number of key-value pairs to insert.
+ * ret_err: A pointer to an int to write a return code to. NULL if none. A value
+ *          of 0 indicates success. Otherwise the same codes as for
+ *          hashtable_insert() apply, except that 2 is never reported. The
+ *          pairs before the failing one have been inserted.
+ *
+ * RETURN VALUE
+ * void
+ * ===========================================================================*/
+#define hashtable_insert_batch(table, keys, hashes, values, n, ret_err) \
+    hashtable_insert_batch_ext(table, keys, hashes, values, n, \
+        hashtable_compare_keys, hashtable_copy_key, ret_err)
+
+/* =============================================================================
+ * hashtable_insert_batch_ext()
+ * Like hashtable_insert_batch(), but uses custom key comparison and key
+ * duplication functions as hashtable_insert_ext() does.
+ * ===========================================================================*/
+#define hashtable_insert_batch_ext(table, keys, hashes, values, n, \
+    compare_keys, copy_key, ret_err) \
+    ((void)((table)._buckets = _hashtable_insert_batch((ret_err), \
+        (unsigned char*)(table)._buckets, \
+        &(table)._num_buckets, &(table)._num_values, &(table)._state, \
+        sizeof(*(table)._buckets), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._key, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), \
+        (keys), sizeof(*(keys)), (hashes), (values), sizeof(*(values)), (n), \
+        compare_keys, copy_key)))
+
+/* =============================================================================
+ * hashtable_build()
+ * Insert n key-hash-value combinations from arrays, typically to construct a
+ * table from columnar data. The table grows once to fit all of them. If the
+ * table's config has a parallel_for and the table is one of the default
+ * linear probing engine with at least 65536 buckets, the pairs are placed by
+ * several threads. They first group the pairs by home bucket in one pass over
+ * the hashes, split by input range, and then each inserts the pairs whose
+ * home bucket lies in its own range of buckets. copy_key must then be safe to
+ * call from several threads. Pairs whose probe would leave their thread's
+ * range are inserted afterwards by the calling thread.
+ *
+ * PARAMETERS
+ * table:   The hashtable
+ * keys:    A pointer to an array of n keys of the correct type.
+ * hashes:  A pointer to an array of the n hashes computed from keys.
+ * values:  A pointer to an array of n values of the correct type.
+ * n:       The number of key-value pairs to insert.
+ * policy:  How a key that is already in the table or that occurs several
+ *          times in keys is handled:
+ *          HASHTABLE_BUILD_KEEP_FIRST: Keep the value inserted first.
+ *          HASHTABLE_BUILD_KEEP_LAST: Replace the value by the later one, so
+ *          that the value of the last occurrence in keys is kept.
+ *          HASHTABLE_BUILD_UNIQUE: Keys are expected to be unique. Same as
+ *          HASHTABLE_BUILD_KEEP_FIRST, but 2 is returned if they are not.
+ * ret_err: A pointer to an int to write a return code to. NULL if none. A value
+ *          of 0 indicates success. Otherwise the same codes as for
+ *          hashtable_insert() apply, where 2 is only reported for
+ *          HASHTABLE_BUILD_UNIQUE after inserting every pair. 1 is reported
+ *          without inserting any pair if a hash is 0. If copy_key fails, the
+ *          pairs it could not copy are skipped, every other pair is inserted
+ *          and 3 is reported, whether or not several threads place the
+ *          pairs.
+ *
+ * RETURN VALUE
+ * void
+ *
+ * EXAMPLE
+ * hashtable(uint32_t, float) prices;
+ * hashtable_init(prices, 0, 0);
+ * ... Fill item_ids, item_hashes and item_prices ...
+ * hashtable_build(prices, item_ids, item_hashes, item_prices, num_items,
+ *     HASHTABLE_BUILD_KEEP_LAST, &err);
+ * ===========================================================================*/
+#define hashtable_build(table, keys, hashes, values, n, policy, ret_err) \
+    hashtable_build_ext(table, keys, hashes, values, n, policy, \
+        hashtable_compare_keys, hashtable_copy_key, ret_err)
+
+#define HASHTABLE_BUILD_KEEP_FIRST  0
+#define HASHTABLE_BUILD_KEEP_LAST   1
+#define HASHTABLE_BUILD_UNIQUE      2
+
+/* =============================================================================
+ * hashtable_build_ext()
+ * Like hashtable_build(), but uses custom key comparison and key duplication
+ * functions as hashtable_insert_ext() does.
+ * ===========================================================================*/
+#define hashtable_build_ext(table, keys, hashes, values, n, policy, \
+    compare_keys, copy_key, ret_err) \
+    ((void)((table)._buckets = _hashtable_build((ret_err), \
+        (unsigned char*)(table)._buckets, \
+        &(table)._num_buckets, &(table)._num_values, &(table)._state, \
+        sizeof(*(table)._buckets), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._key, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), \
+        (keys), sizeof(*(keys)), (hashes), (values), sizeof(*(values)), (n), \
+        (policy), compare_keys, copy_key)))
+
 /* =============================================================================
  * hashtable_for_each_pair()
  * Iterate through each key-value pair in the table. The table must not be
@@ -384,7 +910,9 @@
         _hashtable_for_each_pair(&hashtable_i__, &hashtable_j__, &ret_key, \
             &ret_value, sizeof(table._buckets[0]._key), \
             sizeof(table._buckets[0]._value), table._num_values, \
-            (unsigned char*)table._buckets, sizeof(table._buckets[0]), \
+            (unsigned char*)table._buckets, table._num_buckets, \
+            &table._state, \
+            sizeof(table._buckets[0]), \
             _hashtable_ptr_offset(&table._buckets[0]._key, \
                 &table._buckets[0]), \
             _hashtable_ptr_offset(&table._buckets[0]._hash, \
@@ -392,6 +920,210 @@
             _hashtable_ptr_offset(&table._buckets[0]._value, \
                 &table._buckets[0]));)
 
+/* =============================================================================
+ * hashtable_for_each_ref()
+ * Iterate through each key-value pair in the table through pointers into the
+ * bucket array, without copying keys or values. The loop is compiled inline
+ * and skips free buckets of HASHTABLE_SWISS tables 8 control tags at a time.
+ * Values may be modified through the pointer, but the table must not be
+ * modified using insert/erase during iteration.
+ *
+ * PARAMETERS
+ * table:       The hashtable to iterate
+ * ret_key:     A pointer to a const key_type, set to each key
+ * ret_value:   A pointer to a value_type, set to each value
+ *
+ * EXAMPLE
+ * hashtable(uint32_t, struct stats) my_table;
+ * ...
+ * const uint32_t  *key;
+ * struct stats    *value;
+ * hashtable_for_each_ref(my_table, key, value) {
+ *     value->total += value->count;
+ * }
+ * ===========================================================================*/
+#define hashtable_for_each_ref(table, ret_key, ret_value) \
+    for (struct _hashtable_ref hashtable_r__ = {0, 0, 0, 0}; \
+        _hashtable_next_ref(&hashtable_r__, SIZE_MAX, \
+            (unsigned char*)(table)._buckets, (table)._num_buckets, \
+            (table)._num_values, &(table)._state, \
+            sizeof((table)._buckets[0]), \
+            _hashtable_ptr_offset(&(table)._buckets[0]._key, \
+                &(table)._buckets[0]), \
+            _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+                &(table)._buckets[0]), \
+            _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+                &(table)._buckets[0])) && \
+        ((ret_key) = hashtable_r__.key, (ret_value) = hashtable_r__.value, 1);)
+
+/* =============================================================================
+ * hashtable_for_each_range()
+ * Like hashtable_for_each_ref(), but only visits the pairs in bucket positions
+ * [begin, end). Positions run from 0 to hashtable_bucket_end(table), so that
+ * disjoint ranges visit disjoint pairs and together every pair once. Several
+ * threads may iterate disjoint ranges of a table at the same time, for
+ * example through hashtable_parallel_for(), as long as no thread modifies the
+ * table other than through the value pointers of its own range.
+ *
+ * PARAMETERS
+ * table:       The hashtable to iterate
+ * begin:       The first bucket position to visit
+ * end:         The bucket position to stop at, clamped to
+ *              hashtable_bucket_end(table)
+ * ret_key:     A pointer to a const key_type, set to each key
+ * ret_value:   A pointer to a value_type, set to each value
+ *
+ * EXAMPLE
+ * size_t half = hashtable_bucket_end(my_table) / 2;
+ * hashtable_for_each_range(my_table, 0, half, key, value) {
+ *     ... Pairs of the first half ...
+ * }
+ * hashtable_for_each_range(my_table, half, SIZE_MAX, key, value) {
+ *     ... Pairs of the second half ...
+ * }
+ * ===========================================================================*/
+#define hashtable_for_each_range(table, begin, end, ret_key, ret_value) \
+    for (struct _hashtable_ref hashtable_r__ = {(begin), 0, 0, 0}; \
+        _hashtable_next_ref(&hashtable_r__, (end), \
+            (unsigned char*)(table)._buckets, (table)._num_buckets, \
+            SIZE_MAX, &(table)._state, \
+            sizeof((table)._buckets[0]), \
+            _hashtable_ptr_offset(&(table)._buckets[0]._key, \
+                &(table)._buckets[0]), \
+            _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+                &(table)._buckets[0]), \
+            _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+                &(table)._buckets[0])) && \
+        ((ret_key) = hashtable_r__.key, (ret_value) = hashtable_r__.value, 1);)
+
+/* =============================================================================
+ * hashtable_bucket_end()
+ * The end of the bucket positions visited by hashtable_for_each_range(). Equal
+ * to hashtable_num_buckets(), plus the old buckets while a
+ * HASHTABLE_INCREMENTAL table is being resized.
+ * ===========================================================================*/
+#define hashtable_bucket_end(table) \
+    ((table)._state.num_old_buckets + (table)._num_buckets)
+
+/* =============================================================================
+ * hashtable_save()
+ * Write a table to a file from which hashtable_load() can restore it without
+ * reinserting its pairs. The file holds a header and the table's bucket array
+ * exactly as it lies in memory, so it must not be used for tables whose keys
+ * or values hold pointers, which would dangle in the loaded table, and it can
+ * only be loaded by a build with the same bucket layout and hash function. An
+ * ongoing HASHTABLE_INCREMENTAL resize is finished first. The file is
+ * overwritten in place; write to a temporary path and rename() it to replace
+ * a file that may be loaded concurrently.
+ *
+ * PARAMETERS
+ * table:   The hashtable to save
+ * path:    The path of the file to write
+ * hash_id: An id of the hash function the table's hashes were computed with,
+ *          which hashtable_load() compares to its own: hashtable_hash_id() for
+ *          hashtable_hash(), or any nonzero value identifying a custom hash
+ *          function. 0 if none.
+ * ret_err: A pointer to an int to write a return code to. NULL if none. A value
+ *          of 0 indicates success, 5 that the file could not be written.
+ *
+ * RETURN VALUE
+ * void
+ *
+ * EXAMPLE
+ * hashtable(uint64_t, uint32_t) my_table;
+ * ...
+ * hashtable_save(my_table, "table.tmp", hashtable_hash_id(sizeof(uint64_t)),
+ *     &err);
+ * if (!err)
+ *     rename("table.tmp", "table.bin");
+ * ===========================================================================*/
+#define hashtable_save(table, path, hash_id, ret_err) \
+    _hashtable_save((ret_err), (path), (hash_id), \
+        (unsigned char*)(table)._buckets, (table)._num_buckets, \
+        (table)._num_values, &(table)._state, sizeof((table)._buckets[0]), \
+        sizeof((table)._buckets[0]._key), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]))
+
+/* =============================================================================
+ * hashtable_load()
+ * Initialize a table from a file written by hashtable_save(). On Linux, the
+ * file is mapped into memory rather than read, so that loading takes the same
+ * time for any table size, and lookups fault in the pages they touch. The
+ * engine, load factor and growth factor of the saved table are kept.
+ *
+ * PARAMETERS
+ * table:   The hashtable to initialize, of the same type as the saved one
+ * path:    The path of the file to read
+ * hash_id: The id of the hash function the table will be probed with, as
+ *          passed to hashtable_save(). The file is rejected if it was saved
+ *          with a different nonzero id. 0 skips the check.
+ * flags:   A combination of the following, or 0 to map the file read-only.
+ *          Such a table can be searched, iterated and destroyed. Inserting,
+ *          erasing, clearing, rehashing and building fail with error 1 and
+ *          leave it unchanged, and its values must not be written through the
+ *          pointers returned by hashtable_find() or hashtable_for_each_ref().
+ *          HASHTABLE_LOAD_WRITABLE: Map the file copy-on-write, so that the
+ *          table can be modified like any other, without changing the file.
+ *          Only touched pages are copied until the table grows.
+ *          HASHTABLE_LOAD_COPY: Read the file into memory from config's
+ *          allocator instead of mapping it. The only mode on other systems.
+ *          HASHTABLE_LOAD_POPULATE: Read a mapped file in while loading, so
+ *          that no lookup waits for the disk.
+ *          HASHTABLE_LOAD_VERIFY: Check the checksum of the bucket array,
+ *          which reads all of it.
+ * config:  A pointer to a struct hashtable_config, or NULL. Only its
+ *          compute_hash, allocator, parallel_for and num_threads are used. A
+ *          mapped table allocates the arrays it grows into with malloc().
+ * ret_err: A pointer to an int to write a return code to. NULL if none. A value
+ *          of 0 indicates success, 1 that the file is not a table of the same
+ *          layout and hash function or is corrupt, 4 that memory could not be
+ *          allocated and 5 that the file could not be read or mapped. The
+ *          table is left uninitialized on failure.
+ *
+ * RETURN VALUE
+ * void
+ *
+ * EXAMPLE
+ * hashtable(uint64_t, uint32_t) my_table;
+ * hashtable_load(my_table, "table.bin", hashtable_hash_id(sizeof(uint64_t)), 0,
+ *     NULL, &err);
+ * ===========================================================================*/
+#define hashtable_load(table, path, hash_id, flags, config, ret_err) \
+    ((void)((table)._buckets = _hashtable_load((ret_err), (path), (hash_id), \
+        (flags), &(table)._num_buckets, &(table)._num_values, \
+        &(table)._state, sizeof((table)._buckets[0]), \
+        sizeof((table)._buckets[0]._key), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._value, \
+            &(table)._buckets[0]), \
+        _hashtable_ptr_offset(&(table)._buckets[0]._hash, \
+            &(table)._buckets[0]), (config))))
+
+#define HASHTABLE_LOAD_WRITABLE (1u << 0)
+#define HASHTABLE_LOAD_COPY     (1u << 1)
+#define HASHTABLE_LOAD_POPULATE (1u << 2)
+#define HASHTABLE_LOAD_VERIFY   (1u << 3)
+
+/* =============================================================================
+ * hashtable_hash_id()
+ * Compute an id of hashtable_hash() for keys of key_size bytes from its hashes
+ * of two fixed keys. Builds whose hashes of such keys differ, for example
+ * through HASHTABLE_CRC32_HASH, get different ids, so that hashtable_load()
+ * rejects files they cannot probe. Tables with a custom hash function pass an
+ * id of their own instead, since such a function may not accept arbitrary key
+ * bytes.
+ *
+ * PARAMETERS
+ * key_size:    The size of the key type
+ *
+ * RETURN VALUE
+ * A nonzero id, or 0 if no probe key could be allocated.
+ * ===========================================================================*/
+size_t hashtable_hash_id(size_t key_size);
+
+
 /* =============================================================================
  * hashtable_define()
  * A macro for defining typesafe hashtables and functions for their use. This
@@ -409,9 +1141,30 @@
  * void TABLE_einit(TABLE *table, size_t size)
  * Same as hashtable_einit().
  *
+ * int TABLE_init_ext(TABLE *table, size_t size,
+ *     const struct hashtable_config *config)
+ * Same as hashtable_init_ext(), but directly returns an error code (zero means
+ * success).
+ *
+ * void TABLE_einit_ext(TABLE *table, size_t size,
+ *     const struct hashtable_config *config)
+ * Same as hashtable_einit_ext().
+ *
  * void TABLE_destroy(TABLE *table)
  * Same as hashtable_destroy().
  *
+ * int TABLE_reserve(TABLE *table, size_t num_values)
+ * Same as hashtable_reserve(), but directly returns an error code (zero means
+ * success).
+ *
+ * int TABLE_rehash(TABLE *table, size_t num_buckets)
+ * Same as hashtable_rehash(), but directly returns an error code (zero means
+ * success).
+ *
+ * int TABLE_shrink_to_fit(TABLE *table)
+ * Same as hashtable_shrink_to_fit(), but directly returns an error code (zero
+ * means success).
+ *
  * int TABLE_insert(TABLE *table, KEY_TYPE key, VALUE_TYPE value)
  * Same as hashtable_insert_ext(), but directly returns an error code (zero
  * means success).
@@ -419,7 +1172,7 @@
  * void TABLE_einsert(TABLE *table, KEY_TYPE key, VALUE_TYPE value)
  * Same as hashtable_einsert_ext().
  *
- * void TABLE_erase(TABLE *table, KEY_TYPE key)
+ * int TABLE_erase(TABLE *table, KEY_TYPE key)
  * Same as hashtable_erase_ext().
  *
  * int TABLE_exists(TABLE *table, KEY_TYPE key)
@@ -428,6 +1181,48 @@
  * VALUE_TYPE *TABLE_find(TABLE *table, KEY_TYPE key)
  * Same as hashtable_find_ext().
  *
+ * size_t TABLE_hash(KEY_TYPE key)
+ * Computes the hash of a key with the table's hash function.
+ *
+ * VALUE_TYPE *TABLE_find_hashed(TABLE *table, KEY_TYPE key, size_t hash)
+ * Same as TABLE_find(), but with a hash returned by TABLE_hash(), for
+ * example one computed once to find the key in several tables.
+ *
+ * VALUE_TYPE *TABLE_find_by(TABLE *table, const void *key, size_t key_size,
+ *     size_t hash, int (*compare_keys)(const void *a, const void *b,
+ *     size_t size))
+ * Same as hashtable_find_by().
+ *
+ * size_t TABLE_find_batch(TABLE *table, const KEY_TYPE *keys, size_t n,
+ *     VALUE_TYPE **ret_values)
+ * Same as hashtable_find_batch_ext(), hashing HASHTABLE_BATCH_SIZE keys at a
+ * time. ret_values may be NULL.
+ *
+ * int TABLE_insert_batch(TABLE *table, const KEY_TYPE *keys,
+ *     const VALUE_TYPE *values, size_t n)
+ * Same as hashtable_insert_batch_ext(), but directly returns an error code
+ * (zero means success).
+ *
+ * int TABLE_build(TABLE *table, const KEY_TYPE *keys,
+ *     const VALUE_TYPE *values, size_t n, unsigned policy)
+ * Same as hashtable_build_ext(), but computes the hashes itself in one pass
+ * over keys, split between threads if the table has a parallel_for, and
+ * directly returns an error code. Returns 4 if the hashes cannot be
+ * allocated.
+ *
+ * int TABLE_save(TABLE *table, const char *path)
+ * Same as hashtable_save() with the hashtable_hash_id() of the key type, but
+ * directly returns an error code. Returns 1 without writing the file unless
+ * the table uses hashtable_hash(), hashtable_compare_keys(),
+ * hashtable_copy_key() and no free_key function, since other keys may hold
+ * pointers.
+ *
+ * int TABLE_load(TABLE *table, const char *path, unsigned flags,
+ *     const struct hashtable_config *config)
+ * Same as hashtable_load() with the same id as TABLE_save(), but directly
+ * returns an error code. Returns 1 without reading the file for the tables
+ * TABLE_save() rejects.
+ *
  * PARAMETERS
  * table_type_name: The type name and function prefix used for the table.
  * key_type:        The type used as key for the table.
@@ -479,6 +1274,16 @@
  *                  called to free the key. The function signature must be as
  *                  follows:
  *                  void free_key(void *key);
+ *
+ * INLINE MODE
+ * If HASHTABLE_INLINE is defined before hashtable.h is included, the generated
+ * insert, find and erase functions (as well as the hashtable_insert(),
+ * hashtable_find() and hashtable_erase() family of macros) probe the table
+ * using static inline code from this header rather than calling into
+ * hashtable.c. Key size, bucket layout and the key functions are then known at
+ * compile time, so for example integer keys using hashtable_compare_keys() are
+ * compared with a single integer comparison. Key functions should be visible
+ * in the including translation unit for them to be inlined.
  * ===========================================================================*/
 #define hashtable_define_ext(table_type_name, key_type, value_type, \
     compute_hash, compare_keys, copy_key, free_key) \
@@ -487,22 +1292,98 @@
         _hashtable_body(key_type, value_type) \
     }; \
     \
-    static inline int table_type_name##_init(struct table_type_name *table, \
-        size_t size) \
+    _hashtable_define_functions(table_type_name, key_type, value_type, \
+        compute_hash, compare_keys, copy_key, free_key)
+
+/* =============================================================================
+ * hashtable_define_compact()
+ * Like hashtable_define(), but defines a hashtable_compact() table. The
+ * generated functions are the same.
+ *
+ * EXAMPLE
+ * hashtable_define_compact(id_table, uint32_t, uint32_t);
+ * ...
+ * struct id_table my_table;
+ * id_table_einit(&my_table, 8);
+ * ===========================================================================*/
+#define hashtable_define_compact(table_type_name, key_type, value_type) \
+    hashtable_define_compact_ext(table_type_name, key_type, value_type, \
+        hashtable_hash, hashtable_compare_keys, hashtable_copy_key, 0)
+
+/* =============================================================================
+ * hashtable_define_compact_ext()
+ * Like hashtable_define_ext(), but defines a hashtable_compact() table. Unless
+ * the config passed to TABLE_init_ext() names a compute_hash function,
+ * compute_hash is also used to rehash the keys when the table resizes.
+ * ===========================================================================*/
+#define hashtable_define_compact_ext(table_type_name, key_type, value_type, \
+    compute_hash, compare_keys, copy_key, free_key) \
+    \
+    struct table_type_name { \
+        _hashtable_compact_body(key_type, value_type) \
+    }; \
+    \
+    _hashtable_define_functions(table_type_name, key_type, value_type, \
+        compute_hash, compare_keys, copy_key, free_key)
+
+#define _hashtable_define_functions(table_type_name, key_type, value_type, \
+    compute_hash, compare_keys, copy_key, free_key) \
+    \
+    static inline int table_type_name##_init_ext( \
+        struct table_type_name *table, size_t size, \
+        const struct hashtable_config *config) \
     { \
+        struct hashtable_config hashed = _hashtable_hashed_config(config, \
+            compute_hash); \
         int err; \
-        hashtable_init(*table, size, &err); \
+        hashtable_init_ext(*table, size, &hashed, &err); \
         return err; \
     } \
     \
+    static inline int table_type_name##_init(struct table_type_name *table, \
+        size_t size) \
+        {return table_type_name##_init_ext(table, size, 0);} \
+    \
+    static inline void table_type_name##_einit_ext( \
+        struct table_type_name *table, size_t size, \
+        const struct hashtable_config *config) \
+    { \
+        if (table_type_name##_init_ext(table, size, config)) \
+            hashtable_panic(); \
+    } \
+    \
     static inline void table_type_name##_einit(struct table_type_name *table, \
         size_t size) \
-        {hashtable_einit(*table, size);} \
+        {table_type_name##_einit_ext(table, size, 0);} \
     \
     static inline void table_type_name##_destroy( \
         struct table_type_name *table) \
         {hashtable_destroy(*table, free_key);} \
     \
+    static inline int table_type_name##_reserve( \
+        struct table_type_name *table, size_t num_values) \
+    { \
+        int err; \
+        hashtable_reserve(*table, num_values, &err); \
+        return err; \
+    } \
+    \
+    static inline int table_type_name##_rehash(struct table_type_name *table, \
+        size_t num_buckets) \
+    { \
+        int err; \
+        hashtable_rehash(*table, num_buckets, &err); \
+        return err; \
+    } \
+    \
+    static inline int table_type_name##_shrink_to_fit( \
+        struct table_type_name *table) \
+    { \
+        int err; \
+        hashtable_shrink_to_fit(*table, &err); \
+        return err; \
+    } \
+    \
     static inline int table_type_name##_insert(struct table_type_name *table, \
         key_type key, value_type value) \
     { \
@@ -521,11 +1402,11 @@
             copy_key); \
     } \
     \
-    static inline void table_type_name##_erase(struct table_type_name *table, \
+    static inline int table_type_name##_erase(struct table_type_name *table, \
         key_type key) \
     { \
         size_t hash = compute_hash(&key, sizeof(key)); \
-        hashtable_erase_ext(*table, key, hash, compare_keys, free_key); \
+        return hashtable_erase_ext(*table, key, hash, compare_keys, free_key); \
     } \
     \
     static inline int table_type_name##_exists(struct table_type_name *table, \
@@ -543,116 +1424,1836 @@
         return hashtable_find_ext(*table, key, hash, compare_keys); \
     } \
     \
-    static inline void table_type_name##_clear(struct table_type_name *table) \
+    static inline size_t table_type_name##_hash(key_type key) \
+        {return compute_hash(&key, sizeof(key));} \
+    \
+    static inline value_type *table_type_name##_find_hashed( \
+        struct table_type_name *table, key_type key, size_t hash) \
+        {return hashtable_find_ext(*table, key, hash, compare_keys);} \
+    \
+    static inline value_type *table_type_name##_find_by( \
+        struct table_type_name *table, const void *key, size_t key_size, \
+        size_t hash, \
+        int (*compare)(const void *a, const void *b, size_t size)) \
+        {return hashtable_find_by(*table, key, key_size, hash, compare);} \
+    \
+    static inline size_t table_type_name##_find_batch( \
+        struct table_type_name *table, const key_type *keys, size_t n, \
+        value_type **ret_values) \
+    { \
+        size_t  num_found = 0; \
+        size_t  hashes[HASHTABLE_BATCH_SIZE]; \
+        void    *values[HASHTABLE_BATCH_SIZE]; \
+        for (size_t i = 0; i < n; i += HASHTABLE_BATCH_SIZE) { \
+            size_t num = n - i < HASHTABLE_BATCH_SIZE ? \
+                n - i : HASHTABLE_BATCH_SIZE; \
+            for (size_t j = 0; j < num; ++j) \
+                hashes[j] = compute_hash(&keys[i + j], sizeof(key_type)); \
+            num_found += hashtable_find_batch_ext(*table, keys + i, hashes, \
+                num, compare_keys, values); \
+            if (ret_values) \
+                for (size_t j = 0; j < num; ++j) \
+                    ret_values[i + j] = (value_type*)values[j]; \
+        } \
+        return num_found; \
+    } \
+    \
+    static inline int table_type_name##_insert_batch( \
+        struct table_type_name *table, const key_type *keys, \
+        const value_type *values, size_t n) \
+    { \
+        int     err = 0; \
+        size_t  hashes[HASHTABLE_BATCH_SIZE]; \
+        if (n > SIZE_MAX - hashtable_num_values(*table)) \
+            return 1; \
+        hashtable_reserve(*table, hashtable_num_values(*table) + n, &err); \
+        for (size_t i = 0; !err && i < n; i += HASHTABLE_BATCH_SIZE) { \
+            size_t num = n - i < HASHTABLE_BATCH_SIZE ? \
+                n - i : HASHTABLE_BATCH_SIZE; \
+            for (size_t j = 0; j < num; ++j) \
+                hashes[j] = compute_hash(&keys[i + j], sizeof(key_type)); \
+            hashtable_insert_batch_ext(*table, keys + i, hashes, values + i, \
+                num, compare_keys, copy_key, &err); \
+        } \
+        return err; \
+    } \
+    \
+    struct table_type_name##_build_hashes { \
+        const key_type  *keys; \
+        size_t          *hashes; \
+    }; \
+    \
+    static inline void table_type_name##_build_hash(void *ctx, size_t begin, \
+        size_t end, unsigned thread) \
+    { \
+        struct table_type_name##_build_hashes *b = ctx; \
+        (void)thread; \
+        for (size_t i = begin; i < end; ++i) \
+            b->hashes[i] = compute_hash(&b->keys[i], sizeof(key_type)); \
+    } \
+    \
+    static inline int table_type_name##_build(struct table_type_name *table, \
+        const key_type *keys, const value_type *values, size_t n, \
+        unsigned policy) \
+    { \
+        int err = 0; \
+        struct table_type_name##_build_hashes b = {keys, \
+            n ? malloc(n * sizeof(size_t)) : 0}; \
+        if (n > SIZE_MAX / sizeof(size_t) || (n && !b.hashes)) { \
+            free(b.hashes); \
+            return 4; \
+        } \
+        if (table->_state.parallel_for) \
+            table->_state.parallel_for(n, table->_state.num_threads, \
+                table_type_name##_build_hash, &b); \
+        else \
+            table_type_name##_build_hash(&b, 0, n, 0); \
+        hashtable_build_ext(*table, keys, b.hashes, values, n, policy, \
+            compare_keys, copy_key, &err); \
+        free(b.hashes); \
+        return err; \
+    } \
+    \
+    static inline int table_type_name##_save(struct table_type_name *table, \
+        const char *path) \
+    { \
+        int err; \
+        if (!_hashtable_plain_keys(compute_hash, compare_keys, copy_key, \
+            free_key)) \
+            return 1; \
+        hashtable_save(*table, path, hashtable_hash_id(sizeof(key_type)), \
+            &err); \
+        return err; \
+    } \
+    \
+    static inline int table_type_name##_load(struct table_type_name *table, \
+        const char *path, unsigned flags, \
+        const struct hashtable_config *config) \
+    { \
+        struct hashtable_config hashed = _hashtable_hashed_config(config, \
+            compute_hash); \
+        int err; \
+        if (!_hashtable_plain_keys(compute_hash, compare_keys, copy_key, \
+            free_key)) \
+            return 1; \
+        hashtable_load(*table, path, hashtable_hash_id(sizeof(key_type)), \
+            flags, &hashed, &err); \
+        return err; \
+    } \
+    \
+    static inline int table_type_name##_clear(struct table_type_name *table) \
     { \
-        hashtable_clear(*table, free_key); \
+        return hashtable_clear(*table, free_key); \
     }
 
 /* =============================================================================
- * hashtable_hash()
- * A default hash function. Uses the 32 bit or 64 bit fnv-a1 algorithm depending
- * on architecture.
+ * struct hashtable_str
+ * The key type of hashtable_define_str() tables. A key of up to
+ * HASHTABLE_STR_INLINE bytes is stored inside the struct, null-terminated, so
+ * that probing compares it without following a pointer. A longer key is
+ * stored as a pointer and a length. The fields are private: use
+ * hashtable_str_data() and hashtable_str_len() to read a key, for example one
+ * returned by hashtable_for_each_pair().
  * ===========================================================================*/
-size_t hashtable_hash(const void *key, size_t size);
+#define HASHTABLE_STR_INLINE 23
 
-/* =============================================================================
- * hashtable_str_hash()
- * A hash function for strings. Uses the same algorithm as * hashtable_hash(),
- * but saves having to first calculate the string's length just to pass it to
- * hashtable_hash().
- * ===========================================================================*/
-size_t hashtable_str_hash(const char *key);
+struct hashtable_str {
+    union {
+        /* The last byte holds HASHTABLE_STR_INLINE minus the length of an
+         * inline key, which makes it the terminating null of a full one, or
+         * _HASHTABLE_STR_SPILLED */
+        char _chars[HASHTABLE_STR_INLINE + 1];
+        struct {
+            const char  *_data;
+            size_t      _len;
+        };
+    };
+};
+
+#define _HASHTABLE_STR_SPILLED 0xFF
+
+static inline size_t hashtable_str_len(const struct hashtable_str *key)
+{
+    unsigned char tag = (unsigned char)key->_chars[HASHTABLE_STR_INLINE];
+    return tag == _HASHTABLE_STR_SPILLED ? key->_len :
+        (size_t)(HASHTABLE_STR_INLINE - tag);
+}
+
+static inline const char *hashtable_str_data(const struct hashtable_str *key)
+{
+    unsigned char tag = (unsigned char)key->_chars[HASHTABLE_STR_INLINE];
+    return tag == _HASHTABLE_STR_SPILLED ? key->_data : key->_chars;
+}
 
 /* =============================================================================
- * hashtable_compare_keys()
- * The default key comparison function. Compares values like memcmp() does.
+ * hashtable_define_str()
+ * Defines a table type with string keys of any length, which need not be
+ * null-terminated. Keys of up to HASHTABLE_STR_INLINE bytes are copied into
+ * the bucket itself, longer ones into an arena owned by the table, so
+ * insertion makes no allocation per key and looking up a short key never
+ * follows a pointer. The memory of erased long keys is reclaimed when the
+ * table is cleared or destroyed. The following functions are defined, where
+ * TABLE and VALUE_TYPE have the same meaning as for hashtable_define():
+ *
+ * int TABLE_init(TABLE *table, size_t size)
+ * int TABLE_init_ext(TABLE *table, size_t size,
+ *     const struct hashtable_config *config)
+ * void TABLE_einit(TABLE *table, size_t size)
+ * void TABLE_einit_ext(TABLE *table, size_t size,
+ *     const struct hashtable_config *config)
+ * void TABLE_destroy(TABLE *table)
+ * int TABLE_reserve(TABLE *table, size_t num_values)
+ * int TABLE_rehash(TABLE *table, size_t num_buckets)
+ * int TABLE_shrink_to_fit(TABLE *table)
+ * void TABLE_clear(TABLE *table)
+ * Same as for hashtable_define().
+ *
+ * int TABLE_insert(TABLE *table, const char *key, size_t len,
+ *     VALUE_TYPE value)
+ * void TABLE_einsert(TABLE *table, const char *key, size_t len,
+ *     VALUE_TYPE value)
+ * void TABLE_erase(TABLE *table, const char *key, size_t len)
+ * int TABLE_exists(TABLE *table, const char *key, size_t len)
+ * VALUE_TYPE *TABLE_find(TABLE *table, const char *key, size_t len)
+ * Same as for hashtable_define(), with the key given as its first len bytes.
+ * TABLE_insert() returns 4 if a long key cannot be copied.
+ *
+ * PARAMETERS
+ * table_type_name: The type name and function prefix used for the table.
+ * value_type:      The type of the values that will be stored in the table.
+ *
+ * EXAMPLE
+ * hashtable_define_str(symbol_table, int);
+ * ...
+ * struct symbol_table symbols;
+ * symbol_table_einit(&symbols, 64);
+ * symbol_table_einsert(&symbols, "main", 4, 1);
+ * int *value = symbol_table_find(&symbols, name, strlen(name));
+ * ...
+ * struct hashtable_str key;
+ * int                  value;
+ * hashtable_for_each_pair(symbols, key, value)
+ *     printf("%.*s\n", (int)hashtable_str_len(&key), hashtable_str_data(&key));
  * ===========================================================================*/
-int hashtable_compare_keys(const void *a, const void *b, size_t size);
+#define hashtable_define_str(table_type_name, value_type) \
+    \
+    struct table_type_name { \
+        _hashtable_body(struct hashtable_str, value_type) \
+        struct hashtable_arena _arena; \
+    }; \
+    \
+    static inline int table_type_name##_init_ext( \
+        struct table_type_name *table, size_t size, \
+        const struct hashtable_config *config) \
+    { \
+        int err; \
+        hashtable_init_ext(*table, size, config, &err); \
+        hashtable_arena_init(&table->_arena, 0); \
+        return err; \
+    } \
+    \
+    static inline int table_type_name##_init(struct table_type_name *table, \
+        size_t size) \
+        {return table_type_name##_init_ext(table, size, 0);} \
+    \
+    static inline void table_type_name##_einit_ext( \
+        struct table_type_name *table, size_t size, \
+        const struct hashtable_config *config) \
+    { \
+        if (table_type_name##_init_ext(table, size, config)) \
+            hashtable_panic(); \
+    } \
+    \
+    static inline void table_type_name##_einit(struct table_type_name *table, \
+        size_t size) \
+        {table_type_name##_einit_ext(table, size, 0);} \
+    \
+    static inline void table_type_name##_destroy( \
+        struct table_type_name *table) \
+    { \
+        hashtable_arena_release(&table->_arena); \
+        hashtable_destroy(*table, 0); \
+    } \
+    \
+    static inline int table_type_name##_reserve( \
+        struct table_type_name *table, size_t num_values) \
+    { \
+        int err; \
+        hashtable_reserve(*table, num_values, &err); \
+        return err; \
+    } \
+    \
+    static inline int table_type_name##_rehash(struct table_type_name *table, \
+        size_t num_buckets) \
+    { \
+        int err; \
+        hashtable_rehash(*table, num_buckets, &err); \
+        return err; \
+    } \
+    \
+    static inline int table_type_name##_shrink_to_fit( \
+        struct table_type_name *table) \
+    { \
+        int err; \
+        hashtable_shrink_to_fit(*table, &err); \
+        return err; \
+    } \
+    \
+    static inline value_type *table_type_name##_find( \
+        struct table_type_name *table, const char *key, size_t len) \
+    { \
+        struct hashtable_str str = _hashtable_str_key(key, len); \
+        return hashtable_find_ext(*table, str, hashtable_hash(key, len), \
+            _hashtable_str_compare); \
+    } \
+    \
+    static inline int table_type_name##_exists( \
+        struct table_type_name *table, const char *key, size_t len) \
+        {return table_type_name##_find(table, key, len) != 0;} \
+    \
+    static inline int table_type_name##_insert(struct table_type_name *table, \
+        const char *key, size_t len, value_type value) \
+    { \
+        int err; \
+        size_t hash = hashtable_hash(key, len); \
+        struct hashtable_str str = _hashtable_str_key(key, len); \
+        if (len > HASHTABLE_STR_INLINE) { \
+            /* Don't leave a copy in the arena for an existing key */ \
+            if (hashtable_find_ext(*table, str, hash, _hashtable_str_compare)) \
+                return 2; \
+            char *copy = hashtable_arena_alloc(&table->_arena, len); \
+            if (!copy) \
+                return 4; \
+            memcpy(copy, key, len); \
+            str._data = copy; \
+        } \
+        hashtable_insert_ext(*table, str, hash, value, _hashtable_str_compare, \
+            hashtable_copy_key, &err); \
+        return err; \
+    } \
+    \
+    static inline void table_type_name##_einsert( \
+        struct table_type_name *table, const char *key, size_t len, \
+        value_type value) \
+    { \
+        if (table_type_name##_insert(table, key, len, value)) \
+            hashtable_panic(); \
+    } \
+    \
+    static inline void table_type_name##_erase(struct table_type_name *table, \
+        const char *key, size_t len) \
+    { \
+        struct hashtable_str str = _hashtable_str_key(key, len); \
+        hashtable_erase_ext(*table, str, hashtable_hash(key, len), \
+            _hashtable_str_compare, 0); \
+    } \
+    \
+    static inline void table_type_name##_clear(struct table_type_name *table) \
+    { \
+        hashtable_clear(*table, 0); \
+        hashtable_arena_release(&table->_arena); \
+    }
 
+#ifdef HASHTABLE_CONCURRENT
 /* =============================================================================
- * hashtable_copy_key()
- * The default key copying function. Works similarly to memcpy().
+ * hashtable_define_concurrent()
+ * Only available if HASHTABLE_CONCURRENT is defined before including this
+ * header. Defines a table type that may be used from several threads at once.
+ * The table is split into num_shards sub-tables, each protected by its own
+ * lock. A key's shard is selected by the high bits of its mixed hash, while
+ * buckets within a shard are selected by the low bits, so operations on keys
+ * of different shards never wait for each other. Hashes are computed before
+ * taking a lock. Locks are pthread mutexes, or SRW locks on Windows.
+ * The following functions are defined, where TABLE, KEY_TYPE and VALUE_TYPE
+ * have the same meaning as for hashtable_define():
+ *
+ * int TABLE_init(TABLE *table, size_t size)
+ * int TABLE_init_ext(TABLE *table, size_t size,
+ *     const struct hashtable_config *config)
+ * void TABLE_einit(TABLE *table, size_t size)
+ * void TABLE_einit_ext(TABLE *table, size_t size,
+ *     const struct hashtable_config *config)
+ * Same as for hashtable_define(), except that size is the number of initial
+ * buckets of the whole table, divided between the shards. Not thread safe.
+ *
+ * void TABLE_destroy(TABLE *table)
+ * Same as for hashtable_define(). Not thread safe.
+ *
+ * int TABLE_insert(TABLE *table, KEY_TYPE key, VALUE_TYPE value)
+ * void TABLE_einsert(TABLE *table, KEY_TYPE key, VALUE_TYPE value)
+ * void TABLE_erase(TABLE *table, KEY_TYPE key)
+ * int TABLE_exists(TABLE *table, KEY_TYPE key)
+ * void TABLE_clear(TABLE *table)
+ * Same as for hashtable_define().
+ *
+ * int TABLE_find(TABLE *table, KEY_TYPE key, VALUE_TYPE *ret_value)
+ * Unlike for hashtable_define(), copies the value of key to ret_value (if not
+ * NULL) and returns nonzero if key was found, or returns 0. A pointer into the
+ * table would not stay valid once the shard's lock is released.
+ *
+ * size_t TABLE_num_values(TABLE *table)
+ * The number of values in the table. Shards are counted one at a time, so the
+ * result is only exact if no other thread modifies the table meanwhile.
+ *
+ * PARAMETERS
+ * table_type_name: The type name and function prefix used for the table.
+ * key_type:        The type used as key for the table.
+ * value_type:      The type of the values that will be stored in the table.
+ * num_shards:      The number of independently locked sub-tables, from 1 to
+ *                  65536. A few times the number of threads using the table
+ *                  keeps lock contention low.
+ *
+ * EXAMPLE
+ * #define HASHTABLE_CONCURRENT
+ * #include "hashtable.h"
+ * hashtable_define_concurrent(shared_table, uint64_t, int, 64);
+ * ...
+ * struct shared_table my_table;
+ * shared_table_einit(&my_table, 1024);
+ * // From any thread:
+ * int value;
+ * shared_table_einsert(&my_table, 5, 10);
+ * if (shared_table_find(&my_table, 5, &value))
+ *     ...
  * ===========================================================================*/
-int hashtable_copy_key(void *dst, const void *src, size_t size);
+#define hashtable_define_concurrent(table_type_name, key_type, value_type, \
+    num_shards) \
+    hashtable_define_concurrent_ext(table_type_name, key_type, value_type, \
+        hashtable_hash, hashtable_compare_keys, hashtable_copy_key, 0, \
+        num_shards)
 
 /* =============================================================================
- * hashtable_panic()
- * The panic function used by any of the errorless functions (hashtable_einsert,
- * etc.) This may be set manually to something else, or left unchanged, in which
- * case it will call standard abort().
+ * hashtable_define_concurrent_ext()
+ * Similar to hashtable_define_concurrent(), but accepts the same key function
+ * parameters as hashtable_define_ext().
  * ===========================================================================*/
-extern void (*hashtable_panic)(void);
-
-#define _hashtable_body(key_type, value_type) \
-    struct { \
-        key_type    _key; \
-        value_type  _value; \
-        size_t      _hash; \
-    } *_buckets; \
-    size_t _num_buckets; \
-    size_t _num_values;
-
-#define _hashtable_ptr_offset(ptr, base) \
-    ((size_t)((unsigned char*)(ptr) - (unsigned char*)(base)))
-
-#ifndef _MSC_VER
-  #define HASHTABLE_RESTRICT restrict
-#else
-  #define HASHTABLE_RESTRICT __restrict
-#endif
-
-void *_hashtable_init(size_t *num_buckets, size_t num,
-    size_t bucket_size, size_t *num_values, int *ret_err);
-
-static inline void *_hashtable_einit(size_t *HASHTABLE_RESTRICT num_buckets, size_t num,
-    size_t bucket_size, size_t *HASHTABLE_RESTRICT num_values);
-
-void _hashtable_clear(unsigned char *buckets, size_t num_buckets,
-    size_t bucket_size, size_t *num_values, size_t key_off, size_t hash_off,
-    void (*free_key)(void *key));
-
-void _hashtable_destroy(void *table, size_t table_size, unsigned char *buckets,
-    void (*free_key)(void *), size_t num_buckets, size_t bucket_size,
-    size_t key_off, size_t hash_off, size_t num_values);
-
-void *_hashtable_insert(int *ret_err, unsigned char *HASHTABLE_RESTRICT buckets,
-    size_t *HASHTABLE_RESTRICT num_buckets, size_t *HASHTABLE_RESTRICT num_values,
-    size_t bucket_size, size_t key_off1, size_t value_off1, size_t hash_off1,
-    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash, void *HASHTABLE_RESTRICT value,
-    size_t value_size,
-    int (*compare_keys)(const void *a, const void *b, size_t size),
-    int (*copy_key)(void *dst, const void *src, size_t size));
-
-static inline void *_hashtable_einsert(unsigned char *HASHTABLE_RESTRICT buckets,
-    size_t *HASHTABLE_RESTRICT num_buckets, size_t *HASHTABLE_RESTRICT num_values,
-    size_t bucket_size, size_t key_off1, size_t value_off1, size_t hash_off1,
-    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash, void *HASHTABLE_RESTRICT value,
-    size_t value_size,
-    int (*compare_keys)(const void *a, const void *b, size_t size),
-    int (*copy_key)(void *dst, const void *src, size_t size));
-
-void *_hashtable_find(const void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
-    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets, size_t bucket_size,
-    size_t key_off, size_t value_off, size_t hash_off,
-    int (*compare_keys)(const void *a, const void *b, size_t size));
-
-void _hashtable_erase(unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
-    size_t *HASHTABLE_RESTRICT num_values, void *HASHTABLE_RESTRICT key, size_t key_size,
-    size_t hash, size_t bucket_size, size_t key_off, size_t hash_off,
-    int (*compare_keys)(const void *a, const void *b, size_t size),
-    void (*free_key)(void *key));
-
-int _hashtable_for_each_pair(size_t *HASHTABLE_RESTRICT i, size_t *HASHTABLE_RESTRICT j,
-    void *HASHTABLE_RESTRICT ret_key, void *HASHTABLE_RESTRICT ret_value, size_t key_size,
+#define hashtable_define_concurrent_ext(table_type_name, key_type, value_type, \
+    compute_hash, compare_keys, copy_key, free_key, num_shards) \
+    \
+    struct table_type_name##_shard { \
+        _hashtable_lock_t lock; \
+        struct { \
+            _hashtable_body(key_type, value_type) \
+        } table; \
+    }; \
+    \
+    /* Pad shards to whole cache lines so their locks don't share one */ \
+    union table_type_name##_padded_shard { \
+        struct table_type_name##_shard shard; \
+        unsigned char _pad[_hashtable_cache_lines( \
+            sizeof(struct table_type_name##_shard))]; \
+    }; \
+    \
+    struct table_type_name { \
+        HASHTABLE_CACHE_ALIGNED \
+        union table_type_name##_padded_shard _shards[num_shards]; \
+    }; \
+    \
+    static inline struct table_type_name##_shard *table_type_name##_shard_of( \
+        struct table_type_name *table, size_t hash) \
+    { \
+        size_t i = _hashtable_shard_index(hash, num_shards); \
+        return &table->_shards[i].shard; \
+    } \
+    \
+    static inline void table_type_name##_destroy( \
+        struct table_type_name *table) \
+    { \
+        for (size_t i = 0; i < (num_shards); ++i) { \
+            struct table_type_name##_shard *shard = &table->_shards[i].shard; \
+            hashtable_destroy(shard->table, free_key); \
+            _hashtable_lock_destroy(&shard->lock); \
+        } \
+    } \
+    \
+    static inline int table_type_name##_init_ext( \
+        struct table_type_name *table, size_t size, \
+        const struct hashtable_config *config) \
+    { \
+        size_t shard_size = (size + (num_shards) - 1) / (num_shards); \
+        for (size_t i = 0; i < (num_shards); ++i) { \
+            struct table_type_name##_shard *shard = &table->_shards[i].shard; \
+            int err; \
+            hashtable_init_ext(shard->table, shard_size, config, &err); \
+            if (!err && _hashtable_lock_init(&shard->lock)) { \
+                hashtable_destroy(shard->table, 0); \
+                err = 1; \
+            } \
+            if (err) { \
+                while (i--) { \
+                    shard = &table->_shards[i].shard; \
+                    hashtable_destroy(shard->table, 0); \
+                    _hashtable_lock_destroy(&shard->lock); \
+                } \
+                return err; \
+            } \
+        } \
+        return 0; \
+    } \
+    \
+    static inline int table_type_name##_init(struct table_type_name *table, \
+        size_t size) \
+        {return table_type_name##_init_ext(table, size, 0);} \
+    \
+    static inline void table_type_name##_einit_ext( \
+        struct table_type_name *table, size_t size, \
+        const struct hashtable_config *config) \
+    { \
+        if (table_type_name##_init_ext(table, size, config)) \
+            hashtable_panic(); \
+    } \
+    \
+    static inline void table_type_name##_einit(struct table_type_name *table, \
+        size_t size) \
+        {table_type_name##_einit_ext(table, size, 0);} \
+    \
+    static inline int table_type_name##_insert(struct table_type_name *table, \
+        key_type key, value_type value) \
+    { \
+        int err; \
+        size_t hash = compute_hash(&key, sizeof(key)); \
+        struct table_type_name##_shard *shard = \
+            table_type_name##_shard_of(table, hash); \
+        _hashtable_lock(&shard->lock); \
+        hashtable_insert_ext(shard->table, key, hash, value, compare_keys, \
+            copy_key, &err); \
+        _hashtable_unlock(&shard->lock); \
+        return err; \
+    } \
+    \
+    static inline void table_type_name##_einsert( \
+        struct table_type_name *table, key_type key, value_type value) \
+    { \
+        if (table_type_name##_insert(table, key, value)) \
+            hashtable_panic(); \
+    } \
+    \
+    static inline void table_type_name##_erase(struct table_type_name *table, \
+        key_type key) \
+    { \
+        size_t hash = compute_hash(&key, sizeof(key)); \
+        struct table_type_name##_shard *shard = \
+            table_type_name##_shard_of(table, hash); \
+        _hashtable_lock(&shard->lock); \
+        hashtable_erase_ext(shard->table, key, hash, compare_keys, free_key); \
+        _hashtable_unlock(&shard->lock); \
+    } \
+    \
+    static inline int table_type_name##_find(struct table_type_name *table, \
+        key_type key, value_type *ret_value) \
+    { \
+        size_t hash = compute_hash(&key, sizeof(key)); \
+        struct table_type_name##_shard *shard = \
+            table_type_name##_shard_of(table, hash); \
+        _hashtable_lock(&shard->lock); \
+        value_type *value = hashtable_find_ext(shard->table, key, hash, \
+            compare_keys); \
+        if (value && ret_value) \
+            *ret_value = *value; \
+        _hashtable_unlock(&shard->lock); \
+        return value != 0; \
+    } \
+    \
+    static inline int table_type_name##_exists( \
+        struct table_type_name *table, key_type key) \
+        {return table_type_name##_find(table, key, 0);} \
+    \
+    static inline void table_type_name##_clear(struct table_type_name *table) \
+    { \
+        for (size_t i = 0; i < (num_shards); ++i) { \
+            struct table_type_name##_shard *shard = &table->_shards[i].shard; \
+            _hashtable_lock(&shard->lock); \
+            hashtable_clear(shard->table, free_key); \
+            _hashtable_unlock(&shard->lock); \
+        } \
+    } \
+    \
+    static inline size_t table_type_name##_num_values( \
+        struct table_type_name *table) \
+    { \
+        size_t num_values = 0; \
+        for (size_t i = 0; i < (num_shards); ++i) { \
+            struct table_type_name##_shard *shard = &table->_shards[i].shard; \
+            _hashtable_lock(&shard->lock); \
+            num_values += hashtable_num_values(shard->table); \
+            _hashtable_unlock(&shard->lock); \
+        } \
+        return num_values; \
+    }
+
+/* =============================================================================
+ * hashtable_define_read_mostly()
+ * Only available if HASHTABLE_CONCURRENT is defined before including this
+ * header. Defines a table type for tables that are looked up from many threads
+ * and rarely modified. Writers are serialized by a lock, while lookups take no
+ * lock and never write to shared memory: a lookup probes the table
+ * optimistically and retries if a sequence counter shows that a writer was
+ * active meanwhile, so the cache lines it reads stay shared between cores.
+ * Bucket arrays replaced by a resize are kept until the table is destroyed,
+ * since a lookup may still be probing them. As the table grows geometrically,
+ * they take less memory than the current array.
+ * Lookups may read buckets while a writer modifies them, and only discard the
+ * result afterwards, so keys are copied with hashtable_copy_key() and never
+ * freed. Keys pointing to other memory, such as strings, must stay valid as
+ * long as the table, and compare_keys must tolerate any such key.
+ * HASHTABLE_INCREMENTAL may not be used. The following functions are defined,
+ * with the same meaning as for hashtable_define_concurrent():
+ *
+ * int TABLE_init(TABLE *table, size_t size)
+ * int TABLE_init_ext(TABLE *table, size_t size,
+ *     const struct hashtable_config *config)
+ * void TABLE_einit(TABLE *table, size_t size)
+ * void TABLE_einit_ext(TABLE *table, size_t size,
+ *     const struct hashtable_config *config)
+ * void TABLE_destroy(TABLE *table)
+ * int TABLE_insert(TABLE *table, KEY_TYPE key, VALUE_TYPE value)
+ * void TABLE_einsert(TABLE *table, KEY_TYPE key, VALUE_TYPE value)
+ * void TABLE_erase(TABLE *table, KEY_TYPE key)
+ * int TABLE_find(TABLE *table, KEY_TYPE key, VALUE_TYPE *ret_value)
+ * int TABLE_exists(TABLE *table, KEY_TYPE key)
+ * void TABLE_clear(TABLE *table)
+ * size_t TABLE_num_values(TABLE *table)
+ *
+ * TABLE_init_ext() returns 1 if config contains HASHTABLE_INCREMENTAL.
+ * Lookups wait while a writer modifies the table, including while it
+ * resizes, which TABLE_init() with a large enough size avoids.
+ *
+ * PARAMETERS
+ * table_type_name: The type name and function prefix used for the table.
+ * key_type:        The type used as key for the table.
+ * value_type:      The type of the values that will be stored in the table.
+ *
+ * EXAMPLE
+ * #define HASHTABLE_CONCURRENT
+ * #include "hashtable.h"
+ * hashtable_define_read_mostly(route_table, uint32_t, int);
+ * ...
+ * struct route_table routes;
+ * route_table_einit(&routes, 1024);
+ * // From any thread:
+ * int port;
+ * if (route_table_find(&routes, address, &port))
+ *     ...
+ * ===========================================================================*/
+#define hashtable_define_read_mostly(table_type_name, key_type, value_type) \
+    hashtable_define_read_mostly_ext(table_type_name, key_type, value_type, \
+        hashtable_hash, hashtable_compare_keys)
+
+/* =============================================================================
+ * hashtable_define_read_mostly_ext()
+ * Similar to hashtable_define_read_mostly(), but accepts a compute_hash and a
+ * compare_keys function as hashtable_define_ext() does.
+ * ===========================================================================*/
+#define hashtable_define_read_mostly_ext(table_type_name, key_type, \
+    value_type, compute_hash, compare_keys) \
+    \
+    struct table_type_name##_body { \
+        _hashtable_body(key_type, value_type) \
+    }; \
+    \
+    struct table_type_name { \
+        _hashtable_seq_t _seq; \
+        struct table_type_name##_body _table; \
+        /* Only writers touch the lock, keep it off the readers' lines */ \
+        unsigned char _pad[HASHTABLE_CACHE_LINE]; \
+        _hashtable_lock_t _lock; \
+    }; \
+    \
+    static inline void table_type_name##_destroy( \
+        struct table_type_name *table) \
+    { \
+        hashtable_destroy(table->_table, 0); \
+        _hashtable_lock_destroy(&table->_lock); \
+    } \
+    \
+    static inline int table_type_name##_init_ext( \
+        struct table_type_name *table, size_t size, \
+        const struct hashtable_config *config) \
+    { \
+        struct hashtable_config retain = {0}; \
+        if (config) \
+            retain = *config; \
+        if (retain.flags & HASHTABLE_INCREMENTAL) \
+            return 1; \
+        retain.flags |= _HASHTABLE_RETAIN_BUCKETS; \
+        int err; \
+        hashtable_init_ext(table->_table, size, &retain, &err); \
+        if (err) \
+            return err; \
+        if (_hashtable_lock_init(&table->_lock)) { \
+            hashtable_destroy(table->_table, 0); \
+            return 1; \
+        } \
+        table->_seq = 0; \
+        return 0; \
+    } \
+    \
+    static inline int table_type_name##_init(struct table_type_name *table, \
+        size_t size) \
+        {return table_type_name##_init_ext(table, size, 0);} \
+    \
+    static inline void table_type_name##_einit_ext( \
+        struct table_type_name *table, size_t size, \
+        const struct hashtable_config *config) \
+    { \
+        if (table_type_name##_init_ext(table, size, config)) \
+            hashtable_panic(); \
+    } \
+    \
+    static inline void table_type_name##_einit(struct table_type_name *table, \
+        size_t size) \
+        {table_type_name##_einit_ext(table, size, 0);} \
+    \
+    static inline int table_type_name##_insert(struct table_type_name *table, \
+        key_type key, value_type value) \
+    { \
+        int err; \
+        size_t hash = compute_hash(&key, sizeof(key)); \
+        _hashtable_lock(&table->_lock); \
+        _hashtable_write_begin(&table->_seq); \
+        hashtable_insert_ext(table->_table, key, hash, value, compare_keys, \
+            hashtable_copy_key, &err); \
+        _hashtable_write_end(&table->_seq); \
+        _hashtable_unlock(&table->_lock); \
+        return err; \
+    } \
+    \
+    static inline void table_type_name##_einsert( \
+        struct table_type_name *table, key_type key, value_type value) \
+    { \
+        if (table_type_name##_insert(table, key, value)) \
+            hashtable_panic(); \
+    } \
+    \
+    static inline void table_type_name##_erase(struct table_type_name *table, \
+        key_type key) \
+    { \
+        size_t hash = compute_hash(&key, sizeof(key)); \
+        _hashtable_lock(&table->_lock); \
+        _hashtable_write_begin(&table->_seq); \
+        hashtable_erase_ext(table->_table, key, hash, compare_keys, 0); \
+        _hashtable_write_end(&table->_seq); \
+        _hashtable_unlock(&table->_lock); \
+    } \
+    \
+    static inline int table_type_name##_find(struct table_type_name *table, \
+        key_type key, value_type *ret_value) \
+    { \
+        size_t hash = compute_hash(&key, sizeof(key)); \
+        for (;;) { \
+            size_t seq = _hashtable_read_begin(&table->_seq); \
+            if (seq & 1) { \
+                _hashtable_cpu_relax(); \
+                continue; \
+            } \
+            /* The bucket array and its size must belong together before \
+             * probing, or the probe could leave the array */ \
+            struct table_type_name##_body snapshot; \
+            memcpy(&snapshot, &table->_table, sizeof(snapshot)); \
+            if (_hashtable_read_retry(&table->_seq, seq)) \
+                continue; \
+            value_type *value = hashtable_find_ext(snapshot, key, hash, \
+                compare_keys); \
+            value_type copy; \
+            if (value) \
+                memcpy(&copy, value, sizeof(copy)); \
+            if (_hashtable_read_retry(&table->_seq, seq)) \
+                continue; \
+            if (value && ret_value) \
+                *ret_value = copy; \
+            return value != 0; \
+        } \
+    } \
+    \
+    static inline int table_type_name##_exists( \
+        struct table_type_name *table, key_type key) \
+        {return table_type_name##_find(table, key, 0);} \
+    \
+    static inline void table_type_name##_clear(struct table_type_name *table) \
+    { \
+        _hashtable_lock(&table->_lock); \
+        _hashtable_write_begin(&table->_seq); \
+        hashtable_clear(table->_table, 0); \
+        _hashtable_write_end(&table->_seq); \
+        _hashtable_unlock(&table->_lock); \
+    } \
+    \
+    static inline size_t table_type_name##_num_values( \
+        struct table_type_name *table) \
+    { \
+        for (;;) { \
+            size_t seq = _hashtable_read_begin(&table->_seq); \
+            size_t num_values = hashtable_num_values(table->_table); \
+            if (!(seq & 1) && !_hashtable_read_retry(&table->_seq, seq)) \
+                return num_values; \
+            _hashtable_cpu_relax(); \
+        } \
+    }
+
+/* =============================================================================
+ * hashtable_parallel_for()
+ * Only available if HASHTABLE_CONCURRENT is defined before including this
+ * header. Splits the positions [0, end) into one range per thread and calls fn
+ * for each range from its own thread, returning once all calls have returned.
+ * The calling thread handles the first range, as well as any range whose
+ * thread could not be started. Ranges start at multiples of
+ * HASHTABLE_PARALLEL_ALIGN, so that threads scanning neighbouring ranges of a
+ * bucket array rarely write to the same cache line. Empty ranges are skipped.
+ * Combined with hashtable_for_each_range(), this scans, reduces or frees the
+ * keys of a large table at the speed of all cores.
+ *
+ * PARAMETERS
+ * end:         The end of the positions, usually hashtable_bucket_end().
+ * num_threads: The number of ranges, at most HASHTABLE_MAX_THREADS. 0 starts
+ *              one per online CPU.
+ * fn:          A pointer to the function called for each range, with thread
+ *              being the index of the range, below num_threads. Signature
+ *              must be as follows:
+ *              void fn(void *ctx, size_t begin, size_t end, unsigned thread);
+ * ctx:         Passed to fn.
+ *
+ * EXAMPLE
+ * #define HASHTABLE_CONCURRENT
+ * #include "hashtable.h"
+ * hashtable_define(counter_table, uint32_t, uint64_t);
+ * struct sum_ctx {
+ *     struct counter_table    *table;
+ *     uint64_t                sums[HASHTABLE_MAX_THREADS];
+ * };
+ * static void sum_range(void *ctx, size_t begin, size_t end, unsigned thread)
+ * {
+ *     struct sum_ctx  *sum = ctx;
+ *     const uint32_t  *key;
+ *     uint64_t        *value;
+ *     hashtable_for_each_range(*sum->table, begin, end, key, value)
+ *         sum->sums[thread] += *value;
+ * }
+ * ...
+ * struct sum_ctx ctx = {&counters, {0}};
+ * hashtable_parallel_for(hashtable_bucket_end(counters), 0, sum_range, &ctx);
+ * ===========================================================================*/
+static inline void hashtable_parallel_for(size_t end, unsigned num_threads,
+    void (*fn)(void *ctx, size_t begin, size_t end, unsigned thread),
+    void *ctx);
+#endif
+
+/* =============================================================================
+ * hashtable_hash()
+ * A default hash function. Keys of 4 or 8 bytes are hashed as integers by
+ * hashtable_hash_u32() and hashtable_hash_u64(). Other keys are hashed 16 bytes
+ * at a time by a multiply-and-fold hash of the wyhash family, using three
+ * independent lanes for keys longer than 48 bytes. Hashes are never 0.
+ * If HASHTABLE_CRC32_HASH is defined when compiling hashtable.c on a target
+ * with the SSE4.2 or ARMv8 CRC32 instructions, the bulk of long keys is
+ * hashed with those instead. Hashes may therefore differ between builds, so
+ * persisted hashes are only valid in a build with the same hashtable_hash_id().
+ * hashtable_load() checks this against the id recorded by hashtable_save().
+ * ===========================================================================*/
+static inline size_t hashtable_hash(const void *key, size_t size);
+
+/* =============================================================================
+ * hashtable_hash_u32(), hashtable_hash_u64()
+ * Hash an integer key with a single wide multiplication. Equivalent to passing
+ * a pointer to the key and its size to hashtable_hash().
+ * ===========================================================================*/
+static inline size_t hashtable_hash_u32(uint32_t key);
+static inline size_t hashtable_hash_u64(uint64_t key);
+
+/* =============================================================================
+ * hashtable_str_hash()
+ * A hash function for null-terminated strings. Same as passing the string and
+ * its length to hashtable_hash().
+ * ===========================================================================*/
+size_t hashtable_str_hash(const char *key);
+
+/* =============================================================================
+ * struct hashtable_str_view
+ * A key type for strings of known length, such as fields of a network buffer,
+ * which need not be null-terminated. Used with hashtable_define_ext() and the
+ * functions below, a key is hashed over its known length and compared by
+ * length before its bytes, so no operation scans it for a terminating null.
+ * The hash of a view equals hashtable_str_hash() of the same string.
+ *
+ * hashtable_str_view_hash(), hashtable_str_view_compare()
+ * The compute_hash and compare_keys functions of such tables.
+ *
+ * hashtable_str_compare_view()
+ * A compare_keys function for hashtable_find_by() that compares a
+ * null-terminated string key of a table to a struct hashtable_str_view, so
+ * that such a table can be searched by a view hashed by
+ * hashtable_str_view_hash().
+ *
+ * hashtable_str_view_copy(), hashtable_str_view_free()
+ * A copy_key function that copies the viewed bytes into a null-terminated
+ * allocation of their own, and the matching free_key function. Tables whose
+ * keys point into memory that outlives them may use hashtable_copy_key() and
+ * no free_key function instead.
+ *
+ * EXAMPLE
+ * hashtable_define_ext(header_table, struct hashtable_str_view, int,
+ *     hashtable_str_view_hash, hashtable_str_view_compare,
+ *     hashtable_str_view_copy, hashtable_str_view_free);
+ * ...
+ * header_table_einsert(&headers, hashtable_str_view(buf + off, len), 1);
+ * ===========================================================================*/
+struct hashtable_str_view {
+    const char  *data;
+    size_t      len;
+};
+
+static inline struct hashtable_str_view hashtable_str_view(const char *data,
+    size_t len)
+{
+    struct hashtable_str_view ret = {data, len};
+    return ret;
+}
+
+static inline size_t hashtable_str_view_hash(const void *key, size_t size);
+static inline int hashtable_str_view_compare(const void *a, const void *b,
+    size_t size);
+static inline int hashtable_str_compare_view(const void *a, const void *b,
+    size_t size);
+int hashtable_str_view_copy(void *dst, const void *src, size_t size);
+void hashtable_str_view_free(void *key);
+
+/* =============================================================================
+ * hashtable_fnv_hash(), hashtable_fnv_str_hash()
+ * The previous default hash functions, using the 32 bit or 64 bit fnv-1a
+ * algorithm depending on architecture. They process one byte at a time and
+ * are kept for code that depends on their exact hash values.
+ * ===========================================================================*/
+size_t hashtable_fnv_hash(const void *key, size_t size);
+size_t hashtable_fnv_str_hash(const char *key);
+
+/* =============================================================================
+ * hashtable_compare_keys()
+ * The default key comparison function. Compares values like memcmp() does.
+ * ===========================================================================*/
+int hashtable_compare_keys(const void *a, const void *b, size_t size);
+
+/* =============================================================================
+ * hashtable_copy_key()
+ * The default key copying function. Works similarly to memcpy().
+ * ===========================================================================*/
+int hashtable_copy_key(void *dst, const void *src, size_t size);
+
+/* =============================================================================
+ * struct hashtable_arena
+ * A bump allocator handing out memory from large blocks, all of which are freed
+ * at once by hashtable_arena_release(). Keys such as strings that live in an
+ * arena need no free_key function, and a table whose allocator is the arena's
+ * needs no hashtable_destroy(), so a table built for a single request can be
+ * discarded together with its keys by releasing the arena. Not thread safe.
+ * The fields are private.
+ *
+ * EXAMPLE
+ * hashtable_define_ext(str_table, const char*, int, str_hash, str_compare,
+ *     hashtable_copy_key, 0);
+ * ...
+ * struct hashtable_arena arena;
+ * hashtable_arena_init(&arena, 0);
+ * struct hashtable_allocator allocator = hashtable_arena_allocator(&arena);
+ * struct hashtable_config config = {.allocator = &allocator};
+ * struct str_table table;
+ * str_table_init_ext(&table, 1024, &config);
+ * const char *key = hashtable_arena_strdup(&arena, name);
+ * if (key)
+ *     str_table_insert(&table, key, 5);
+ * ...
+ * hashtable_arena_release(&arena); // Frees the table and every key
+ * ===========================================================================*/
+struct hashtable_arena {
+    unsigned char   *block;         /* Newest block, chained to older ones */
+    size_t          used;           /* Bytes used of the newest block */
+    size_t          size;           /* Size of the newest block */
+    size_t          block_size;
+};
+
+/* Default block size of hashtable_arena_init() */
+#define HASHTABLE_ARENA_BLOCK_SIZE 65536
+
+/* =============================================================================
+ * hashtable_arena_init()
+ * Initialize an empty arena. Blocks are allocated with malloc() once needed.
+ *
+ * PARAMETERS
+ * arena:       The arena to initialize.
+ * block_size:  Size of each block in bytes, or 0 for HASHTABLE_ARENA_BLOCK_SIZE.
+ *              Allocations larger than half a block get a block of their own.
+ * ===========================================================================*/
+void hashtable_arena_init(struct hashtable_arena *arena, size_t block_size);
+
+/* =============================================================================
+ * hashtable_arena_alloc()
+ * Allocate size bytes aligned as by malloc() from an arena. The memory is not
+ * zeroed. Returns NULL if out of memory.
+ * ===========================================================================*/
+void *hashtable_arena_alloc(struct hashtable_arena *arena, size_t size);
+
+/* =============================================================================
+ * hashtable_arena_strdup()
+ * Copy a null-terminated string into an arena. Returns NULL if out of memory.
+ * ===========================================================================*/
+char *hashtable_arena_strdup(struct hashtable_arena *arena, const char *str);
+
+/* =============================================================================
+ * hashtable_arena_release()
+ * Free every block of an arena. The arena stays initialized and may be used
+ * again.
+ * ===========================================================================*/
+void hashtable_arena_release(struct hashtable_arena *arena);
+
+/* =============================================================================
+ * hashtable_arena_allocator()
+ * Returns a struct hashtable_allocator that allocates bucket arrays from an
+ * arena. Arrays replaced when the table grows are only reclaimed when the
+ * arena is released, so reserving the expected size up front saves memory.
+ * ===========================================================================*/
+struct hashtable_allocator hashtable_arena_allocator(
+    struct hashtable_arena *arena);
+
+/* =============================================================================
+ * struct hashtable_pages
+ * Options of hashtable_page_allocator(), which maps each bucket array of a
+ * table straight from the operating system. Meant for tables of millions of
+ * entries, whose lookups would otherwise miss the TLB on nearly every probe:
+ * an array of at least 2 MB is aligned to 2 MB so that it can be backed by
+ * huge pages, while smaller arrays use normal pages. Only implemented on
+ * Linux. Elsewhere, the allocator falls back to malloc() and free() and the
+ * options are ignored.
+ *
+ * FIELDS
+ * flags:       A combination of the following flags, or 0.
+ *              HASHTABLE_PAGES_HUGE: Ask for transparent huge pages with
+ *              madvise(MADV_HUGEPAGE). Takes effect if the kernel's
+ *              transparent_hugepage setting is "always" or "madvise".
+ *              HASHTABLE_PAGES_HUGETLB: Map explicit 2 MB pages from the
+ *              kernel's reserved pool (vm.nr_hugepages), falling back to
+ *              HASHTABLE_PAGES_HUGE if the pool is exhausted.
+ *              HASHTABLE_PAGES_1GB: Together with HASHTABLE_PAGES_HUGETLB, map
+ *              1 GB pages instead, for arrays of at least 1 GB.
+ *              HASHTABLE_PAGES_INTERLEAVE: Spread the pages round-robin over
+ *              the NUMA nodes of node_mask, so that threads on every node see
+ *              the same average latency and all memory controllers share the
+ *              load. Otherwise each page lands on the node of the thread that
+ *              first touches it.
+ *              HASHTABLE_PAGES_BIND: Place the pages on the nodes of node_mask
+ *              only, such as the node whose threads use the table.
+ * node_mask:   Bit n selects NUMA node n. 0 selects every node the process may
+ *              use. The NUMA policy is a best effort: it is silently skipped
+ *              where the kernel does not allow it.
+ *
+ * EXAMPLE
+ * struct hashtable_pages       pages = {.flags = HASHTABLE_PAGES_HUGE |
+ *     HASHTABLE_PAGES_INTERLEAVE};
+ * struct hashtable_allocator   allocator = hashtable_page_allocator(&pages);
+ * struct hashtable_config      config = {.allocator = &allocator};
+ * hashtable_init_ext(my_table, 1 << 28, &config, NULL);
+ * ===========================================================================*/
+struct hashtable_pages {
+    unsigned        flags;
+    unsigned long   node_mask;
+};
+
+#define HASHTABLE_PAGES_HUGE        (1u << 0)
+#define HASHTABLE_PAGES_HUGETLB     (1u << 1)
+#define HASHTABLE_PAGES_1GB         (1u << 2)
+#define HASHTABLE_PAGES_INTERLEAVE  (1u << 3)
+#define HASHTABLE_PAGES_BIND        (1u << 4)
+
+/* =============================================================================
+ * hashtable_page_allocator()
+ * Returns a struct hashtable_allocator that maps bucket arrays as described by
+ * pages. The struct pointed to by pages must outlive every table using the
+ * allocator.
+ * ===========================================================================*/
+struct hashtable_allocator hashtable_page_allocator(
+    const struct hashtable_pages *pages);
+
+/* =============================================================================
+ * hashtable_panic()
+ * The panic function used by any of the errorless functions (hashtable_einsert,
+ * etc.) This may be set manually to something else, or left unchanged, in which
+ * case it will call standard abort().
+ * ===========================================================================*/
+extern void (*hashtable_panic)(void);
+
+/* =============================================================================
+ * hashtable_stats
+ * Probe statistics, only available if HASHTABLE_STATS is defined when
+ * compiling both hashtable.c and the code using the table. The counters are
+ * global, not atomic, and meant for benchmarking only.
+ *
+ * num_key_compares:    Number of times a key comparison function was called
+ *                      while probing.
+ * num_hash_rejects:    Number of occupied buckets skipped while probing because
+ *                      their stored hash differed from the searched one, that
+ *                      is, key comparisons avoided.
+ * ===========================================================================*/
+#ifdef HASHTABLE_STATS
+struct hashtable_stats {
+    size_t num_key_compares;
+    size_t num_hash_rejects;
+};
+
+extern struct hashtable_stats hashtable_stats;
+
+  #define _HASHTABLE_STAT(counter) ((void)++hashtable_stats.counter)
+#else
+  #define _HASHTABLE_STAT(counter) ((void)0)
+#endif
+
+#define _hashtable_body(key_type, value_type) \
+    struct { \
+        key_type    _key; \
+        value_type  _value; \
+        size_t      _hash; \
+    } *_buckets; \
+    size_t _num_buckets; \
+    size_t _num_values; \
+    struct _hashtable_state _state;
+
+/* The _hash member only gives the macros an offset to pass. hashtable.c tells
+ * a compact bucket by its hash offset lying before the value. */
+#define _hashtable_compact_body(key_type, value_type) \
+    struct { \
+        union { \
+            key_type        _key; \
+            unsigned char   _hash; \
+        }; \
+        value_type  _value; \
+    } *_buckets; \
+    size_t _num_buckets; \
+    size_t _num_values; \
+    struct _hashtable_state _state;
+
+/* Per-table settings and engine data that do not depend on the key and value
+ * types. */
+struct _hashtable_state {
+    unsigned char   *ctrl;          /* Control tags of a HASHTABLE_SWISS table */
+    size_t          num_deleted;    /* Deleted tags of a HASHTABLE_SWISS table */
+    unsigned        flags;
+    unsigned        load_factor;    /* Percent */
+    unsigned        growth_factor;  /* Percent */
+    /* Buckets not yet moved by an ongoing HASHTABLE_INCREMENTAL resize */
+    unsigned char   *old_buckets;
+    size_t          num_old_buckets;
+    size_t          num_old_values;
+    size_t          migrate_pos;    /* Next old bucket to move */
+    size_t          migrate_left;   /* Old buckets left to visit */
+    /* Bucket arrays replaced by resizes of a table with lock-free readers */
+    unsigned char   *retired;
+    /* Key and value strides of a HASHTABLE_SOA table, including the padding
+     * that follows them in a bucket */
+    size_t          key_stride;
+    size_t          value_stride;
+    /* Rehashes the keys of a hashtable_compact() table */
+    size_t          (*compute_hash)(const void *data, size_t size);
+    size_t          key_size;
+    struct hashtable_allocator allocator;   /* Zero for calloc() and free() */
+    /* Splits the rebuild of a growing table between threads if set */
+    void            (*parallel_for)(size_t end, unsigned num_threads,
+        void (*fn)(void *ctx, size_t begin, size_t end, unsigned thread),
+        void *ctx);
+    unsigned        num_threads;
+};
+
+/* Set by hashtable_define_read_mostly() tables */
+#define _HASHTABLE_RETAIN_BUCKETS (1u << 31)
+/* Set by _hashtable_init() for hashtable_compact() tables */
+#define _HASHTABLE_NO_HASH (1u << 30)
+/* Set by _hashtable_load() while the table's allocator.ctx is the record of a
+ * mapped file */
+#define _HASHTABLE_MAPPED (1u << 29)
+/* Set by _hashtable_load() for a file mapped without HASHTABLE_LOAD_WRITABLE,
+ * whose buckets must not be written */
+#define _HASHTABLE_READ_ONLY (1u << 28)
+
+#define _hashtable_ptr_offset(ptr, base) \
+    ((size_t)((unsigned char*)(ptr) - (unsigned char*)(base)))
+
+/* Each array of a HASHTABLE_SOA allocation starts at a multiple of this */
+#define HASHTABLE_SOA_ALIGN 16
+
+static inline size_t _hashtable_soa_align(size_t size)
+{
+    return (size + HASHTABLE_SOA_ALIGN - 1) &
+        ~(size_t)(HASHTABLE_SOA_ALIGN - 1);
+}
+
+#ifndef _MSC_VER
+  #define HASHTABLE_RESTRICT restrict
+#else
+  #define HASHTABLE_RESTRICT __restrict
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+  #define HASHTABLE_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+  #define HASHTABLE_FORCE_INLINE __forceinline
+#else
+  #define HASHTABLE_FORCE_INLINE inline
+#endif
+
+#if defined(_MSC_VER) && defined(_M_X64) && !defined(__clang__)
+  #include <intrin.h>
+#endif
+
+#define HASHTABLE_LOAD_FACTOR       70
+#define HASHTABLE_SWISS_LOAD_FACTOR 87
+#define HASHTABLE_GROWTH_FACTOR     2
+/* Keys hashed at a time by the batch functions of hashtable_define() */
+#define HASHTABLE_BATCH_SIZE    128
+
+/* The factors of a table in use. They are zero in a table that was zeroed
+ * rather than initialized, or that is reused after hashtable_destroy(), which
+ * then gets the defaults. */
+static inline unsigned _hashtable_load_factor(
+    const struct _hashtable_state *state)
+{
+    if (state->load_factor)
+        return state->load_factor;
+    return (state->flags & HASHTABLE_SWISS) ? HASHTABLE_SWISS_LOAD_FACTOR :
+        HASHTABLE_LOAD_FACTOR;
+}
+
+static inline unsigned _hashtable_growth_factor(
+    const struct _hashtable_state *state)
+{
+    return state->growth_factor ? state->growth_factor :
+        HASHTABLE_GROWTH_FACTOR * 100;
+}
+
+/* With HASHTABLE_INLINE defined before including this header, insertion,
+ * lookup and erasure are compiled from the static inline bodies below instead
+ * of calling into hashtable.c. Since the macros pass key sizes, bucket offsets
+ * and key functions as constants, the compiler can specialize each probe loop
+ * for the table's type. Growing the table still happens out of line. */
+#ifdef HASHTABLE_INLINE
+  #define _hashtable_insert_impl    _hashtable_insert_inline
+  #define _hashtable_find_impl      _hashtable_find_inline
+  #define _hashtable_erase_impl     _hashtable_erase_inline
+#else
+  #define _hashtable_insert_impl    _hashtable_insert
+  #define _hashtable_find_impl      _hashtable_find
+  #define _hashtable_erase_impl     _hashtable_erase
+#endif
+
+void *_hashtable_init(size_t *num_buckets, size_t num,
+    size_t bucket_size, size_t key_size, size_t value_off, size_t hash_off, size_t *num_values,
+    struct _hashtable_state *state, const struct hashtable_config *config,
+    int *ret_err);
+
+static inline void *_hashtable_einit(size_t *HASHTABLE_RESTRICT num_buckets, size_t num,
+    size_t bucket_size, size_t key_size, size_t value_off, size_t hash_off,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state,
+    const struct hashtable_config *config);
+
+/* A copy of config, or of the defaults, whose compute_hash defaults to the
+ * hash function of a hashtable_define() table. */
+static inline struct hashtable_config _hashtable_hashed_config(
+    const struct hashtable_config *config,
+    size_t (*compute_hash)(const void *data, size_t size))
+{
+    struct hashtable_config ret = {0};
+    if (config)
+        ret = *config;
+    if (!ret.compute_hash)
+        ret.compute_hash = compute_hash;
+    return ret;
+}
+
+/* Whether the keys of a hashtable_define() table are plain bytes hashed by
+ * hashtable_hash(), so that TABLE_save() and TABLE_load() may handle them.
+ * hashtable_hash() is static, so this must be compared in the caller's
+ * translation unit. */
+static inline int _hashtable_plain_keys(
+    size_t (*compute_hash)(const void *data, size_t size),
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size),
+    void (*free_key)(void *key))
+{
+    return compute_hash == hashtable_hash &&
+        compare_keys == hashtable_compare_keys &&
+        copy_key == hashtable_copy_key && !free_key;
+}
+
+int _hashtable_clear(unsigned char *buckets, size_t num_buckets,
+    size_t bucket_size, size_t *num_values, struct _hashtable_state *state,
+    size_t key_off, size_t value_off, size_t hash_off,
+    void (*free_key)(void *key));
+
+void _hashtable_destroy(void *table, size_t table_size, unsigned char *buckets,
+    void (*free_key)(void *), size_t num_buckets, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off, size_t num_values,
+    const struct _hashtable_state *state);
+
+unsigned char *_hashtable_grow(unsigned char *buckets, size_t *num_buckets,
+    size_t bucket_size, size_t hash_off, struct _hashtable_state *state);
+
+void *_hashtable_reserve(int *ret_err, unsigned char *buckets,
+    size_t *num_buckets, size_t num_values, struct _hashtable_state *state,
+    size_t bucket_size, size_t hash_off, size_t num);
+
+void *_hashtable_rehash(int *ret_err, unsigned char *buckets,
+    size_t *num_buckets, size_t num_values, struct _hashtable_state *state,
+    size_t bucket_size, size_t hash_off, size_t num);
+
+void *_hashtable_insert(int *ret_err, unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets, size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size, size_t key_off1, size_t value_off1, size_t hash_off1,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash, void *HASHTABLE_RESTRICT value,
+    size_t value_size,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size));
+
+static inline void *_hashtable_einsert(unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets, size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size, size_t key_off1, size_t value_off1, size_t hash_off1,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash, void *HASHTABLE_RESTRICT value,
+    size_t value_size,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size));
+
+void *_hashtable_find(const void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    const struct _hashtable_state *state, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size));
+
+int _hashtable_erase(unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state,
+    void *HASHTABLE_RESTRICT key, size_t key_size,
+    size_t hash, size_t bucket_size, size_t key_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    void (*free_key)(void *key));
+
+size_t _hashtable_find_batch(const void *HASHTABLE_RESTRICT keys,
+    size_t key_size, const size_t *HASHTABLE_RESTRICT hashes, size_t n,
+    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    const struct _hashtable_state *state, size_t bucket_size, size_t key_off,
+    size_t value_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    void **HASHTABLE_RESTRICT ret_values);
+
+void *_hashtable_insert_batch(int *ret_err,
+    unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off,
+    const void *HASHTABLE_RESTRICT keys, size_t key_size,
+    const size_t *HASHTABLE_RESTRICT hashes,
+    const void *HASHTABLE_RESTRICT values, size_t value_size, size_t n,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size));
+
+void *_hashtable_build(int *ret_err, unsigned char *buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off,
+    const void *HASHTABLE_RESTRICT keys, size_t key_size,
+    const size_t *HASHTABLE_RESTRICT hashes,
+    const void *HASHTABLE_RESTRICT values, size_t value_size, size_t n,
+    unsigned policy,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size));
+
+void _hashtable_save(int *ret_err, const char *path, size_t hash_id,
+    unsigned char *buckets, size_t num_buckets, size_t num_values,
+    struct _hashtable_state *state, size_t bucket_size, size_t key_size,
+    size_t value_off, size_t hash_off);
+
+void *_hashtable_load(int *ret_err, const char *path, size_t hash_id,
+    unsigned flags, size_t *HASHTABLE_RESTRICT num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_size, size_t value_off, size_t hash_off,
+    const struct hashtable_config *config);
+
+int _hashtable_for_each_pair(size_t *HASHTABLE_RESTRICT i, size_t *HASHTABLE_RESTRICT j,
+    void *HASHTABLE_RESTRICT ret_key, void *HASHTABLE_RESTRICT ret_value, size_t key_size,
     size_t value_size, size_t num_values, unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t num_buckets, const struct _hashtable_state *state,
     size_t bucket_size, size_t key_off, size_t hash_off, size_t value_off);
 
+/* Position of hashtable_for_each_ref() and the pointers it yields */
+struct _hashtable_ref {
+    size_t  i;      /* Next bucket, counting old buckets of a resize first */
+    size_t  num;    /* Pairs yielded so far */
+    void    *key;
+    void    *value;
+};
+
+/* Index of the lowest byte whose high bit is set in a nonzero mask */
+static HASHTABLE_FORCE_INLINE unsigned _hashtable_first_byte(uint64_t mask)
+{
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return (unsigned)__builtin_ctzll(mask) / 8;
+#elif defined(_MSC_VER) && defined(_M_X64) && !defined(__clang__)
+    unsigned long ret;
+    _BitScanForward64(&ret, mask);
+    return (unsigned)ret / 8;
+#else
+    unsigned char bytes[8];
+    unsigned ret = 0;
+    memcpy(bytes, &mask, sizeof(bytes));
+    while (!bytes[ret])
+        ++ret;
+    return ret;
+#endif
+}
+
+/* Find the next pair of ref at a bucket position below end. Positions count
+ * the old buckets of an incremental resize first. Iteration also stops once
+ * num_values pairs have been yielded. */
+static HASHTABLE_FORCE_INLINE int _hashtable_next_ref(
+    struct _hashtable_ref *HASHTABLE_RESTRICT ref, size_t end,
+    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    size_t num_values, const struct _hashtable_state *state,
+    size_t bucket_size, size_t key_off, size_t value_off, size_t hash_off)
+{
+    if (ref->num >= num_values)
+        return 0;
+    size_t i        = ref->i;
+    size_t num_old  = state->num_old_buckets;
+    size_t hash;
+    /* The old buckets of an incremental resize have no control tags */
+    for (; i < num_old && i < end; ++i) {
+        unsigned char *bucket = state->old_buckets + i * bucket_size;
+        memcpy(&hash, bucket + hash_off, sizeof(hash));
+        if (hash) {
+            ref->i      = i + 1;
+            ref->key    = bucket + key_off;
+            ref->value  = bucket + value_off;
+            ++ref->num;
+            return 1;
+        }
+    }
+    if (i >= end)
+        return 0;
+    if (end - num_old > num_buckets)
+        end = num_old + num_buckets;
+    if (i >= end)
+        return 0;
+    size_t k        = i - num_old;
+    size_t k_end    = end - num_old;
+    if (state->ctrl) {
+        /* A tag is in use when its high bit is clear */
+        const unsigned char *ctrl = state->ctrl;
+        while (k < k_end) {
+            if (k + 8 <= k_end) {
+                uint64_t tags;
+                memcpy(&tags, ctrl + k, sizeof(tags));
+                uint64_t mask = ~tags & 0x8080808080808080ULL;
+                if (!mask) {
+                    k += 8;
+                    continue;
+                }
+                k += _hashtable_first_byte(mask);
+            } else if (ctrl[k] & 0x80) {
+                ++k;
+                continue;
+            }
+            ref->key    = buckets + k * bucket_size + key_off;
+            ref->value  = buckets + k * bucket_size + value_off;
+            break;
+        }
+    } else if (state->flags & HASHTABLE_SOA) {
+        for (; k < k_end; ++k) {
+            memcpy(&hash, buckets + k * sizeof(size_t), sizeof(hash));
+            if (hash)
+                break;
+        }
+        unsigned char *keys = buckets +
+            _hashtable_soa_align(num_buckets * sizeof(size_t));
+        ref->key    = keys + k * state->key_stride;
+        ref->value  = keys + _hashtable_soa_align(
+            num_buckets * state->key_stride) + k * state->value_stride;
+    } else {
+        for (; k < k_end; ++k) {
+            memcpy(&hash, buckets + k * bucket_size + hash_off, sizeof(hash));
+            if (hash)
+                break;
+        }
+        ref->key    = buckets + k * bucket_size + key_off;
+        ref->value  = buckets + k * bucket_size + value_off;
+    }
+    if (k >= k_end)
+        return 0;
+    ref->i = num_old + k + 1;
+    ++ref->num;
+    return 1;
+}
+
+/* Mix the bits of a hash before masking it into a bucket index, so that hashes
+ * differing only in their high bits (or weak user hashes in general) don't all
+ * map to the same few buckets of a power-of-two sized table. */
+static HASHTABLE_FORCE_INLINE size_t _hashtable_mix(size_t hash)
+{
+#if SIZE_MAX == 0xFFFFFFFF
+    hash ^= hash >> 16;
+    hash *= 0x7FEB352D;
+    hash ^= hash >> 15;
+#else
+    hash ^= hash >> 32;
+    hash *= 0xD6E8FEB86659FD93;
+    hash ^= hash >> 32;
+#endif
+    return hash;
+}
+
+/* num_buckets must be a power of two. */
+static HASHTABLE_FORCE_INLINE size_t _hashtable_bucket_index(size_t hash,
+    size_t num_buckets)
+    {return _hashtable_mix(hash) & (num_buckets - 1);}
+
+static HASHTABLE_FORCE_INLINE int _hashtable_inline_compare_keys(
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    const void *a, const void *b, size_t size)
+{
+    /* Folded at compile time when the default comparison is used, leaving a
+     * memcmp() of constant size the compiler can turn into a single compare. */
+    if (compare_keys == hashtable_compare_keys)
+        return memcmp(a, b, size);
+    return compare_keys(a, b, size);
+}
+
+/* A key referring to len bytes of data, which are copied if short */
+static inline struct hashtable_str _hashtable_str_key(const char *data,
+    size_t len)
+{
+    struct hashtable_str ret;
+    memset(&ret, 0, sizeof(ret));
+    if (len <= HASHTABLE_STR_INLINE) {
+        if (len)
+            memcpy(ret._chars, data, len);
+        ret._chars[HASHTABLE_STR_INLINE] = (char)(HASHTABLE_STR_INLINE - len);
+    } else {
+        ret._data   = data;
+        ret._len    = len;
+        ret._chars[HASHTABLE_STR_INLINE] = (char)_HASHTABLE_STR_SPILLED;
+    }
+    return ret;
+}
+
+/* Inline keys are zero-padded, so two keys of which at least one is inline
+ * are equal exactly if their bytes are. */
+static inline int _hashtable_str_compare(const void *a, const void *b,
+    size_t size)
+{
+    const struct hashtable_str *x = a;
+    const struct hashtable_str *y = b;
+    (void)size;
+    if ((unsigned char)x->_chars[HASHTABLE_STR_INLINE] !=
+        _HASHTABLE_STR_SPILLED ||
+        (unsigned char)y->_chars[HASHTABLE_STR_INLINE] !=
+        _HASHTABLE_STR_SPILLED)
+        return memcmp(x, y, sizeof(*x));
+    if (x->_len != y->_len)
+        return 1;
+    return memcmp(x->_data, y->_data, x->_len);
+}
+
+static HASHTABLE_FORCE_INLINE int _hashtable_inline_copy_key(
+    int (*copy_key)(void *dst, const void *src, size_t size),
+    void *dst, const void *src, size_t size)
+{
+    if (copy_key == hashtable_copy_key) {
+        memcpy(dst, src, size);
+        return 0;
+    }
+    return copy_key(dst, src, size);
+}
+
+/* Buckets whose stored hash differs from the searched one cannot hold the key,
+ * so the potentially expensive key comparison is only made on a full hash
+ * match. */
+static HASHTABLE_FORCE_INLINE int _hashtable_keys_match(size_t item_hash,
+    size_t hash, int (*compare_keys)(const void *a, const void *b, size_t size),
+    const void *a, const void *b, size_t size)
+{
+    if (item_hash != hash) {
+        _HASHTABLE_STAT(num_hash_rejects);
+        return 0;
+    }
+    _HASHTABLE_STAT(num_key_compares);
+    return !_hashtable_inline_compare_keys(compare_keys, a, b, size);
+}
+
+/* Distance of bucket index i from the index hash maps to. A bucket's probe
+ * distance is not stored, as it follows from the bucket's stored hash. */
+static HASHTABLE_FORCE_INLINE size_t _hashtable_probe_distance(size_t hash,
+    size_t i, size_t num_buckets)
+    {return (i - _hashtable_bucket_index(hash, num_buckets)) & (num_buckets - 1);}
+
+/* Close the gap left by an erased bucket by moving back any later buckets of
+ * the same probe run that would otherwise become unreachable. */
+static inline void _hashtable_close_gap(unsigned char *buckets,
+    size_t num_buckets, size_t bucket_size, size_t hash_off, unsigned flags,
+    size_t gap)
+{
+    for (size_t j = gap;;) {
+        j = (j + 1) & (num_buckets - 1);
+        unsigned char *bucket = buckets + j * bucket_size;
+        size_t item_hash;
+        memcpy(&item_hash, bucket + hash_off, sizeof(item_hash));
+        if (!item_hash)
+            break;
+        /* The bucket may stay if its home index lies cyclically within
+         * (gap, j]. Robin Hood runs are ordered by home index, so nothing
+         * after a bucket at its home index can move either. */
+        size_t home = _hashtable_bucket_index(item_hash, num_buckets);
+        if ((flags & HASHTABLE_ROBIN_HOOD) && home == j)
+            break;
+        if (gap <= j ? (gap < home && home <= j) : (gap < home || home <= j))
+            continue;
+        memcpy(buckets + gap * bucket_size, bucket, bucket_size);
+        gap = j;
+    }
+    memset(buckets + gap * bucket_size + hash_off, 0, sizeof(size_t));
+}
+
+/* Make room at index i of a Robin Hood run by moving the buckets from i up to
+ * the next empty bucket forward by one. */
+static inline void _hashtable_shift_run(unsigned char *buckets,
+    size_t num_buckets, size_t bucket_size, size_t hash_off, size_t i)
+{
+    size_t mask = num_buckets - 1;
+    size_t end  = i;
+    for (;;) {
+        end = (end + 1) & mask;
+        size_t item_hash;
+        memcpy(&item_hash, buckets + end * bucket_size + hash_off,
+            sizeof(item_hash));
+        if (!item_hash)
+            break;
+    }
+    for (size_t j = end; j != i;) {
+        size_t prev = (j - 1) & mask;
+        memcpy(buckets + j * bucket_size, buckets + prev * bucket_size,
+            bucket_size);
+        j = prev;
+    }
+}
+
+/* Whether a linear probing table must grow before another value is inserted.
+ * Besides the load factor, one bucket is always left empty so that probe
+ * sequences terminate even in small tables. */
+static HASHTABLE_FORCE_INLINE int _hashtable_linear_needs_growth(
+    size_t num_values, size_t num_buckets, unsigned load_factor)
+{
+    return num_values + 1 >= num_buckets ||
+        (size_t)100 * num_values / num_buckets >= load_factor;
+}
+
+/* The default linear probing engine, optionally with Robin Hood placement.
+ * Used both by hashtable.c and, with HASHTABLE_INLINE, directly by the
+ * macros. */
+static HASHTABLE_FORCE_INLINE void *_hashtable_linear_insert(int *ret_err,
+    unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets, size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *state, size_t bucket_size, size_t key_off,
+    size_t value_off, size_t hash_off, void *HASHTABLE_RESTRICT key,
+    size_t key_size, size_t hash, void *HASHTABLE_RESTRICT value,
+    size_t value_size,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size))
+{
+    if (!hash) {
+        if (ret_err)
+            *ret_err = 1;
+        return buckets;
+    }
+    unsigned flags = state->flags;
+    if (_hashtable_linear_needs_growth(*num_values, *num_buckets,
+        _hashtable_load_factor(state))) {
+        unsigned char *new_buckets = _hashtable_grow(buckets, num_buckets,
+            bucket_size, hash_off, state);
+        if (!new_buckets) {
+            if (ret_err)
+                *ret_err = 4;
+            return buckets;
+        }
+        buckets = new_buckets;
+    }
+    size_t n = *num_buckets;
+    size_t i = _hashtable_bucket_index(hash, n);
+    for (size_t dist = 0;; ++dist) {
+        unsigned char *bucket = buckets + i * bucket_size;
+        size_t item_hash;
+        memcpy(&item_hash, bucket + hash_off, sizeof(item_hash));
+        if (!item_hash)
+            break;
+        if (_hashtable_keys_match(item_hash, hash, compare_keys,
+            bucket + key_off, key, key_size)) {
+            /* Key already exists */
+            if (ret_err)
+                *ret_err = 2;
+            return buckets;
+        }
+        /* Take the place of the first bucket closer to its home */
+        if ((flags & HASHTABLE_ROBIN_HOOD) &&
+            _hashtable_probe_distance(item_hash, i, n) < dist) {
+            _hashtable_shift_run(buckets, n, bucket_size, hash_off, i);
+            break;
+        }
+        i = (i + 1) & (n - 1);
+    }
+    unsigned char *bucket = buckets + i * bucket_size;
+    if (_hashtable_inline_copy_key(copy_key, bucket + key_off, key,
+        key_size)) {
+        /* Undo a possible shift */
+        _hashtable_close_gap(buckets, n, bucket_size, hash_off, flags, i);
+        if (ret_err)
+            *ret_err = 3;
+        return buckets;
+    }
+    memcpy(bucket + value_off, value, value_size);
+    memcpy(bucket + hash_off, &hash, sizeof(size_t));
+    if (ret_err)
+        *ret_err = 0;
+    (*num_values)++;
+    return buckets;
+}
+
+static HASHTABLE_FORCE_INLINE void *_hashtable_linear_find(
+    const void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    unsigned flags, size_t bucket_size, size_t key_off, size_t value_off,
+    size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size))
+{
+    if (!num_buckets)
+        return 0;
+    size_t bucket_index = _hashtable_bucket_index(hash, num_buckets);
+    for (size_t i = bucket_index, dist = 0;; ++dist) {
+        unsigned char *bucket = buckets + i * bucket_size;
+        size_t item_hash;
+        memcpy(&item_hash, bucket + hash_off, sizeof(item_hash));
+        if (!item_hash)
+            return 0;
+        if (_hashtable_keys_match(item_hash, hash, compare_keys,
+            bucket + key_off, key, key_size))
+            return bucket + value_off;
+        /* The key would have displaced this bucket if it were present */
+        if ((flags & HASHTABLE_ROBIN_HOOD) &&
+            _hashtable_probe_distance(item_hash, i, num_buckets) < dist)
+            return 0;
+        i = (i + 1) & (num_buckets - 1);
+        if (i == bucket_index)
+            return 0;
+    }
+}
+
+static HASHTABLE_FORCE_INLINE void _hashtable_linear_erase(
+    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values, unsigned flags,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    size_t bucket_size, size_t key_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    void (*free_key)(void *key))
+{
+    if (!*num_values)
+        return;
+    size_t bucket_index = _hashtable_bucket_index(hash, num_buckets);
+    for (size_t i = bucket_index, dist = 0;; ++dist) {
+        unsigned char *bucket = buckets + i * bucket_size;
+        size_t item_hash;
+        memcpy(&item_hash, bucket + hash_off, sizeof(item_hash));
+        if (!item_hash)
+            return;
+        if (_hashtable_keys_match(item_hash, hash, compare_keys,
+            bucket + key_off, key, key_size)) {
+            if (free_key)
+                free_key(bucket + key_off);
+            _hashtable_close_gap(buckets, num_buckets, bucket_size, hash_off,
+                flags, i);
+            (*num_values)--;
+            return;
+        }
+        if ((flags & HASHTABLE_ROBIN_HOOD) &&
+            _hashtable_probe_distance(item_hash, i, num_buckets) < dist)
+            return;
+        i = (i + 1) & (num_buckets - 1);
+        if (i == bucket_index)
+            return;
+    }
+}
+
+/* Flags of tables the inline path hands over to hashtable.c */
+#define _HASHTABLE_OUT_OF_LINE_FLAGS \
+    (HASHTABLE_SWISS | HASHTABLE_INCREMENTAL | HASHTABLE_SOA | \
+        _HASHTABLE_READ_ONLY)
+
+static HASHTABLE_FORCE_INLINE void *_hashtable_insert_inline(int *ret_err,
+    unsigned char *HASHTABLE_RESTRICT buckets,
+    size_t *HASHTABLE_RESTRICT num_buckets, size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size,
+    size_t key_off, size_t value_off, size_t hash_off,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    void *HASHTABLE_RESTRICT value, size_t value_size,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    int (*copy_key)(void *dst, const void *src, size_t size))
+{
+    if (state->flags & _HASHTABLE_OUT_OF_LINE_FLAGS)
+        return _hashtable_insert(ret_err, buckets, num_buckets, num_values,
+            state, bucket_size, key_off, value_off, hash_off, key, key_size,
+            hash, value, value_size, compare_keys, copy_key);
+    return _hashtable_linear_insert(ret_err, buckets, num_buckets, num_values,
+        state, bucket_size, key_off, value_off, hash_off, key, key_size, hash,
+        value, value_size, compare_keys, copy_key);
+}
+
+static HASHTABLE_FORCE_INLINE void *_hashtable_find_inline(
+    const void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    const struct _hashtable_state *state, size_t bucket_size, size_t key_off,
+    size_t value_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size))
+{
+    /* Finding does not move buckets of an incremental resize, so only an
+     * ongoing one needs to be handled out of line */
+    if ((state->flags & (HASHTABLE_SWISS | HASHTABLE_SOA)) ||
+        state->old_buckets)
+        return _hashtable_find(key, key_size, hash, buckets, num_buckets, state,
+            bucket_size, key_off, value_off, hash_off, compare_keys);
+    return _hashtable_linear_find(key, key_size, hash, buckets, num_buckets,
+        state->flags, bucket_size, key_off, value_off, hash_off, compare_keys);
+}
+
+static HASHTABLE_FORCE_INLINE int _hashtable_erase_inline(
+    unsigned char *HASHTABLE_RESTRICT buckets, size_t num_buckets,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state,
+    void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash,
+    size_t bucket_size, size_t key_off, size_t hash_off,
+    int (*compare_keys)(const void *a, const void *b, size_t size),
+    void (*free_key)(void *key))
+{
+    if (state->flags & _HASHTABLE_OUT_OF_LINE_FLAGS)
+        return _hashtable_erase(buckets, num_buckets, num_values, state, key,
+            key_size, hash, bucket_size, key_off, hash_off, compare_keys,
+            free_key);
+    _hashtable_linear_erase(buckets, num_buckets, num_values, state->flags,
+        key, key_size, hash, bucket_size, key_off, hash_off, compare_keys,
+        free_key);
+    return 0;
+}
+
 static inline void *_hashtable_einit(size_t *HASHTABLE_RESTRICT num_buckets, size_t num,
-    size_t bucket_size, size_t *HASHTABLE_RESTRICT num_values)
+    size_t bucket_size, size_t key_size, size_t value_off, size_t hash_off,
+    size_t *HASHTABLE_RESTRICT num_values,
+    struct _hashtable_state *HASHTABLE_RESTRICT state,
+    const struct hashtable_config *config)
 {
     int err;
-    void *ret = _hashtable_init(num_buckets, num, bucket_size, num_values,
-        &err);
+    void *ret = _hashtable_init(num_buckets, num, bucket_size, key_size,
+        value_off, hash_off, num_values, state, config, &err);
     if (err)
         hashtable_panic();
     return ret;
@@ -660,19 +3261,283 @@ static inline void *_hashtable_einit(size_t *HASHTABLE_RESTRICT num_buckets, siz
 
 static inline void *_hashtable_einsert(unsigned char *HASHTABLE_RESTRICT buckets,
     size_t *HASHTABLE_RESTRICT num_buckets, size_t *HASHTABLE_RESTRICT num_values,
-    size_t bucket_size, size_t key_off1, size_t value_off1, size_t hash_off1,
+    struct _hashtable_state *HASHTABLE_RESTRICT state, size_t bucket_size, size_t key_off1, size_t value_off1, size_t hash_off1,
     void *HASHTABLE_RESTRICT key, size_t key_size, size_t hash, void *HASHTABLE_RESTRICT value,
     size_t value_size,
     int (*compare_keys)(const void *a, const void *b, size_t size),
     int (*copy_key)(void *dst, const void *src, size_t size))
 {
     int err;
-    void *ret = _hashtable_insert(&err, buckets, num_buckets, num_values,
-        bucket_size, key_off1, value_off1, hash_off1, key, key_size, hash,
+    void *ret = _hashtable_insert_impl(&err, buckets, num_buckets, num_values,
+        state, bucket_size, key_off1, value_off1, hash_off1, key, key_size, hash,
         value, value_size, compare_keys, copy_key);
     if (err)
         hashtable_panic();
     return ret;
 }
 
+#ifdef HASHTABLE_CONCURRENT
+  #if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+      #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+    typedef SRWLOCK _hashtable_lock_t;
+    static inline int _hashtable_lock_init(_hashtable_lock_t *lock)
+        {InitializeSRWLock(lock); return 0;}
+    static inline void _hashtable_lock_destroy(_hashtable_lock_t *lock)
+        {(void)lock;}
+    static inline void _hashtable_lock(_hashtable_lock_t *lock)
+        {AcquireSRWLockExclusive(lock);}
+    static inline void _hashtable_unlock(_hashtable_lock_t *lock)
+        {ReleaseSRWLockExclusive(lock);}
+  #else
+    #include <pthread.h>
+    typedef pthread_mutex_t _hashtable_lock_t;
+    static inline int _hashtable_lock_init(_hashtable_lock_t *lock)
+        {return pthread_mutex_init(lock, 0);}
+    static inline void _hashtable_lock_destroy(_hashtable_lock_t *lock)
+        {pthread_mutex_destroy(lock);}
+    static inline void _hashtable_lock(_hashtable_lock_t *lock)
+        {pthread_mutex_lock(lock);}
+    static inline void _hashtable_unlock(_hashtable_lock_t *lock)
+        {pthread_mutex_unlock(lock);}
+  #endif
+
+  #define HASHTABLE_CACHE_LINE 64
+  #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+    #define HASHTABLE_CACHE_ALIGNED _Alignas(HASHTABLE_CACHE_LINE)
+  #else
+    #define HASHTABLE_CACHE_ALIGNED
+  #endif
+
+  #define _hashtable_cache_lines(size) \
+    (((size) + HASHTABLE_CACHE_LINE - 1) / HASHTABLE_CACHE_LINE * \
+        HASHTABLE_CACHE_LINE)
+
+/* Shards are selected by the top 16 bits of the mixed hash, leaving the low
+ * bits to select buckets within the shard. */
+static HASHTABLE_FORCE_INLINE size_t _hashtable_shard_index(size_t hash,
+    size_t num_shards)
+{
+    size_t high = _hashtable_mix(hash) >> (sizeof(size_t) * 8 - 16);
+    return high * num_shards >> 16;
+}
+
+/* Sequence counter of hashtable_define_read_mostly() tables. Odd while a
+ * writer modifies the table. Readers only load it, before and after reading
+ * the table, and retry if it was odd or changed. */
+  #if defined(_MSC_VER) && !defined(__clang__)
+    typedef volatile LONG_PTR _hashtable_seq_t;
+    #define _hashtable_cpu_relax() YieldProcessor()
+    static inline size_t _hashtable_read_begin(_hashtable_seq_t *seq)
+    {
+        size_t ret = (size_t)*seq;
+        MemoryBarrier();
+        return ret;
+    }
+    static inline int _hashtable_read_retry(_hashtable_seq_t *seq, size_t start)
+        {MemoryBarrier(); return (size_t)*seq != start;}
+    static inline void _hashtable_write_begin(_hashtable_seq_t *seq)
+        {InterlockedIncrementAcquire(seq);}
+    static inline void _hashtable_write_end(_hashtable_seq_t *seq)
+        {InterlockedIncrementRelease(seq);}
+  #else
+    typedef size_t _hashtable_seq_t;
+    #if defined(__x86_64__) || defined(__i386__)
+      #define _hashtable_cpu_relax() __builtin_ia32_pause()
+    #elif defined(__aarch64__)
+      #define _hashtable_cpu_relax() __asm__ __volatile__("yield")
+    #else
+      #define _hashtable_cpu_relax() ((void)0)
+    #endif
+    static inline size_t _hashtable_read_begin(_hashtable_seq_t *seq)
+        {return __atomic_load_n(seq, __ATOMIC_ACQUIRE);}
+    static inline int _hashtable_read_retry(_hashtable_seq_t *seq, size_t start)
+    {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+    }
+    static inline void _hashtable_write_begin(_hashtable_seq_t *seq)
+    {
+        __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    static inline void _hashtable_write_end(_hashtable_seq_t *seq)
+        {__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);}
+  #endif
+
+  #define HASHTABLE_MAX_THREADS     64
+  #define HASHTABLE_PARALLEL_ALIGN  64
+
+/* A range of hashtable_parallel_for() and the call it is handled by */
+struct _hashtable_parallel_range {
+    void        (*fn)(void *ctx, size_t begin, size_t end, unsigned thread);
+    void        *ctx;
+    size_t      begin;
+    size_t      end;
+    unsigned    thread;
+};
+
+static inline void _hashtable_parallel_run(
+    const struct _hashtable_parallel_range *range)
+    {range->fn(range->ctx, range->begin, range->end, range->thread);}
+
+  #if defined(_WIN32)
+    typedef HANDLE _hashtable_thread_t;
+    static DWORD WINAPI _hashtable_parallel_main(LPVOID arg)
+        {_hashtable_parallel_run(arg); return 0;}
+    static inline int _hashtable_thread_start(_hashtable_thread_t *thread,
+        struct _hashtable_parallel_range *range)
+    {
+        *thread = CreateThread(0, 0, _hashtable_parallel_main, range, 0, 0);
+        return *thread ? 0 : 1;
+    }
+    static inline void _hashtable_thread_join(_hashtable_thread_t *thread)
+        {WaitForSingleObject(*thread, INFINITE); CloseHandle(*thread);}
+    static inline unsigned _hashtable_num_cpus(void)
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (unsigned)info.dwNumberOfProcessors;
+    }
+  #else
+    #include <unistd.h>
+    typedef pthread_t _hashtable_thread_t;
+    static void *_hashtable_parallel_main(void *arg)
+        {_hashtable_parallel_run(arg); return 0;}
+    static inline int _hashtable_thread_start(_hashtable_thread_t *thread,
+        struct _hashtable_parallel_range *range)
+        {return pthread_create(thread, 0, _hashtable_parallel_main, range);}
+    static inline void _hashtable_thread_join(_hashtable_thread_t *thread)
+        {pthread_join(*thread, 0);}
+    static inline unsigned _hashtable_num_cpus(void)
+    {
+        long ret = sysconf(_SC_NPROCESSORS_ONLN);
+        return ret > 0 ? (unsigned)ret : 1;
+    }
+  #endif
+
+static inline void hashtable_parallel_for(size_t end, unsigned num_threads,
+    void (*fn)(void *ctx, size_t begin, size_t end, unsigned thread),
+    void *ctx)
+{
+    struct _hashtable_parallel_range    ranges[HASHTABLE_MAX_THREADS];
+    _hashtable_thread_t                 threads[HASHTABLE_MAX_THREADS];
+    int                                 started[HASHTABLE_MAX_THREADS];
+    if (!num_threads)
+        num_threads = _hashtable_num_cpus();
+    if (num_threads > HASHTABLE_MAX_THREADS)
+        num_threads = HASHTABLE_MAX_THREADS;
+    size_t size = (end / num_threads + HASHTABLE_PARALLEL_ALIGN) &
+        ~(size_t)(HASHTABLE_PARALLEL_ALIGN - 1);
+    for (unsigned i = 0; i < num_threads; ++i) {
+        size_t begin = i ? ranges[i - 1].end : 0;
+        ranges[i].fn        = fn;
+        ranges[i].ctx       = ctx;
+        ranges[i].begin     = begin;
+        ranges[i].end       = end - begin > size ? begin + size : end;
+        ranges[i].thread    = i;
+        started[i] = i && begin < end &&
+            !_hashtable_thread_start(&threads[i], &ranges[i]);
+    }
+    for (unsigned i = 0; i < num_threads; ++i) {
+        if (started[i])
+            _hashtable_thread_join(&threads[i]);
+        else if (ranges[i].begin < ranges[i].end)
+            _hashtable_parallel_run(&ranges[i]);
+    }
+}
+#endif
+
+/* Constants of the wyhash family of hash functions */
+#define HASHTABLE_HASH_P0 0xA0761D6478BD642FULL
+#define HASHTABLE_HASH_P1 0xE7037ED1A0B428DBULL
+#define HASHTABLE_HASH_P2 0x8EBC6AF09C88C6E3ULL
+#define HASHTABLE_HASH_P3 0x589965CC75374CC3ULL
+
+/* Multiply two 64-bit values and fold the 128-bit product by xoring its
+ * halves. */
+static HASHTABLE_FORCE_INLINE uint64_t _hashtable_mum(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64) && !defined(__clang__)
+    uint64_t hi;
+    uint64_t lo = _umul128(a, b, &hi);
+    return lo ^ hi;
+#else
+    uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t  = rl + (rm0 << 32);
+    uint64_t c  = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    return lo ^ hi;
+#endif
+}
+
+size_t _hashtable_hash_bytes(const void *key, size_t size);
+
+/* A hash of 0 marks a free bucket, so the one key hashing to it gets 1 */
+static inline size_t hashtable_hash_u64(uint64_t key)
+{
+    size_t hash = (size_t)_hashtable_mum(key ^ HASHTABLE_HASH_P0,
+        HASHTABLE_HASH_P1);
+    return hash | !hash;
+}
+
+static inline size_t hashtable_hash_u32(uint32_t key)
+    {return hashtable_hash_u64(key);}
+
+static inline size_t hashtable_hash(const void *key, size_t size)
+{
+    if (size == sizeof(uint32_t)) {
+        uint32_t k;
+        memcpy(&k, key, sizeof(k));
+        return hashtable_hash_u32(k);
+    }
+    if (size == sizeof(uint64_t)) {
+        uint64_t k;
+        memcpy(&k, key, sizeof(k));
+        return hashtable_hash_u64(k);
+    }
+    return _hashtable_hash_bytes(key, size);
+}
+
+static inline size_t hashtable_str_view_hash(const void *key, size_t size)
+{
+    const struct hashtable_str_view *view = key;
+    (void)size;
+    return _hashtable_hash_bytes(view->data, view->len);
+}
+
+static inline int hashtable_str_view_compare(const void *a, const void *b,
+    size_t size)
+{
+    const struct hashtable_str_view *x = a;
+    const struct hashtable_str_view *y = b;
+    (void)size;
+    if (x->len != y->len)
+        return 1;
+    return x->len ? memcmp(x->data, y->data, x->len) : 0;
+}
+
+static inline int hashtable_str_compare_view(const void *a, const void *b,
+    size_t size)
+{
+    const char                      *str;
+    const struct hashtable_str_view *view = b;
+    (void)size;
+    memcpy(&str, a, sizeof(str));
+    /* The string may be shorter than the view, so stop at its null */
+    for (size_t i = 0; i < view->len; ++i) {
+        if (!str[i] || str[i] != view->data[i])
+            return 1;
+    }
+    return str[view->len] != 0;
+}
+
 #endif